@@ -31,10 +31,12 @@
 #define _FATFS_H
 
 #include <vfscore/vnode.h>
+#include <uk/list.h>
 #include <sys/types.h>
 #include <sys/file.h>
 #include <sys/mount.h>
 #include <stdint.h>
+#include <time.h>
 
 #define DPRINTF(a)	uk_pr_debug a
 
@@ -101,7 +103,12 @@ struct fat_bpb {
 struct fat_dirent {
 	__u8	name[11];
 	__u8	attr;
-	__u8	reserve[10];
+	__u8	ntres;			/* reserved for NT */
+	__u8	ctime_ms;		/* creation time, 10ms units 0-199 */
+	__u16	ctime;			/* creation time */
+	__u16	cdate;			/* creation date */
+	__u16	adate;			/* last access date */
+	__u16	cluster_hi;		/* high word of cluster#, FAT32 */
 	__u16	time;
 	__u16	date;
 	__u16	cluster;
@@ -135,6 +142,223 @@ struct fat_dirent {
 #define IS_DELETED(de)  ((de)->name[0] == 0xe5)
 #define IS_EMPTY(de)    ((de)->name[0] == 0)
 
+/*
+ * Timestamps set by fat_stamp()
+ */
+#define STAMP_CREATE	0x01		/* creation time and date */
+#define STAMP_MODIFY	0x02		/* modification time and date */
+#define STAMP_ACCESS	0x04		/* last access date */
+
+/*
+ * VFAT long file name entry
+ *
+ * The entries of a long name are placed just before its short name
+ * entry, last part first. They look like volume labels to the code
+ * which does not know them.
+ */
+struct fat_lfn_dirent {
+	__u8	ord;			/* sequence#, LFN_LAST on last part */
+	__u8	name1[10];		/* characters 1-5 */
+	__u8	attr;			/* FA_LFN */
+	__u8	type;			/* 0 */
+	__u8	csum;			/* checksum of short name */
+	__u8	name2[12];		/* characters 6-11 */
+	__u16	cluster;		/* 0 */
+	__u8	name3[4];		/* characters 12-13 */
+} __packed;
+
+#define FA_LFN		0x0f		/* attr of long name entry */
+#define IS_LFN(de)	(((de)->attr & 0x3f) == FA_LFN)
+
+#define LFN_LAST	0x40		/* last part of long name */
+#define LFN_ORD_MASK	0x1f
+#define LFN_CHARS	13		/* UCS-2 characters per entry */
+#define LFN_ENTRIES	20		/* max entries per name */
+#define LFN_MAX		255		/* max characters of long name */
+#define SFN_TAIL_MAX	999		/* max numeric tail of short name */
+
+/*
+ * Location of long name entries
+ */
+struct fatfs_lfnpos {
+	__u32	cluster;		/* cluster# of first entry */
+	__u32	sector;			/* sector# of first entry */
+	__u32	offset;			/* offset of first entry in sector */
+	int	nr;			/* number of entries, 0 if no long name */
+};
+
+/*
+ * Long name being collected from directory entries
+ */
+struct fat_lfn {
+	__u16	name[LFN_ENTRIES * LFN_CHARS]; /* UCS-2 characters */
+	struct fatfs_lfnpos pos;	/* entries collected, nr is 0 if none */
+	int	next;			/* sequence# expected next */
+	__u8	csum;			/* checksum of short name */
+};
+
+/*
+ * Name index entry of a directory
+ */
+struct fatfs_index {
+	struct fat_dirent dirent;	/* copy of directory entry */
+	__u32	sector;			/* sector# for directory entry, 0 if unused */
+	__u32	offset;			/* offset of directory entry in sector */
+	struct fatfs_lfnpos lfn;	/* long name entries */
+	__u32	lhash;			/* hash of long name in lindex, or 0 */
+};
+
+/*
+ * Long name index entry of a directory
+ */
+struct fatfs_lindex {
+	__u32	hash;			/* fat_hash_lname() of name, 0 if unused */
+	char	*name;			/* long name in UTF-8 */
+	__u8	sfn[11];		/* short name to find in the name index */
+};
+
+/*
+ * Slots of a directory sector, one bit per entry
+ */
+struct fat_slotmap {
+	__u16	match;			/* name matches the key */
+	__u16	empty;			/* end of directory */
+	__u16	deleted;		/* deleted entry */
+	__u16	vol;			/* volume label */
+};
+
+#define FAT_KEY_SIZE	16		/* size of name key to scan */
+
+/*
+ * Location of directory entry
+ */
+struct fatfs_slot {
+	__u32	sector;			/* sector# */
+	__u32	offset;			/* offset in sector */
+};
+
+#define DIR_FREE_MAX	32		/* max free slots kept per directory */
+
+/*
+ * Run of contiguous directory sectors read ahead
+ */
+struct fatfs_run {
+	__u32	sector;			/* first sector# */
+	__u32	count;			/* number of sectors */
+};
+
+#define DIR_RA_RUNS	16		/* max runs of directory read-ahead */
+#define ZERO_MAX	(64 * 1024)	/* max bytes cleared by one request */
+
+/*
+ * In-memory directory data
+ */
+struct fatfs_dir {
+	struct fatfs_dir	*next;		/* next directory in hash chain */
+	__u32			cluster;	/* first cluster# of directory */
+	__u32			stamp;		/* last access, for LRU replacement */
+	__u32			gen;		/* generation of entry layout */
+	int			flags;		/* directory flags */
+	__u32			nr_index;	/* number of indexed entries */
+	__u32			index_mask;	/* size of index table - 1 */
+	struct fatfs_index	*index;		/* name index, NULL if not built */
+	__u32			nr_lindex;	/* number of long names indexed */
+	__u32			lindex_mask;	/* size of lindex table - 1 */
+	struct fatfs_lindex	*lindex;	/* long name index */
+	__u32			bloom_mask;	/* number of filter bits - 1 */
+	__u32			bloom_free;	/* names to add before rebuild */
+	__u8			*bloom;		/* Bloom filter of names */
+	__u32			last_cl;	/* last cluster#, if eod is invalid */
+	__u32			eod_cl;		/* cluster# of eod */
+	struct fatfs_slot	eod;		/* end of directory, or SEC_INVAL */
+	int			nr_free;	/* number of known free slots */
+	struct fatfs_slot	free[DIR_FREE_MAX]; /* deleted slots to reuse */
+	__u32			nr_live;	/* entries in use */
+	__u32			nr_deleted;	/* deleted entries */
+	__u32			*chain;		/* cluster chain for binary search */
+	__u32			nr_chain;	/* number of clusters in chain */
+};
+
+#define DIR_NOINDEX	0x01		/* too many entries to index */
+#define DIR_SEEDING	0x02		/* index is being filled by readdir */
+#define DIR_EOD		0x04		/* eod and free slots are known */
+#define DIR_COUNTED	0x08		/* nr_live and nr_deleted are valid */
+#define DIR_SORTED	0x10		/* names are in ascending order */
+#define DIR_MARKED	0x20		/* sorted marker has been checked */
+
+/*
+ * A volume label entry with this name in the first sector of a
+ * directory marks its names as sorted. Lookups in such directories
+ * on read-only mounts are done by binary search without a full scan.
+ */
+#define SORTED_MARK	"SORTED     "
+
+#define DIR_HASH_SIZE	32		/* buckets of directory hash */
+#define DIR_CACHE_MAX	64		/* max directories kept in memory */
+
+/*
+ * Pool of fixed size objects. Free objects are linked by their
+ * first word.
+ */
+struct fatfs_pool {
+	size_t	size;			/* object size */
+	void	*free;			/* free objects */
+	__u32	nr_free;		/* number of free objects */
+	__u32	max_free;		/* free objects to keep */
+	char	*block;			/* objects allocated at once */
+	__u32	nr_block;		/* number of objects in block */
+};
+
+#define POOL_KEEP	64		/* free objects kept at least */
+
+/*
+ * Pool of I/O buffers of one size, aligned for the device. Free
+ * buffers are linked by their first word. The pool has its own lock,
+ * so that buffers are taken without any other lock held.
+ */
+struct fatfs_bufpool {
+	size_t	size;			/* buffer size */
+	size_t	align;			/* buffer alignment */
+	void	*free;			/* free buffers */
+	__u32	nr_free;		/* number of free buffers */
+	__u32	max_free;		/* free buffers to keep */
+#ifdef CONFIG_LIBUKSCHED
+	struct uk_mutex lock;		/* free list lock */
+#endif
+};
+
+/*
+ * Path cache entry
+ */
+struct fatfs_pathent {
+	__u32	hash;			/* hash of base and path, 0 if unused */
+	__u32	gen;			/* path generation when cached */
+	__u32	base;			/* cluster# of base directory */
+	char	*path;			/* path from base directory */
+	__u32	cluster;		/* first cluster# of entry */
+	__u8	attr;			/* attribute of entry */
+	__u32	dcluster;		/* cluster# of parent directory */
+	__u32	sector;			/* sector# for directory entry */
+	__u32	offset;			/* offset of directory entry in sector */
+	struct fatfs_lfnpos lfn;	/* long name entries */
+};
+
+/*
+ * Locks are taken in this order, never the other way:
+ *
+ *  fatfs_node.lock	data and size of a file, held over the data I/O
+ *			of read, write and truncate
+ *  fatfsmount.lock	directory entries, fat nodes and the directory
+ *			caches, with dir_buf and ra_buf
+ *  fatfsmount.fat_lock	FAT entries, fat_buf and the free cluster scan
+ *  fatfs_bufpool.lock	free list of an I/O buffer pool
+ *
+ * The fields of a fat node which go to its directory entry are
+ * changed with fatfsmount.lock held. The chain of a file removed
+ * while a vnode holds it is freed when the last such vnode goes, so
+ * a writer never needs the lock of another node.
+ */
+
 /*
  * Mount data
  */
@@ -150,12 +374,36 @@ struct fatfsmount {
 	__u32			fat_mask;	/* mask for cluster# */
 	__u32			free_scan;	/* start cluster# to free search */
 	struct vnode		*root_vnode;	/* vnode for root */
-	char			*io_buf;	/* local data buffer */
 	char			*fat_buf;	/* buffer for fat entry */
+	__u32			fat_sec;	/* first sector# held in fat_buf */
+	__u32			fat_nr;		/* number of sectors in fat_buf */
+	int			fat_dirty;	/* fat_buf is not written yet */
 	char			*dir_buf;	/* buffer for directory entry */
+	__u32			dir_sec;	/* sector# held in dir_buf */
+	int			dir_dirty;	/* dir_buf is not written yet */
+	int			batch;		/* nesting of deferred writes */
 	struct uk_blkdev	*dev;		/* mounted device */
+	struct fatfs_dir	*dir_hash[DIR_HASH_SIZE]; /* directory data */
+	int			nr_dirs;	/* number of directory data */
+	__u32			dir_clock;	/* clock for directory LRU */
+	__u32			dir_gen;	/* last directory generation */
+	struct uk_list_head	nodes;		/* nodes of looked up vnodes */
+	__u64			ino_gen;	/* last inode number made up */
+	char			*ra_buf;	/* directory read-ahead buffer */
+	__u32			ra_dir;		/* cluster# of directory read ahead */
+	int			nr_ra;		/* number of runs read ahead */
+	struct fatfs_run	ra_run[DIR_RA_RUNS]; /* sectors in ra_buf */
+	struct fatfs_pool	node_pool;	/* fatfs nodes */
+	struct fatfs_pool	pos_pool;	/* readdir positions */
+	struct fatfs_bufpool	sec_bufs;	/* sector I/O buffers */
+	struct fatfs_bufpool	cl_bufs;	/* cluster I/O buffers */
+	struct fatfs_pathent	*path_cache;	/* path cache, NULL if empty */
+	__u32			path_gen;	/* bumped on remove and rename */
+	struct fatfs_dirusage	**usage;	/* usage by directory, or NULL */
+	__u32			nr_usage;	/* number of usage records */
 #ifdef CONFIG_LIBUKSCHED
-	struct uk_mutex		lock;		/* file system lock */
+	struct uk_mutex		lock;		/* directory and node lock */
+	struct uk_mutex		fat_lock;	/* FAT allocator lock */
 #endif
 };
 
@@ -165,13 +413,64 @@ struct fatfsmount {
 #define IS_EOFCL(fat, cl) \
 	(((cl) & EOF_MASK) == ((fat)->fat_mask & EOF_MASK))
 
+/*
+ * Run of clusters contiguous on disk in a file
+ */
+struct fatfs_extent {
+	__u32	index;			/* cluster index in file */
+	__u32	cluster;		/* first cluster# */
+	__u32	count;			/* number of clusters */
+};
+
+#define NODE_EXT_MAX	8		/* runs of the chain kept per node */
+#define NODE_READ_RETRY	4		/* lock-free tries of a read chunk */
+
 /*
  * File/directory node
+ *
+ * Readers of file data take no lock. They check the size, the chain
+ * and the removal of the node with its sequence count, which is odd
+ * while they change. The count is changed with fatfsmount.lock held.
  */
 struct fatfs_node {
 	struct fat_dirent dirent; 	/* copy of directory entry */
 	__u32	sector;			/* sector# for directory entry */
 	__u32	offset;			/* offset of directory entry in sector */
+	__u32	dcluster;		/* cluster# of parent directory */
+	struct fatfs_lfnpos lfn;	/* long name entries */
+	struct uk_list_head link;	/* link in fatfsmount.nodes */
+	__u64	ino;			/* inode number of the vnode */
+	int	dirty;			/* size or times not written yet */
+	int	orphan;			/* chain freed when released */
+	__u32	seq;			/* odd while size or chain change */
+	__u32	nr_ext;			/* runs known from the file start */
+	__u32	ext_next;		/* cluster# after the last run */
+	struct fatfs_extent ext[NODE_EXT_MAX]; /* runs of the chain */
+#ifdef CONFIG_LIBUKSCHED
+	struct uk_mutex lock;		/* file data lock */
+#endif
+};
+
+/* Node of a vnode whose entry was removed with FATFS_IOC_RMTREE */
+#define NODE_REMOVED(np)	IS_DELETED(&(np)->dirent)
+
+struct fatfs_walk;
+struct fatfs_scan;
+struct fatfs_handle;
+struct fatfs_dirusage;
+struct fatfs_usage;
+
+/*
+ * Position in directory, kept by readdir across calls
+ */
+struct fatfs_dirpos {
+	int	index;			/* index of next entry */
+	__u32	cluster;		/* cluster# of last entry */
+	__u32	sector;			/* sector# of last entry, or SEC_INVAL */
+	__u32	slot;			/* slot of last entry in sector */
+	__u32	gen;			/* directory generation */
+	int	seed;			/* filling the name index */
+	struct fatfs_walk *walk;	/* subtree scan, or NULL */
 };
 
 extern struct vnops fatfs_vnops;
@@ -182,23 +481,134 @@ extern struct vnops fatfs_vnops;
 
 int	 fat_next_cluster(struct fatfsmount *fmp, __u32 cl, __u32 *next);
 int	 fat_set_cluster(struct fatfsmount *fmp, __u32 cl, __u32 next);
-int	 fat_alloc_cluster(struct fatfsmount *fmp, __u32 scan_start, __u32 *free);
+int	 fat_new_cluster(struct fatfsmount *fmp, __u32 *free);
+int	 fat_alloc_clusters(struct fatfsmount *fmp, __u32 nr, __u32 *cls);
 int	 fat_free_clusters(struct fatfsmount *fmp, __u32 start);
 int	 fat_seek_cluster(struct fatfsmount *fmp, __u32 start, __u32 offset,
 			    __u32 *cl);
 int	 fat_expand_file(struct fatfsmount *fmp, __u32 *cl, __u32 size);
 int	 fat_expand_dir(struct fatfsmount *fmp, __u32 cl, __u32 *new_cl);
+int	 fat_flush(struct fatfsmount *fmp);
 
 void	 fat_convert_name(char *org, char *name);
 void	 fat_restore_name(char *org, char *name);
 int	 fat_valid_name(char *name);
 int	 fat_compare_name(char *n1, char *n2);
+__u32	 fat_hash_name(char *name);
 void	 fat_mode_to_attr(mode_t mode, unsigned char *attr);
 void	 fat_attr_to_mode(unsigned char attr, mode_t *mode);
+time_t	 fat_time_to_unix(__u16 date, __u16 time);
+void	 fat_unix_to_time(time_t t, __u16 *date, __u16 *time);
+int	 fat_stamp(struct fat_dirent *de, int flags);
+void	 fat_make_key(char *name, char *key);
+
+int	 fat_valid_lname(char *name);
+__u32	 fat_hash_lname(char *name);
+int	 fat_utf8_to_ucs2(const char *src, __u16 *dst, int max, int *len);
+int	 fat_ucs2_to_utf8(const __u16 *src, int len, char *dst, size_t size);
+__u8	 fat_lfn_checksum(__u8 *sfn);
+void	 fat_lfn_reset(struct fat_lfn *lfn);
+void	 fat_lfn_add(struct fat_lfn *lfn, struct fat_dirent *de, __u32 cl,
+		     __u32 sec, __u32 offset);
+int	 fat_lfn_check(struct fat_lfn *lfn, struct fat_dirent *de);
+int	 fat_lfn_name(struct fat_lfn *lfn, char *buf, size_t size);
+int	 fat_lfn_build(char *name, __u8 *sfn, struct fat_dirent *ent, int *nr);
+void	 fat_make_sfn(char *name, int tail, char *sfn);
+void	 fat_scan_sector(const char *buf, const char *key,
+			 struct fat_slotmap *map);
 
+void	 fatfs_ra_invalidate(struct fatfsmount *fmp, __u32 sec, __u32 nr);
+int	 fatfs_flush_dirent(struct fatfsmount *fmp);
+void	 fatfs_batch_begin(struct fatfsmount *fmp);
+int	 fatfs_batch_end(struct fatfsmount *fmp);
 int	 fatfs_lookup_node(struct vnode *dvp, char *name, struct fatfs_node *node);
 int	 fatfs_get_node(struct vnode *dvp, int index, struct fatfs_node *node);
+int	 fatfs_read_node(struct vnode *dvp, struct fatfs_dirpos *pos,
+			 struct fatfs_node *node, char *lname);
 int	 fatfs_put_node(struct fatfsmount *fmp, struct fatfs_node *node);
 int	 fatfs_add_node(struct vnode *dvp, struct fatfs_node *node);
+int	 fatfs_add_long(struct vnode *dvp, struct fatfs_node *node, char *name,
+			struct fatfs_node *self);
+int	 fatfs_add_name(struct vnode *dvp, struct fatfs_node *node, char *name);
+int	 fatfs_del_lfn(struct fatfsmount *fmp, struct fatfs_node *node);
+int	 fatfs_compact_node(struct vnode *dvp);
+__u64	 fatfs_node_ino(struct fatfs_node *node);
+int	 fatfs_reload_node(struct fatfsmount *fmp, struct fatfs_node *node);
+int	 fatfs_find_lfn(struct fatfsmount *fmp, struct fatfs_node *node);
+int	 fatfs_sync_node(struct fatfsmount *fmp, struct fatfs_node *node);
+void	 fatfs_drop_node(struct fatfsmount *fmp, struct fatfs_node *node,
+			 struct fat_dirent *de);
+int	 fatfs_sync_nodes(struct fatfsmount *fmp);
+__u32	 fatfs_node_read_begin(struct fatfs_node *node);
+int	 fatfs_node_read_retry(struct fatfs_node *node, __u32 seq);
+void	 fatfs_node_write_begin(struct fatfs_node *node);
+void	 fatfs_node_write_end(struct fatfs_node *node);
+void	 fatfs_node_trim(struct fatfs_node *node);
+void	 fatfs_node_gone(struct fatfs_node *node);
+struct fatfs_node *fatfs_nodes_gone(struct fatfsmount *fmp,
+				    struct fatfs_node *node);
+int	 fatfs_remove_chain(struct fatfsmount *fmp, struct fatfs_node *node);
+int	 fatfs_free_orphan(struct fatfsmount *fmp, struct fatfs_node *node);
+int	 fatfs_node_find_ext(struct fatfs_node *node, __u32 index,
+			     struct fatfs_extent *ext);
+int	 fatfs_node_map(struct fatfsmount *fmp, struct fatfs_node *node,
+			__u32 index, struct fatfs_extent *ext);
+struct fatfs_node *fatfs_node_alloc(struct fatfsmount *fmp);
+void	 fatfs_node_free(struct fatfsmount *fmp, struct fatfs_node *node);
+void	 fatfs_node_moved(struct fatfsmount *fmp, struct fatfs_node *from,
+			  struct fatfs_node *to);
+
+void	 fatfs_dir_init(struct fatfsmount *fmp);
+void	 fatfs_dir_cleanup(struct fatfsmount *fmp);
+struct fatfs_dir *fatfs_dir_find(struct fatfsmount *fmp, __u32 cl);
+struct fatfs_dir *fatfs_dir_get(struct fatfsmount *fmp, __u32 cl);
+void	 fatfs_dir_drop(struct fatfsmount *fmp, __u32 cl);
+void	 fatfs_dir_release(struct fatfsmount *fmp, __u32 cl);
+struct fatfs_index *fatfs_index_lookup(struct fatfs_dir *dp, char *name);
+int	 fatfs_index_add(struct fatfs_dir *dp, struct fat_dirent *de,
+			 __u32 sec, __u32 offset, struct fatfs_lfnpos *lfn);
+void	 fatfs_index_free(struct fatfs_dir *dp);
+void	 fatfs_index_seed(struct fatfsmount *fmp, struct fatfs_dirpos *pos,
+			  struct fatfs_node *np, char *lname, int error);
+struct fatfs_index *fatfs_lindex_lookup(struct fatfs_dir *dp, char *name);
+int	 fatfs_lindex_add(struct fatfs_dir *dp, char *name, __u8 *sfn);
+int	 fatfs_bloom_init(struct fatfs_dir *dp, __u32 *hash, __u32 nr);
+int	 fatfs_bloom_test(struct fatfs_dir *dp, __u32 hash);
+void	 fatfs_bloom_free(struct fatfs_dir *dp);
+void	 fatfs_dir_update(struct fatfsmount *fmp, struct fat_dirent *old,
+			  struct fatfs_node *np);
+void	 fatfs_dir_add_lname(struct fatfsmount *fmp, struct fatfs_node *np,
+			     char *name);
+void	 fatfs_dir_del_lname(struct fatfsmount *fmp, struct fatfs_node *np);
+
+int	 fatfs_pool_init(struct fatfs_pool *pool, size_t size, __u32 prealloc,
+			 __u32 max_free);
+void	 fatfs_pool_destroy(struct fatfs_pool *pool);
+void	*fatfs_pool_get(struct fatfs_pool *pool);
+void	 fatfs_pool_put(struct fatfs_pool *pool, void *obj);
+int	 fatfs_bufpool_init(struct fatfs_bufpool *pool, size_t size,
+			    size_t align, __u32 prealloc, __u32 max_free);
+void	 fatfs_bufpool_destroy(struct fatfs_bufpool *pool);
+void	*fatfs_buf_get(struct fatfs_bufpool *pool);
+void	 fatfs_buf_put(struct fatfs_bufpool *pool, void *buf);
+
+int	 fatfs_path_lookup(struct vnode *dvp, const char *path,
+			   struct fatfs_node *node);
+void	 fatfs_path_cleanup(struct fatfsmount *fmp);
+void	 fatfs_handle_make(struct fatfs_node *node, struct fatfs_handle *fh);
+int	 fatfs_handle_lookup(struct vnode *vp, struct fatfs_handle *fh,
+			     struct fatfs_node *node);
+
+int	 fatfs_rmtree(struct vnode *dvp, char *name, size_t *nr);
+int	 fatfs_scan(struct vnode *dvp, struct fatfs_dirpos *pos,
+		    struct fatfs_scan *sc);
+void	 fatfs_scan_free(struct fatfs_walk *walk);
+
+void	 fatfs_usage_change(struct fatfsmount *fmp, __u32 dcl,
+			    struct fat_dirent *old, struct fat_dirent *new);
+int	 fatfs_usage_get(struct vnode *dvp, struct fatfs_usage *u);
+void	 fatfs_usage_release(struct fatfsmount *fmp, __u32 cl);
+void	 fatfs_usage_move(struct fatfsmount *fmp, __u32 cl, __u32 dcl);
+void	 fatfs_usage_cleanup(struct fatfsmount *fmp);
 
 #endif /* !_FATFS_H */
@@ -0,0 +1,837 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "fatfs.h"
+
+#define INDEX_MIN	64		/* initial size of name index */
+#define LINDEX_MIN	16		/* initial size of long name index */
+
+#define BLOOM_BITS	10		/* filter bits per name */
+#define BLOOM_HASHES	5		/* bits set per name */
+#define BLOOM_MIN	512		/* minimum filter bits */
+
+#define DIR_HASH(cl)	((cl) & (DIR_HASH_SIZE - 1))
+
+/*
+ * Check if the directory entry can be found by name.
+ */
+#define IS_NAMED(de)	(!IS_EMPTY(de) && !IS_DELETED(de) && !IS_VOL(de))
+
+/*
+ * Initialize directory data of the mount point.
+ */
+void
+fatfs_dir_init(struct fatfsmount *fmp)
+{
+	memset(fmp->dir_hash, 0, sizeof(fmp->dir_hash));
+	fmp->nr_dirs = 0;
+	fmp->dir_clock = 0;
+	fmp->dir_gen = 0;
+}
+
+static void
+dir_free(struct fatfs_dir *dp)
+{
+	fatfs_index_free(dp);
+	fatfs_bloom_free(dp);
+	free(dp->chain);
+	free(dp);
+}
+
+/*
+ * Release all directory data of the mount point.
+ */
+void
+fatfs_dir_cleanup(struct fatfsmount *fmp)
+{
+	struct fatfs_dir *dp, *next;
+	int i;
+
+	for (i = 0; i < DIR_HASH_SIZE; i++) {
+		for (dp = fmp->dir_hash[i]; dp != NULL; dp = next) {
+			next = dp->next;
+			dir_free(dp);
+		}
+		fmp->dir_hash[i] = NULL;
+	}
+	fmp->nr_dirs = 0;
+}
+
+/*
+ * Unlink directory data from the hash chain and free it.
+ */
+static void
+dir_remove(struct fatfsmount *fmp, struct fatfs_dir *dp)
+{
+	struct fatfs_dir **dpp;
+
+	for (dpp = &fmp->dir_hash[DIR_HASH(dp->cluster)]; *dpp != NULL;
+	     dpp = &(*dpp)->next) {
+		if (*dpp == dp) {
+			*dpp = dp->next;
+			fmp->nr_dirs--;
+			dir_free(dp);
+			return;
+		}
+	}
+}
+
+/*
+ * Drop the least recently used directory data.
+ */
+static void
+dir_reclaim(struct fatfsmount *fmp)
+{
+	struct fatfs_dir *dp, *victim = NULL;
+	int i;
+
+	for (i = 0; i < DIR_HASH_SIZE; i++) {
+		for (dp = fmp->dir_hash[i]; dp != NULL; dp = dp->next) {
+			if (victim == NULL ||
+			    (__s32)(dp->stamp - victim->stamp) < 0)
+				victim = dp;
+		}
+	}
+	if (victim != NULL)
+		dir_remove(fmp, victim);
+}
+
+/*
+ * Find directory data for specified cluster.
+ * Return NULL if it is not in memory.
+ */
+struct fatfs_dir *
+fatfs_dir_find(struct fatfsmount *fmp, __u32 cl)
+{
+	struct fatfs_dir *dp;
+
+	for (dp = fmp->dir_hash[DIR_HASH(cl)]; dp != NULL; dp = dp->next) {
+		if (dp->cluster == cl) {
+			dp->stamp = ++fmp->dir_clock;
+			return dp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get directory data for specified cluster, allocating it if needed.
+ * Return NULL if no memory.
+ */
+struct fatfs_dir *
+fatfs_dir_get(struct fatfsmount *fmp, __u32 cl)
+{
+	struct fatfs_dir *dp;
+
+	dp = fatfs_dir_find(fmp, cl);
+	if (dp != NULL)
+		return dp;
+
+	if (fmp->nr_dirs >= DIR_CACHE_MAX)
+		dir_reclaim(fmp);
+
+	dp = calloc(1, sizeof(struct fatfs_dir));
+	if (dp == NULL)
+		return NULL;
+	dp->cluster = cl;
+	dp->stamp = ++fmp->dir_clock;
+	dp->gen = ++fmp->dir_gen;
+	dp->next = fmp->dir_hash[DIR_HASH(cl)];
+	fmp->dir_hash[DIR_HASH(cl)] = dp;
+	fmp->nr_dirs++;
+	return dp;
+}
+
+/*
+ * Forget the cached data of a directory whose entries were written
+ * behind it. Its usage record stays, the usage does not change.
+ */
+void
+fatfs_dir_drop(struct fatfsmount *fmp, __u32 cl)
+{
+	struct fatfs_dir *dp;
+
+	dp = fatfs_dir_find(fmp, cl);
+	if (dp != NULL)
+		dir_remove(fmp, dp);
+}
+
+/*
+ * Forget directory data for specified cluster.
+ * This must be called when the directory clusters are released.
+ */
+void
+fatfs_dir_release(struct fatfsmount *fmp, __u32 cl)
+{
+
+	fatfs_dir_drop(fmp, cl);
+	fatfs_usage_release(fmp, cl);
+}
+
+/*
+ * Find index slot for specified name.
+ * Return the matching slot, or the empty slot to insert the name.
+ */
+static struct fatfs_index *
+index_slot(struct fatfs_index *index, __u32 mask, char *name)
+{
+	struct fatfs_index *ip;
+	__u32 i;
+
+	i = fat_hash_name(name) & mask;
+	for (;;) {
+		ip = &index[i];
+		if (ip->sector == 0)
+			return ip;
+		if (!fat_compare_name((char *)ip->dirent.name, name))
+			return ip;
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Resize the name index table.
+ */
+static int
+index_resize(struct fatfs_dir *dp, __u32 size)
+{
+	struct fatfs_index *index, *ip;
+	__u32 i;
+
+	index = calloc(size, sizeof(struct fatfs_index));
+	if (index == NULL)
+		return ENOMEM;
+
+	if (dp->index != NULL) {
+		for (i = 0; i <= dp->index_mask; i++) {
+			if (dp->index[i].sector == 0)
+				continue;
+			ip = index_slot(index, size - 1,
+					(char *)dp->index[i].dirent.name);
+			*ip = dp->index[i];
+		}
+		free(dp->index);
+	}
+	dp->index = index;
+	dp->index_mask = size - 1;
+	return 0;
+}
+
+/*
+ * Find directory entry in the name index.
+ * Return NULL if the name does not exist in the directory.
+ *
+ * @dp: directory data with a built index
+ * @name: file name in 8.3 format
+ */
+struct fatfs_index *
+fatfs_index_lookup(struct fatfs_dir *dp, char *name)
+{
+	struct fatfs_index *ip;
+
+	ip = index_slot(dp->index, dp->index_mask, name);
+	if (ip->sector == 0)
+		return NULL;
+	return ip;
+}
+
+/*
+ * Add directory entry to the name index.
+ * The index table is allocated on first use.
+ *
+ * @dp: directory data
+ * @de: directory entry
+ * @sec: sector# of directory entry
+ * @offset: offset of directory entry in sector
+ * @lfn: long name entries of directory entry, or NULL
+ */
+int
+fatfs_index_add(struct fatfs_dir *dp, struct fat_dirent *de, __u32 sec,
+		__u32 offset, struct fatfs_lfnpos *lfn)
+{
+	struct fatfs_index *ip;
+	int error;
+
+	if (dp->nr_index >= CONFIG_LIBFATFS_DIRINDEX_MAX)
+		return ENOSPC;
+
+	if (dp->index == NULL) {
+		error = index_resize(dp, INDEX_MIN);
+		if (error)
+			return error;
+	} else if ((dp->nr_index + 1) * 4 > (dp->index_mask + 1) * 3) {
+		error = index_resize(dp, (dp->index_mask + 1) * 2);
+		if (error)
+			return error;
+	}
+
+	ip = index_slot(dp->index, dp->index_mask, (char *)de->name);
+	if (ip->sector == 0) {
+		dp->nr_index++;
+		ip->lhash = 0;
+	}
+	ip->dirent = *de;
+	ip->sector = sec;
+	ip->offset = offset;
+	if (lfn != NULL)
+		ip->lfn = *lfn;
+	else
+		ip->lfn.nr = 0;
+	return 0;
+}
+
+/*
+ * Remove the name index slot, shifting back the following
+ * entries of the probe sequence.
+ */
+static void
+index_remove(struct fatfs_dir *dp, struct fatfs_index *ip)
+{
+	struct fatfs_index *index = dp->index;
+	__u32 mask = dp->index_mask;
+	__u32 i, j, home;
+
+	i = ip - index;
+	j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (index[j].sector == 0)
+			break;
+		home = fat_hash_name((char *)index[j].dirent.name) & mask;
+		/* Move entry j to i unless its home is cyclically in (i, j] */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			index[i] = index[j];
+			i = j;
+		}
+	}
+	index[i].sector = 0;
+	dp->nr_index--;
+}
+
+/*
+ * Find long name index slot for specified name.
+ * Return the matching slot, or the empty slot to insert the name.
+ */
+static struct fatfs_lindex *
+lindex_slot(struct fatfs_lindex *lindex, __u32 mask, __u32 hash, char *name)
+{
+	struct fatfs_lindex *lp;
+	__u32 i;
+
+	i = hash & mask;
+	for (;;) {
+		lp = &lindex[i];
+		if (lp->hash == 0)
+			return lp;
+		if (lp->hash == hash && !strcasecmp(lp->name, name))
+			return lp;
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Resize the long name index table.
+ */
+static int
+lindex_resize(struct fatfs_dir *dp, __u32 size)
+{
+	struct fatfs_lindex *lindex, *lp;
+	__u32 i;
+
+	lindex = calloc(size, sizeof(struct fatfs_lindex));
+	if (lindex == NULL)
+		return ENOMEM;
+
+	if (dp->lindex != NULL) {
+		for (i = 0; i <= dp->lindex_mask; i++) {
+			if (dp->lindex[i].hash == 0)
+				continue;
+			lp = lindex_slot(lindex, size - 1, dp->lindex[i].hash,
+					 dp->lindex[i].name);
+			*lp = dp->lindex[i];
+		}
+		free(dp->lindex);
+	}
+	dp->lindex = lindex;
+	dp->lindex_mask = size - 1;
+	return 0;
+}
+
+/*
+ * Find directory entry by long name in the name index.
+ * Return NULL if the long name does not exist in the directory.
+ *
+ * @dp: directory data with a built index
+ * @name: long file name
+ */
+struct fatfs_index *
+fatfs_lindex_lookup(struct fatfs_dir *dp, char *name)
+{
+	struct fatfs_lindex *lp;
+	struct fatfs_index *ip;
+	__u32 hash;
+
+	if (dp->lindex == NULL)
+		return NULL;
+	hash = fat_hash_lname(name);
+	lp = lindex_slot(dp->lindex, dp->lindex_mask, hash, name);
+	if (lp->hash == 0)
+		return NULL;
+	ip = fatfs_index_lookup(dp, (char *)lp->sfn);
+	if (ip == NULL || ip->lhash != hash)
+		return NULL;
+	return ip;
+}
+
+/*
+ * Add long name of an indexed directory entry.
+ *
+ * @dp: directory data with a built index
+ * @name: long file name
+ * @sfn: short name of the entry
+ */
+int
+fatfs_lindex_add(struct fatfs_dir *dp, char *name, __u8 *sfn)
+{
+	struct fatfs_lindex *lp;
+	struct fatfs_index *ip;
+	__u32 hash;
+	int error;
+
+	ip = fatfs_index_lookup(dp, (char *)sfn);
+	if (ip == NULL)
+		return ENOENT;
+
+	if (dp->lindex == NULL) {
+		error = lindex_resize(dp, LINDEX_MIN);
+		if (error)
+			return error;
+	} else if ((dp->nr_lindex + 1) * 4 > (dp->lindex_mask + 1) * 3) {
+		error = lindex_resize(dp, (dp->lindex_mask + 1) * 2);
+		if (error)
+			return error;
+	}
+
+	hash = fat_hash_lname(name);
+	lp = lindex_slot(dp->lindex, dp->lindex_mask, hash, name);
+	if (lp->hash == 0) {
+		lp->name = strdup(name);
+		if (lp->name == NULL)
+			return ENOMEM;
+		lp->hash = hash;
+		dp->nr_lindex++;
+	}
+	memcpy(lp->sfn, sfn, 11);
+	ip->lhash = hash;
+	return 0;
+}
+
+/*
+ * Remove the long name of specified short name from the long name
+ * index, shifting back the following entries of the probe sequence.
+ */
+static void
+lindex_remove(struct fatfs_dir *dp, __u32 hash, __u8 *sfn)
+{
+	struct fatfs_lindex *lindex = dp->lindex;
+	__u32 mask = dp->lindex_mask;
+	__u32 i, j, home;
+
+	if (lindex == NULL)
+		return;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		if (lindex[i].hash == 0)
+			return;
+		if (lindex[i].hash == hash && !memcmp(lindex[i].sfn, sfn, 11))
+			break;
+	}
+	free(lindex[i].name);
+
+	j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (lindex[j].hash == 0)
+			break;
+		home = lindex[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			lindex[i] = lindex[j];
+			i = j;
+		}
+	}
+	lindex[i].hash = 0;
+	lindex[i].name = NULL;
+	dp->nr_lindex--;
+}
+
+/*
+ * Release the name index of the directory.
+ */
+void
+fatfs_index_free(struct fatfs_dir *dp)
+{
+	__u32 i;
+
+	if (dp->lindex != NULL) {
+		for (i = 0; i <= dp->lindex_mask; i++)
+			free(dp->lindex[i].name);
+		free(dp->lindex);
+	}
+	dp->lindex = NULL;
+	dp->lindex_mask = 0;
+	dp->nr_lindex = 0;
+
+	free(dp->index);
+	dp->index = NULL;
+	dp->index_mask = 0;
+	dp->nr_index = 0;
+}
+
+/*
+ * Fill the name index from a readdir pass.
+ *
+ * A pass that starts at the first entry and reaches the end of the
+ * directory without restarting has returned all entries, so the index
+ * is complete then. Entries changed during the pass are kept coherent
+ * by fatfs_dir_update() as usual.
+ *
+ * @fmp: fat mount data
+ * @pos: readdir position, after returning np
+ * @np: returned entry, if error is 0
+ * @lname: long name of returned entry, or empty
+ * @error: result of fatfs_read_node()
+ */
+void
+fatfs_index_seed(struct fatfsmount *fmp, struct fatfs_dirpos *pos,
+		 struct fatfs_node *np, char *lname, int error)
+{
+	struct fatfs_dir *dp;
+
+	if (CONFIG_LIBFATFS_DIRINDEX_MAX == 0)
+		return;
+
+	dp = fatfs_dir_get(fmp, np->dcluster);
+	if (dp == NULL)
+		return;
+
+	if (error == 0 && pos->index == (np->dcluster == CL_ROOT ? 2 : 1)) {
+		/* The pass has started at the first entry. */
+		pos->seed = 0;
+		if (dp->index != NULL ||
+		    (dp->flags & (DIR_NOINDEX | DIR_SEEDING)))
+			return;
+		dp->flags |= DIR_SEEDING;
+		pos->seed = 1;
+		pos->gen = dp->gen;
+		if (np->dcluster == CL_ROOT)
+			return;	/* ".." of root does not exist on disk */
+	}
+
+	if (!pos->seed)
+		return;
+	if (!(dp->flags & DIR_SEEDING) || pos->gen != dp->gen) {
+		/* Someone else has completed or dropped the index */
+		pos->seed = 0;
+		return;
+	}
+
+	if (error == ENOENT) {
+		/* All entries are in the index now */
+		dp->flags &= ~DIR_SEEDING;
+		pos->seed = 0;
+		return;
+	}
+	if (error == 0) {
+		error = fatfs_index_add(dp, &np->dirent, np->sector,
+					np->offset, &np->lfn);
+		if (error == 0 && np->lfn.nr > 0 && *lname != '\0')
+			error = fatfs_lindex_add(dp, lname, np->dirent.name);
+		if (error == 0)
+			return;
+		/* Out of memory, the index is tried again later */
+		if (error == ENOSPC)
+			dp->flags |= DIR_NOINDEX;
+	}
+
+	fatfs_index_free(dp);
+	dp->flags &= ~DIR_SEEDING;
+	pos->seed = 0;
+}
+
+/*
+ * Second hash for the Bloom filter, derived from the name hash.
+ */
+static inline __u32
+bloom_hash2(__u32 hash)
+{
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6dU;
+	hash ^= hash >> 12;
+	return hash | 1;
+}
+
+static void
+bloom_add(struct fatfs_dir *dp, __u32 hash)
+{
+	__u32 h2, bit;
+	int i;
+
+	h2 = bloom_hash2(hash);
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (hash + i * h2) & dp->bloom_mask;
+		dp->bloom[bit / 8] |= (__u8)(1 << (bit % 8));
+	}
+}
+
+/*
+ * Add a new name to the Bloom filter. The filter is dropped when it
+ * is full, to be rebuilt by the next scan.
+ */
+static void
+bloom_add_name(struct fatfs_dir *dp, __u32 hash)
+{
+	if (dp->bloom_free == 0)
+		fatfs_bloom_free(dp);
+	else {
+		bloom_add(dp, hash);
+		dp->bloom_free--;
+	}
+}
+
+/*
+ * Build the Bloom filter from the name hashes of all entries.
+ *
+ * @dp: directory data
+ * @hash: array of fat_hash_name() values
+ * @nr: number of hashes
+ */
+int
+fatfs_bloom_init(struct fatfs_dir *dp, __u32 *hash, __u32 nr)
+{
+	__u32 bits, i;
+
+	fatfs_bloom_free(dp);
+
+	/* Leave room for as many names again before rebuilding */
+	bits = BLOOM_MIN;
+	while (bits < nr * 2 * BLOOM_BITS)
+		bits *= 2;
+
+	dp->bloom = calloc(bits / 8, 1);
+	if (dp->bloom == NULL)
+		return ENOMEM;
+	dp->bloom_mask = bits - 1;
+	dp->bloom_free = bits / BLOOM_BITS - nr;
+
+	for (i = 0; i < nr; i++)
+		bloom_add(dp, hash[i]);
+	return 0;
+}
+
+/*
+ * Test if the name may exist in the directory.
+ * Return 0 if the name surely does not exist.
+ */
+int
+fatfs_bloom_test(struct fatfs_dir *dp, __u32 hash)
+{
+	__u32 h2, bit;
+	int i;
+
+	h2 = bloom_hash2(hash);
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (hash + i * h2) & dp->bloom_mask;
+		if (!(dp->bloom[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Release the Bloom filter of the directory.
+ */
+void
+fatfs_bloom_free(struct fatfs_dir *dp)
+{
+	free(dp->bloom);
+	dp->bloom = NULL;
+	dp->bloom_mask = 0;
+	dp->bloom_free = 0;
+}
+
+/*
+ * Forget the slot hints for a slot which is now in use.
+ */
+static void
+slot_used(struct fatfs_dir *dp, __u32 sec, __u32 offset)
+{
+	int i;
+
+	for (i = 0; i < dp->nr_free; i++) {
+		if (dp->free[i].sector == sec && dp->free[i].offset == offset) {
+			dp->free[i] = dp->free[--dp->nr_free];
+			break;
+		}
+	}
+	if (dp->eod.sector == sec && dp->eod.offset == offset)
+		dp->flags &= ~DIR_EOD;
+}
+
+/*
+ * Keep the name index, Bloom filter, slot hints and usage aggregates
+ * coherent with a directory entry update.
+ *
+ * @fmp: fat mount data
+ * @old: directory entry on disk before update
+ * @np: fat node to be written
+ */
+void
+fatfs_dir_update(struct fatfsmount *fmp, struct fat_dirent *old,
+		 struct fatfs_node *np)
+{
+	struct fatfs_dir *dp;
+	struct fatfs_index *ip;
+	int error;
+
+	/* A removed or renamed entry makes cached paths stale */
+	if (IS_NAMED(old) && (!IS_NAMED(&np->dirent) ||
+	    fat_compare_name((char *)old->name, (char *)np->dirent.name)))
+		fmp->path_gen++;
+
+	fatfs_usage_change(fmp, np->dcluster, old, &np->dirent);
+
+	dp = fatfs_dir_find(fmp, np->dcluster);
+	if (dp == NULL)
+		return;
+
+	if (IS_DELETED(&np->dirent) || IS_EMPTY(&np->dirent)) {
+		if (!IS_DELETED(old) && !IS_EMPTY(old)) {
+			/* The slot can be reused by the next insertion */
+			if (dp->nr_free < DIR_FREE_MAX) {
+				dp->free[dp->nr_free].sector = np->sector;
+				dp->free[dp->nr_free].offset = np->offset;
+				dp->nr_free++;
+			}
+			dp->nr_live--;
+			dp->nr_deleted++;
+		}
+	} else {
+		if (IS_DELETED(old))
+			dp->nr_deleted--;
+		if (IS_DELETED(old) || IS_EMPTY(old))
+			dp->nr_live++;
+		/* A new name may break the order */
+		if (IS_DELETED(old) || IS_EMPTY(old) ||
+		    fat_compare_name((char *)old->name,
+				     (char *)np->dirent.name))
+			dp->flags &= ~DIR_SORTED;
+		slot_used(dp, np->sector, np->offset);
+	}
+
+	/*
+	 * Names can not be removed from the Bloom filter. Stale bits
+	 * only cost a disk scan, until the filter is rebuilt.
+	 */
+	if (dp->bloom != NULL && IS_NAMED(&np->dirent) &&
+	    (!IS_NAMED(old) ||
+	     fat_compare_name((char *)old->name, (char *)np->dirent.name)))
+		bloom_add_name(dp, fat_hash_name((char *)np->dirent.name));
+
+	if (dp->index == NULL)
+		return;
+
+	if (IS_NAMED(old)) {
+		ip = fatfs_index_lookup(dp, (char *)old->name);
+		if (ip != NULL && ip->sector == np->sector &&
+		    ip->offset == np->offset) {
+			if (IS_NAMED(&np->dirent) &&
+			    !fat_compare_name((char *)old->name,
+					      (char *)np->dirent.name)) {
+				/* Same name, the long name is kept */
+				ip->dirent = np->dirent;
+				return;
+			}
+			if (ip->lhash != 0)
+				lindex_remove(dp, ip->lhash, old->name);
+			index_remove(dp, ip);
+		}
+	}
+	if (IS_NAMED(&np->dirent)) {
+		error = fatfs_index_add(dp, &np->dirent, np->sector,
+					np->offset, &np->lfn);
+		if (error) {
+			/* Can not keep the index complete. */
+			fatfs_index_free(dp);
+			if (error == ENOSPC)
+				dp->flags |= DIR_NOINDEX;
+		}
+	}
+}
+
+/*
+ * Add the long name of a new directory entry to the name index and
+ * the Bloom filter. This is called after the entry is written.
+ *
+ * @fmp: fat mount data
+ * @np: fat node written
+ * @name: long file name
+ */
+void
+fatfs_dir_add_lname(struct fatfsmount *fmp, struct fatfs_node *np,
+		    char *name)
+{
+	struct fatfs_dir *dp;
+	int error;
+
+	dp = fatfs_dir_find(fmp, np->dcluster);
+	if (dp == NULL)
+		return;
+
+	if (dp->bloom != NULL)
+		bloom_add_name(dp, fat_hash_lname(name));
+
+	if (dp->index == NULL)
+		return;
+	error = fatfs_lindex_add(dp, name, np->dirent.name);
+	if (error) {
+		/* Can not keep the index complete. */
+		fatfs_index_free(dp);
+		if (error == ENOSPC)
+			dp->flags |= DIR_NOINDEX;
+	}
+}
+
+/*
+ * Forget the long name of a directory entry kept under its short
+ * name, after its long name entries are deleted.
+ *
+ * @fmp: fat mount data
+ * @np: fat node written, without long name
+ */
+void
+fatfs_dir_del_lname(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fatfs_dir *dp;
+	struct fatfs_index *ip;
+
+	dp = fatfs_dir_find(fmp, np->dcluster);
+	if (dp == NULL || dp->index == NULL)
+		return;
+
+	ip = fatfs_index_lookup(dp, (char *)np->dirent.name);
+	if (ip == NULL || ip->sector != np->sector ||
+	    ip->offset != np->offset)
+		return;
+	if (ip->lhash != 0)
+		lindex_remove(dp, ip->lhash, np->dirent.name);
+	ip->lhash = 0;
+	ip->lfn.nr = 0;
+}
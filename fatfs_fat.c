@@ -34,15 +34,15 @@
 #include "fatfs.h"
 
 /*
- * Read the FAT entry for specified cluster.
+ * Get the first FAT sector holding the entry of a cluster.
+ * @nr is set to 2 for a FAT12 entry crossing the sector border.
  */
-static int
-read_fat_entry(struct fatfsmount *fmp, __u32 cl)
+static __u32
+fat_entry_sec(struct fatfsmount *fmp, __u32 cl, __u32 *nr)
 {
 	__u32 sec;
-	char *buf = fmp->fat_buf;
-	int error, border = 0;
 
+	*nr = 1;
 	/* Get the sector number in FAT entry. */
 	if (FAT16(fmp))
 		sec = (cl * 2) / SEC_SIZE;
@@ -54,72 +54,81 @@ read_fat_entry(struct fatfsmount *fmp, __u32 cl)
 		 * more sector to get complete FAT12 entry.
 		 */
 		if ((cl * 3 / 2) % SEC_SIZE == SEC_SIZE - 1)
-			border = 1;
+			*nr = 2;
 	}
-	sec += fmp->fat_start;
+	return sec + fmp->fat_start;
+}
+
+/*
+ * Write back the FAT sectors held in fat_buf, if modified.
+ */
+static int
+flush_fat(struct fatfsmount *fmp)
+{
+	int error;
 
-	/* Read first sector. */
+	if (!fmp->fat_dirty)
+		return 0;
 
-	/* PERF: prex used bread function which reads data from cache */
-	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec, 1, buf);
-	if (error != 0)
-		return error;
+	DPRINTF(("fat_flush: sec=%d nr=%d\n", fmp->fat_sec, fmp->fat_nr));
+	fmp->fat_dirty = 0;
+	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, fmp->fat_sec,
+				  fmp->fat_nr, fmp->fat_buf);
+	if (error)
+		fmp->fat_sec = SEC_INVAL;
+	return error;
+}
 
-	if (!FAT12(fmp) || border == 0)
+/*
+ * Read the FAT entry for specified cluster.
+ * The buffer keeps the last sectors read, so that walking a chain
+ * reads each FAT sector once.
+ */
+static int
+read_fat_entry(struct fatfsmount *fmp, __u32 cl)
+{
+	__u32 sec, nr;
+	int error;
+
+	sec = fat_entry_sec(fmp, cl, &nr);
+	if (sec == fmp->fat_sec && nr <= fmp->fat_nr)
 		return 0;
 
+	/* Modified sectors go out before the buffer is reused */
+	error = flush_fat(fmp);
+	if (error)
+		return error;
+
 	/* PERF: prex used bread function which reads data from cache */
-	/* Read second sector for the border entry of FAT12. */
-	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec + 1, 1, buf + SEC_SIZE);
-	if (error != 0)
+	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec, nr,
+				  fmp->fat_buf);
+	if (error != 0) {
+		fmp->fat_sec = SEC_INVAL;
 		return error;
+	}
+	fmp->fat_sec = sec;
+	fmp->fat_nr = nr;
 	return 0;
 }
 
 /*
  * Write fat entry from buffer.
+ * In a batch, the write is deferred to fat_flush().
  */
 static int
-write_fat_entry(struct fatfsmount *fmp, __u32 cl)
+write_fat_entry(struct fatfsmount *fmp)
 {
-	__u32 sec;
-	char *buf = fmp->fat_buf;
-	int error, border = 0;
-
-	/* Get the sector number in FAT entry. */
-	if (FAT16(fmp))
-		sec = (cl * 2) / SEC_SIZE;
-	else {
-		sec = (cl * 3 / 2) / SEC_SIZE;
-		/* Check if border entry for FAT12 */
-		if ((cl * 3 / 2) % SEC_SIZE == SEC_SIZE - 1)
-			border = 1;
-	}
-	sec += fmp->fat_start;
-
-	/* PERF: prex used bwrite function which reads data from cache */
-	/* Write first sector. */
-	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec, 1, buf);
-	if (error != 0)
-		return error;
-
-	if (!FAT12(fmp) || border == 0)
+	fmp->fat_dirty = 1;
+	if (fmp->batch > 0)
 		return 0;
-
-	/* PERF: prex used bwrite function which reads data from cache */
-	/* Write second sector for the border entry of FAT12. */
-	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec + 1, 1, buf + SEC_SIZE);
-	return error;
+	return flush_fat(fmp);
 }
 
 /*
  * Get next cluster number of FAT chain.
- * @fmp: fat mount data
- * @cl: previous cluster#
- * @next: next cluster# to return
  */
-int
-fat_next_cluster(struct fatfsmount *fmp, __u32 cl, __u32 *next)
+static int
+next_cluster(struct fatfsmount *fmp, __u32 cl, __u32 *next)
 {
 	unsigned int offset;
 	__u16 val;
@@ -153,12 +162,9 @@ fat_next_cluster(struct fatfsmount *fmp, __u32 cl, __u32 *next)
 
 /*
  * Set next cluster number in FAT chain.
- * @fmp: fat mount data
- * @cl: previous cluster#
- * @next: cluster# to set (can be eof)
  */
-int
-fat_set_cluster(struct fatfsmount *fmp, __u32 cl, __u32 next)
+static int
+set_cluster(struct fatfsmount *fmp, __u32 cl, __u32 next)
 {
 	unsigned int offset;
 	char *buf = fmp->fat_buf;
@@ -191,19 +197,16 @@ fat_set_cluster(struct fatfsmount *fmp, __u32 cl, __u32 next)
 	*((__u16 *)(buf + offset)) = val;
 
 	/* Write FAT entry */
-	error = write_fat_entry(fmp, cl);
+	error = write_fat_entry(fmp);
 	return error;
 }
 
 /*
- * Allocate free cluster in FAT chain.
- *
- * @fmp: fat mount data
- * @scan_start: cluster# to scan first. If 0, use the previous used value.
- * @free: allocated cluster# to return
+ * Find a free cluster, from the one after scan_start.
+ * It stays free until the caller links it.
  */
-int
-fat_alloc_cluster(struct fatfsmount *fmp, __u32 scan_start, __u32 *free)
+static int
+alloc_cluster(struct fatfsmount *fmp, __u32 scan_start, __u32 *free)
 {
 	__u32 cl, next;
 	int error;
@@ -215,7 +218,7 @@ fat_alloc_cluster(struct fatfsmount *fmp, __u32 scan_start, __u32 *free)
 
 	cl = scan_start + 1;
 	while (cl != scan_start) {
-		error = fat_next_cluster(fmp, cl, &next);
+		error = next_cluster(fmp, cl, &next);
 		if (error)
 			return error;
 		if (next == CL_FREE) {	/* free ? */
@@ -229,6 +232,123 @@ fat_alloc_cluster(struct fatfsmount *fmp, __u32 scan_start, __u32 *free)
 	return ENOSPC;		/* no space */
 }
 
+/*
+ * Write back the FAT sectors held in fat_buf, if modified.
+ * @fmp: fat mount data
+ */
+int
+fat_flush(struct fatfsmount *fmp)
+{
+	int error;
+
+	uk_mutex_lock(&fmp->fat_lock);
+	error = flush_fat(fmp);
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
+}
+
+/*
+ * Get next cluster number of FAT chain.
+ * @fmp: fat mount data
+ * @cl: previous cluster#
+ * @next: next cluster# to return
+ */
+int
+fat_next_cluster(struct fatfsmount *fmp, __u32 cl, __u32 *next)
+{
+	int error;
+
+	uk_mutex_lock(&fmp->fat_lock);
+	error = next_cluster(fmp, cl, next);
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
+}
+
+/*
+ * Set next cluster number in FAT chain.
+ * @fmp: fat mount data
+ * @cl: previous cluster#
+ * @next: cluster# to set (can be eof)
+ */
+int
+fat_set_cluster(struct fatfsmount *fmp, __u32 cl, __u32 next)
+{
+	int error;
+
+	uk_mutex_lock(&fmp->fat_lock);
+	error = set_cluster(fmp, cl, next);
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
+}
+
+/*
+ * Allocate a free cluster as a chain of its own.
+ *
+ * The cluster is marked as end of chain at once, so that no other
+ * allocation can take it before the caller links it to an entry.
+ *
+ * @fmp: fat mount data
+ * @free: allocated cluster# to return
+ */
+int
+fat_new_cluster(struct fatfsmount *fmp, __u32 *free)
+{
+	int error;
+
+	uk_mutex_lock(&fmp->fat_lock);
+	error = alloc_cluster(fmp, 0, free);
+	if (!error)
+		error = set_cluster(fmp, *free, fmp->fat_eof);
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
+}
+
+/*
+ * Allocate many free clusters in one pass of the FAT.
+ *
+ * Each cluster is marked as end of chain, so that it is not found
+ * free again before the caller links it. Nothing is allocated if
+ * there are not enough free clusters.
+ *
+ * @fmp: fat mount data
+ * @nr: number of clusters
+ * @cls: allocated cluster#s to return, in FAT order
+ */
+int
+fat_alloc_clusters(struct fatfsmount *fmp, __u32 nr, __u32 *cls)
+{
+	__u32 cl, next, n = 0;
+	int error = 0;
+
+	DPRINTF(("fat_alloc_clusters: nr=%d\n", nr));
+
+	uk_mutex_lock(&fmp->fat_lock);
+	cl = fmp->free_scan + 1;
+	while (n < nr && cl != fmp->free_scan) {
+		error = next_cluster(fmp, cl, &next);
+		if (error)
+			goto out;
+		if (next == CL_FREE) {
+			error = set_cluster(fmp, cl, fmp->fat_eof);
+			if (error)
+				goto out;
+			cls[n++] = cl;
+		}
+		if (++cl >= fmp->last_cluster)
+			cl = CL_FIRST;
+	}
+	if (n < nr)
+		error = ENOSPC;
+ out:
+	if (error) {
+		while (n > 0)
+			set_cluster(fmp, cls[--n], CL_FREE);
+	} else if (nr > 0)
+		fmp->free_scan = cls[nr - 1];
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
+}
+
 /*
  * Deallocate needless cluster.
  * @fmp: fat mount data
@@ -237,27 +357,26 @@ fat_alloc_cluster(struct fatfsmount *fmp, __u32 scan_start, __u32 *free)
 int
 fat_free_clusters(struct fatfsmount *fmp, __u32 start)
 {
-	int error;
+	int error = 0;
 	__u32 cl, next;
 
 	cl = start;
 	if (cl < CL_FIRST)
 		return EINVAL;
 
+	uk_mutex_lock(&fmp->fat_lock);
 	while (!IS_EOFCL(fmp, cl)) {
-		error = fat_next_cluster(fmp, cl, &next);
+		error = next_cluster(fmp, cl, &next);
 		if (error)
-			return error;
-		error = fat_set_cluster(fmp, cl, CL_FREE);
+			break;
+		/* This also clears eof of the last cluster */
+		error = set_cluster(fmp, cl, CL_FREE);
 		if (error)
-			return error;
+			break;
 		cl = next;
 	}
-	/* Clear eof */
-	error = fat_set_cluster(fmp, cl, CL_FREE);
-	if (error)
-		return error;
-	return 0;
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
 }
 
 /*
@@ -271,7 +390,7 @@ fat_free_clusters(struct fatfsmount *fmp, __u32 start)
 int
 fat_seek_cluster(struct fatfsmount *fmp, __u32 start, __u32 offset, __u32 *cl)
 {
-	int error;
+	int error = 0;
 	__u32 i, c, target;
 
 	if (start > fmp->last_cluster)
@@ -279,15 +398,19 @@ fat_seek_cluster(struct fatfsmount *fmp, __u32 start, __u32 offset, __u32 *cl)
 
 	c = start;
 	target = offset / fmp->cluster_size;
+	uk_mutex_lock(&fmp->fat_lock);
 	for (i = 0; i < target; i++) {
-		error = fat_next_cluster(fmp, c, &c);
+		error = next_cluster(fmp, c, &c);
 		if (error)
-			return error;
-		if (IS_EOFCL(fmp, c))
-			return EIO;
+			break;
+		if (IS_EOFCL(fmp, c)) {
+			error = EIO;
+			break;
+		}
 	}
+	uk_mutex_unlock(&fmp->fat_lock);
 	*cl = c;
-	return 0;
+	return error;
 }
 
 /*
@@ -307,36 +430,42 @@ fat_expand_file(struct fatfsmount *fmp, __u32 *cl, __u32 size)
 	alloc = 0;
 	cl_len = (size + fmp->cluster_size - 1) / fmp->cluster_size;
 
+	/* Clusters found free must be linked before anyone else looks */
+	uk_mutex_lock(&fmp->fat_lock);
+
 	/* allocate cluster if the file was previously empty */
 	if (*cl == CL_FREE) {
-		error = fat_alloc_cluster(fmp, 0, cl);
+		error = alloc_cluster(fmp, 0, cl);
 		if (error)
-			return error;
+			goto out;
 		alloc = 1;
 	}
 	current = *cl;
 
 	for (i = 1; i < cl_len; i++) {
-		error = fat_next_cluster(fmp, current, &next);
+		error = next_cluster(fmp, current, &next);
 		if (error)
-			return error;
+			goto out;
 		if (alloc || next >= fmp->fat_eof) {
-			error = fat_alloc_cluster(fmp, current, &next);
+			error = alloc_cluster(fmp, current, &next);
 			if (error)
-				return error;
+				goto out;
 			alloc = 1;
 		}
 		if (alloc) {
-			error = fat_set_cluster(fmp, current, next);
+			error = set_cluster(fmp, current, next);
 			if (error)
-				return error;
+				goto out;
 		}
 		current = next;
 	}
 	if (alloc)
-		fat_set_cluster(fmp, current, fmp->fat_eof);	/* add eof */
+		set_cluster(fmp, current, fmp->fat_eof);	/* add eof */
 	DPRINTF(("fat_expand_file: new size=%d\n", size));
-	return 0;
+	error = 0;
+ out:
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
 }
 
 /*
@@ -354,26 +483,32 @@ fat_expand_dir(struct fatfsmount *fmp, __u32 cl, __u32 *new_cl)
 	int error;
 	__u32 next;
 
+	uk_mutex_lock(&fmp->fat_lock);
+
 	/* Find last cluster number of FAT chain. */
-	while (!IS_EOFCL(fmp, cl)) {
-		error = fat_next_cluster(fmp, cl, &next);
+	for (;;) {
+		error = next_cluster(fmp, cl, &next);
 		if (error)
-			return error;
+			goto out;
+		if (IS_EOFCL(fmp, next))
+			break;
 		cl = next;
 	}
 
-	error = fat_alloc_cluster(fmp, cl, &next);
+	error = alloc_cluster(fmp, cl, &next);
 	if (error)
-		return error;
+		goto out;
 
-	error = fat_set_cluster(fmp, cl, next);
+	error = set_cluster(fmp, cl, next);
 	if (error)
-		return error;
+		goto out;
 
-	error = fat_set_cluster(fmp, next, fmp->fat_eof);
+	error = set_cluster(fmp, next, fmp->fat_eof);
 	if (error)
-		return error;
+		goto out;
 
 	*new_cl = next;
-	return 0;
+ out:
+	uk_mutex_unlock(&fmp->fat_lock);
+	return error;
 }
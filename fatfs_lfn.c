@@ -0,0 +1,428 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fatfs.h"
+
+/*
+ * Byte offsets of the characters in a long name entry
+ */
+static const __u8 lfn_offset[LFN_CHARS] = {
+	1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+/*
+ * Check specified name is valid as VFAT long file name.
+ * Return true if valid.
+ */
+int
+fat_valid_lname(char *name)
+{
+	static char invalid_char[] = "\\/:*?\"<>|";
+	size_t len;
+	char *p;
+
+	len = strlen(name);
+	if (len == 0 || len > NAME_MAX)
+		return 0;
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return 0;
+	for (p = name; *p != '\0'; p++) {
+		if ((__u8)*p < 0x20 || strchr(invalid_char, *p))
+			return 0;
+	}
+	/* Trailing dots and spaces are dropped by other systems */
+	if (name[len - 1] == '.' || name[len - 1] == ' ')
+		return 0;
+	return 1;
+}
+
+/*
+ * Hash long file name. Case of ASCII letters is ignored like
+ * strcasecmp().
+ */
+__u32
+fat_hash_lname(char *name)
+{
+	__u32 hash = 2166136261U;	/* FNV-1a */
+	int c;
+
+	for (; *name != '\0'; name++) {
+		c = (__u8)*name;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		hash ^= (__u32)c;
+		hash *= 16777619U;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Convert UTF-8 string to UCS-2. Characters out of the BMP are
+ * stored as surrogate pairs.
+ *
+ * @src: UTF-8 string
+ * @dst: buffer for UCS-2 characters
+ * @max: size of dst
+ * @len: number of UCS-2 characters to return
+ */
+int
+fat_utf8_to_ucs2(const char *src, __u16 *dst, int max, int *len)
+{
+	const __u8 *s = (const __u8 *)src;
+	size_t size;
+	__u32 c;
+	int n = 0, i, extra;
+
+	size = strlen(src);
+#if defined(__SSE2__)
+	/* Widen runs of 16 ASCII characters at once */
+	while (size >= 16 && n + 16 <= max) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+
+		if (_mm_movemask_epi8(v))
+			break;		/* not all ASCII */
+		_mm_storeu_si128((__m128i *)(dst + n),
+				 _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i *)(dst + n + 8),
+				 _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+		s += 16;
+		size -= 16;
+		n += 16;
+	}
+#endif
+	while (size > 0) {
+		c = *s;
+		if (c < 0x80)
+			extra = 0;
+		else if ((c & 0xe0) == 0xc0) {
+			c &= 0x1f;
+			extra = 1;
+		} else if ((c & 0xf0) == 0xe0) {
+			c &= 0x0f;
+			extra = 2;
+		} else if ((c & 0xf8) == 0xf0) {
+			c &= 0x07;
+			extra = 3;
+		} else
+			return EINVAL;
+		if ((size_t)extra >= size)
+			return EINVAL;
+		for (i = 1; i <= extra; i++) {
+			if ((s[i] & 0xc0) != 0x80)
+				return EINVAL;
+			c = (c << 6) | (s[i] & 0x3f);
+		}
+		/* Reject overlong forms and surrogates */
+		if ((extra == 1 && c < 0x80) || (extra == 2 && c < 0x800) ||
+		    (extra == 3 && (c < 0x10000 || c > 0x10ffff)) ||
+		    (c >= 0xd800 && c <= 0xdfff))
+			return EINVAL;
+		s += extra + 1;
+		size -= extra + 1;
+
+		if (c >= 0x10000) {
+			if (n + 2 > max)
+				return ENAMETOOLONG;
+			c -= 0x10000;
+			dst[n++] = (__u16)(0xd800 | (c >> 10));
+			dst[n++] = (__u16)(0xdc00 | (c & 0x3ff));
+		} else {
+			if (n + 1 > max)
+				return ENAMETOOLONG;
+			dst[n++] = (__u16)c;
+		}
+	}
+	*len = n;
+	return 0;
+}
+
+/*
+ * Convert UCS-2 characters to UTF-8 string.
+ *
+ * @src: UCS-2 characters
+ * @len: number of characters
+ * @dst: buffer for UTF-8 string
+ * @size: size of dst, including the terminating NUL
+ */
+int
+fat_ucs2_to_utf8(const __u16 *src, int len, char *dst, size_t size)
+{
+	__u8 *d = (__u8 *)dst;
+	size_t n = 0;
+	__u32 c;
+	int i = 0;
+
+#if defined(__SSE2__)
+	/* Narrow runs of 8 ASCII characters at once */
+	while (len - i >= 8 && n + 8 < size) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_and_si128(v, _mm_set1_epi16((short)0xff80));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi,
+				      _mm_setzero_si128())) != 0xffff)
+			break;		/* not all ASCII */
+		_mm_storel_epi64((__m128i *)(d + n), _mm_packus_epi16(v, v));
+		i += 8;
+		n += 8;
+	}
+#endif
+	for (; i < len; i++) {
+		c = src[i];
+		if (c >= 0xd800 && c <= 0xdbff) {
+			/* Surrogate pair */
+			if (i + 1 >= len || src[i + 1] < 0xdc00 ||
+			    src[i + 1] > 0xdfff)
+				return EINVAL;
+			c = 0x10000 + ((c - 0xd800) << 10) +
+				(src[++i] - 0xdc00);
+		} else if (c >= 0xdc00 && c <= 0xdfff)
+			return EINVAL;
+
+		if (c < 0x80) {
+			if (n + 1 >= size)
+				return ENAMETOOLONG;
+			d[n++] = (__u8)c;
+		} else if (c < 0x800) {
+			if (n + 2 >= size)
+				return ENAMETOOLONG;
+			d[n++] = (__u8)(0xc0 | (c >> 6));
+			d[n++] = (__u8)(0x80 | (c & 0x3f));
+		} else if (c < 0x10000) {
+			if (n + 3 >= size)
+				return ENAMETOOLONG;
+			d[n++] = (__u8)(0xe0 | (c >> 12));
+			d[n++] = (__u8)(0x80 | ((c >> 6) & 0x3f));
+			d[n++] = (__u8)(0x80 | (c & 0x3f));
+		} else {
+			if (n + 4 >= size)
+				return ENAMETOOLONG;
+			d[n++] = (__u8)(0xf0 | (c >> 18));
+			d[n++] = (__u8)(0x80 | ((c >> 12) & 0x3f));
+			d[n++] = (__u8)(0x80 | ((c >> 6) & 0x3f));
+			d[n++] = (__u8)(0x80 | (c & 0x3f));
+		}
+	}
+	if (n >= size)
+		return ENAMETOOLONG;
+	d[n] = '\0';
+	return 0;
+}
+
+/*
+ * Checksum of short name, stored in its long name entries.
+ */
+__u8
+fat_lfn_checksum(__u8 *sfn)
+{
+	__u8 sum = 0;
+	int i;
+
+	for (i = 0; i < 11; i++)
+		sum = (__u8)(((sum & 1) << 7) + (sum >> 1) + sfn[i]);
+	return sum;
+}
+
+/*
+ * Forget the long name being collected.
+ */
+void
+fat_lfn_reset(struct fat_lfn *lfn)
+{
+	lfn->pos.nr = 0;
+	lfn->next = 0;
+}
+
+/*
+ * Collect a long name entry. The entries must come in directory
+ * order, otherwise the long name is dropped.
+ *
+ * @lfn: long name being collected
+ * @de: long name entry
+ * @cl: cluster# of entry
+ * @sec: sector# of entry
+ * @offset: offset of entry in sector
+ */
+void
+fat_lfn_add(struct fat_lfn *lfn, struct fat_dirent *de, __u32 cl,
+	    __u32 sec, __u32 offset)
+{
+	struct fat_lfn_dirent *le = (struct fat_lfn_dirent *)de;
+	__u8 *p = (__u8 *)de;
+	__u16 *name;
+	int ord, i;
+
+	ord = le->ord & LFN_ORD_MASK;
+	if (le->ord & LFN_LAST) {
+		if (ord == 0 || ord > LFN_ENTRIES) {
+			fat_lfn_reset(lfn);
+			return;
+		}
+		lfn->pos.cluster = cl;
+		lfn->pos.sector = sec;
+		lfn->pos.offset = offset;
+		lfn->pos.nr = ord;
+		lfn->csum = le->csum;
+	} else if (lfn->pos.nr == 0 || ord == 0 || ord != lfn->next ||
+		   le->csum != lfn->csum) {
+		fat_lfn_reset(lfn);
+		return;
+	}
+
+	name = lfn->name + (ord - 1) * LFN_CHARS;
+	for (i = 0; i < LFN_CHARS; i++)
+		name[i] = (__u16)(p[lfn_offset[i]] |
+				  (p[lfn_offset[i] + 1] << 8));
+	lfn->next = ord - 1;
+}
+
+/*
+ * Check if the collected long name belongs to the short name entry.
+ * Return the number of long name entries, or 0.
+ */
+int
+fat_lfn_check(struct fat_lfn *lfn, struct fat_dirent *de)
+{
+	if (lfn->pos.nr == 0 || lfn->next != 0 ||
+	    lfn->csum != fat_lfn_checksum(de->name))
+		return 0;
+	return lfn->pos.nr;
+}
+
+/*
+ * Get the collected long name in UTF-8.
+ *
+ * @lfn: long name checked by fat_lfn_check()
+ * @buf: buffer for name
+ * @size: size of buf
+ */
+int
+fat_lfn_name(struct fat_lfn *lfn, char *buf, size_t size)
+{
+	int len, max;
+
+	max = lfn->pos.nr * LFN_CHARS;
+	for (len = 0; len < max; len++) {
+		if (lfn->name[len] == 0x0000 || lfn->name[len] == 0xffff)
+			break;
+	}
+	if (len == 0)
+		return EINVAL;
+	return fat_ucs2_to_utf8(lfn->name, len, buf, size);
+}
+
+/*
+ * Build the long name entries for a name, in directory order.
+ *
+ * @name: long name in UTF-8
+ * @sfn: short name of the entry
+ * @ent: array of LFN_ENTRIES entries to fill
+ * @nr: number of entries to return
+ */
+int
+fat_lfn_build(char *name, __u8 *sfn, struct fat_dirent *ent, int *nr)
+{
+	__u16 ucs[LFN_MAX];
+	struct fat_lfn_dirent *le;
+	__u8 *p, csum;
+	__u16 c;
+	int len, n, k, i, j, error;
+
+	error = fat_utf8_to_ucs2(name, ucs, LFN_MAX, &len);
+	if (error)
+		return error;
+
+	n = (len + LFN_CHARS - 1) / LFN_CHARS;
+	csum = fat_lfn_checksum(sfn);
+	for (k = n; k > 0; k--) {
+		le = (struct fat_lfn_dirent *)&ent[n - k];
+		memset(le, 0, sizeof(*le));
+		le->ord = (__u8)(k | (k == n ? LFN_LAST : 0));
+		le->attr = FA_LFN;
+		le->csum = csum;
+		p = (__u8 *)le;
+		for (i = 0; i < LFN_CHARS; i++) {
+			j = (k - 1) * LFN_CHARS + i;
+			if (j < len)
+				c = ucs[j];
+			else if (j == len)
+				c = 0x0000;
+			else
+				c = 0xffff;
+			p[lfn_offset[i]] = (__u8)c;
+			p[lfn_offset[i] + 1] = (__u8)(c >> 8);
+		}
+	}
+	*nr = n;
+	return 0;
+}
+
+/*
+ * Copy characters of long name for short name.
+ */
+static int
+sfn_copy(const char *src, const char *end, char *dst, int max)
+{
+	static char valid_char[] = "$%'-_@~`!(){}^#&";
+	int n = 0, c;
+
+	for (; src < end && n < max; src++) {
+		c = (__u8)*src;
+		if (c == ' ' || c == '.')
+			continue;
+		if ((c & 0xc0) == 0x80)
+			continue;	/* rest of UTF-8 character */
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		else if (!(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9') &&
+			 !strchr(valid_char, c))
+			c = '_';
+		dst[n++] = (char)c;
+	}
+	return n;
+}
+
+/*
+ * Make a short name for long name, with numeric tail "~n".
+ *
+ * @name: long name
+ * @tail: tail number, 1 or more
+ * @sfn: 8.3 name to return
+ */
+void
+fat_make_sfn(char *name, int tail, char *sfn)
+{
+	char base[8], num[8];
+	char *ext, *end;
+	int n, t;
+
+	while (*name == '.')
+		name++;
+	ext = strrchr(name, '.');
+	end = ext ? ext : name + strlen(name);
+
+	memset(sfn, ' ', 11);
+	n = sfn_copy(name, end, base, 8);
+	if (n == 0)
+		base[n++] = '_';
+
+	t = snprintf(num, sizeof(num), "~%d", tail);
+	if (n > 8 - t)
+		n = 8 - t;
+	memcpy(sfn, base, n);
+	memcpy(sfn + n, num, t);
+
+	if (ext != NULL)
+		sfn_copy(ext + 1, ext + strlen(ext), sfn + 8, 3);
+}
@@ -28,358 +28,2388 @@
  */
 
 #include <uk/blkdev.h>
+#include <uk/semaphore.h>
 #include <vfscore/mount.h>
 
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdlib.h>
 #include <errno.h>
 
 #include "fatfs.h"
 
+/*
+ * Find specified sector in the directory read-ahead buffer.
+ * Return NULL if it is not read ahead.
+ */
+static char *
+fat_ra_find(struct fatfsmount *fmp, __u32 sec)
+{
+	char *buf = fmp->ra_buf;
+	int i;
+
+	for (i = 0; i < fmp->nr_ra; i++) {
+		if (sec - fmp->ra_run[i].sector < fmp->ra_run[i].count)
+			return buf + (sec - fmp->ra_run[i].sector) * SEC_SIZE;
+		buf += fmp->ra_run[i].count * SEC_SIZE;
+	}
+	return NULL;
+}
+
+/*
+ * Drop the directory read-ahead if it holds any of specified sectors.
+ * This must be called when the sectors are written without
+ * fat_write_dirent().
+ *
+ * @fmp: fatfs mount point
+ * @sec: first sector#
+ * @nr: number of sectors
+ */
+void
+fatfs_ra_invalidate(struct fatfsmount *fmp, __u32 sec, __u32 nr)
+{
+	int i;
+
+	for (i = 0; i < fmp->nr_ra; i++) {
+		if (sec < fmp->ra_run[i].sector + fmp->ra_run[i].count &&
+		    fmp->ra_run[i].sector < sec + nr) {
+			fmp->nr_ra = 0;
+			return;
+		}
+	}
+}
+
+static void
+fat_ra_done(struct uk_blkreq *req __unused, void *cookie)
+{
+	uk_semaphore_up((struct uk_semaphore *)cookie);
+}
+
+/*
+ * Read the directory ahead of a scan.
+ *
+ * The cluster chain is resolved first, and the reads of all its
+ * sectors, up to the read-ahead size, are submitted together. The
+ * scan then finds the sectors in memory instead of waiting for each
+ * sector in turn.
+ *
+ * @fmp: fatfs mount point
+ * @cl: cluster# of directory
+ */
+static void
+fat_prefetch_dir(struct fatfsmount *fmp, __u32 cl)
+{
+	struct uk_blkreq req[DIR_RA_RUNS];
+	struct uk_semaphore sem;
+	struct fatfs_run *run = fmp->ra_run;
+	__u32 sec, nr, dir = cl;
+	char *buf;
+	int i, nr_run, nr_req, error;
+
+	if (fmp->ra_buf == NULL)
+		return;
+	if (fmp->nr_ra > 0 && fmp->ra_dir == dir)
+		return;		/* already in memory */
+	/* The sectors read must not miss a deferred write */
+	if (fatfs_flush_dirent(fmp))
+		return;
+
+	fmp->nr_ra = 0;
+	nr_run = 0;
+	nr = 0;
+	if (cl == CL_ROOT) {
+		run[0].sector = fmp->root_start;
+		run[0].count = MIN(fmp->data_start - fmp->root_start,
+				   (__u32)CONFIG_LIBFATFS_DIR_READAHEAD);
+		nr = run[0].count;
+		nr_run = 1;
+	} else {
+		while (!IS_EOFCL(fmp, cl) &&
+		       nr + fmp->sec_per_cl <= CONFIG_LIBFATFS_DIR_READAHEAD) {
+			sec = cl_to_sec(fmp, cl);
+			if (nr_run > 0 &&
+			    run[nr_run - 1].sector + run[nr_run - 1].count == sec)
+				run[nr_run - 1].count += fmp->sec_per_cl;
+			else if (nr_run == DIR_RA_RUNS)
+				break;
+			else {
+				run[nr_run].sector = sec;
+				run[nr_run].count = fmp->sec_per_cl;
+				nr_run++;
+			}
+			nr += fmp->sec_per_cl;
+			if (fat_next_cluster(fmp, cl, &cl))
+				break;
+		}
+	}
+	/* Nothing to gain over a single read */
+	if (nr <= 1)
+		return;
+
+	DPRINTF(("fat_prefetch_dir: cl=%d sectors=%d\n", dir, nr));
+
+	uk_semaphore_init(&sem, 0);
+	buf = fmp->ra_buf;
+	for (nr_req = 0; nr_req < nr_run; nr_req++) {
+		uk_blkreq_init(&req[nr_req], UK_BLKREQ_READ,
+			       run[nr_req].sector, run[nr_req].count, buf,
+			       fat_ra_done, &sem);
+		error = uk_blkdev_queue_submit_one(fmp->dev, 0, &req[nr_req]);
+		if (!uk_blkdev_status_successful(error))
+			break;	/* queue is full, keep the runs submitted */
+		buf += run[nr_req].count * SEC_SIZE;
+	}
+	for (i = 0; i < nr_req; i++)
+		uk_semaphore_down(&sem);
+
+	/* Keep the leading runs read successfully */
+	for (i = 0; i < nr_req; i++) {
+		if (req[i].result < 0)
+			break;
+	}
+	fmp->nr_ra = i;
+	fmp->ra_dir = dir;
+}
+
 /*
  * Read directory entry to buffer, with cache.
+ * The buffer keeps the last sector read or written.
  */
 static int
 fat_read_dirent(struct fatfsmount *fmp, __u32 sec)
 {
+	char *buf;
+	int error;
+
+	if (sec == fmp->dir_sec)
+		return 0;
+
+	/* A deferred write goes out before the buffer is reused */
+	error = fatfs_flush_dirent(fmp);
+	if (error)
+		return error;
+
+	buf = fat_ra_find(fmp, sec);
+	if (buf != NULL) {
+		memcpy(fmp->dir_buf, buf, SEC_SIZE);
+		fmp->dir_sec = sec;
+		return 0;
+	}
+
 	/* PERF: prex used bread function which reads data from cache */
-	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec, 1, fmp->dir_buf);
+	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec, 1, fmp->dir_buf);
+	fmp->dir_sec = error ? SEC_INVAL : sec;
+	return error;
 }
 
 /*
  * Write directory entry from buffer.
+ * In a batch, the write is deferred until the buffer is reused or
+ * the batch ends, so that each sector filled is written once.
  */
 static int
 fat_write_dirent(struct fatfsmount *fmp, __u32 sec)
 {
-	/* PERF: prex used bwrite function which reads data from cache */
-	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec, 1, fmp->dir_buf);
+	char *buf;
+	int error = 0;
+
+	if (fmp->batch > 0) {
+		fmp->dir_sec = sec;
+		fmp->dir_dirty = 1;
+	} else {
+		/* PERF: prex used bwrite function which reads data from cache */
+		error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec, 1,
+					  fmp->dir_buf);
+		fmp->dir_sec = error ? SEC_INVAL : sec;
+	}
+
+	/* Keep the read-ahead copy coherent */
+	buf = fat_ra_find(fmp, sec);
+	if (buf != NULL) {
+		if (error)
+			fmp->nr_ra = 0;
+		else
+			memcpy(buf, fmp->dir_buf, SEC_SIZE);
+	}
+	return error;
+}
+
+/*
+ * Write back the directory sector held in dir_buf, if modified.
+ *
+ * @fmp: fatfs mount point
+ */
+int
+fatfs_flush_dirent(struct fatfsmount *fmp)
+{
+	int error;
+
+	if (!fmp->dir_dirty)
+		return 0;
+
+	fmp->dir_dirty = 0;
+	error = uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, fmp->dir_sec,
+				  1, fmp->dir_buf);
+	if (error) {
+		fatfs_ra_invalidate(fmp, fmp->dir_sec, 1);
+		fmp->dir_sec = SEC_INVAL;
+	}
+	return error;
+}
+
+/*
+ * Defer the writes of FAT and directory sectors.
+ * Batches nest, the sectors are written when the outermost one ends.
+ * The caller must hold the lock for the whole batch.
+ *
+ * @fmp: fatfs mount point
+ */
+void
+fatfs_batch_begin(struct fatfsmount *fmp)
+{
+
+	fmp->batch++;
+}
+
+/*
+ * End a batch of deferred writes.
+ *
+ * @fmp: fatfs mount point
+ */
+int
+fatfs_batch_end(struct fatfsmount *fmp)
+{
+	int error, error2;
+
+	if (--fmp->batch > 0)
+		return 0;
+	error = fatfs_flush_dirent(fmp);
+	error2 = fat_flush(fmp);
+	return error ? error : error2;
 }
 
+/*
+ * Mask of the slots before the end of directory in the sector.
+ */
+#define SLOTS_BEFORE(empty) \
+	((empty) ? (__u16)((1U << __builtin_ctz(empty)) - 1) : (__u16)0xffff)
+
 /*
  * Find directory entry in specified sector.
  * The fat vnode data is filled if success.
  *
  * @fmp: fatfs mount point
  * @sec: sector#
- * @name: file name
+ * @key: name key made by fat_make_key()
  * @node: pointer to fat node
  */
 static int
-fat_lookup_dirent(struct fatfsmount *fmp, __u32 sec, char *name,
+fat_lookup_dirent(struct fatfsmount *fmp, __u32 sec, char *key,
 		  struct fatfs_node *np)
 {
-	struct fat_dirent *de;
+	struct fat_slotmap map;
+	__u16 found;
 	int error, i;
 
 	error = fat_read_dirent(fmp, sec);
 	if (error)
 		return error;
 
-	de = (struct fat_dirent *)fmp->dir_buf;
-
-	for (i = 0; i < DIR_PER_SEC; i++) {
-		/* Find specific file or directory name */
-		if (IS_EMPTY(de))
-			return ENOENT;
-		if (!IS_VOL(de) &&
-		    !fat_compare_name((char *)de->name, name)) {
-			/* Found. Fill the fat vnode data. */
-			*(&np->dirent) = *de;
-			np->sector = sec;
-			np->offset = sizeof(struct fat_dirent) * i;
-			DPRINTF(("fat_lookup_dirent: found sec=%d\n", sec));
-			return 0;
-		}
-		if (!IS_DELETED(de))
-			DPRINTF(("fat_lookup_dirent: %s\n", de->name));
-		de++;
+	fat_scan_sector(fmp->dir_buf, key, &map);
+	found = map.match & ~map.vol & ~map.deleted & SLOTS_BEFORE(map.empty);
+	if (found) {
+		/* Found. Fill the fat vnode data. */
+		i = __builtin_ctz(found);
+		np->dirent = ((struct fat_dirent *)fmp->dir_buf)[i];
+		np->sector = sec;
+		np->offset = sizeof(struct fat_dirent) * i;
+		DPRINTF(("fat_lookup_dirent: found sec=%d\n", sec));
+		return 0;
 	}
-	return EAGAIN;
+	return map.empty ? ENOENT : EAGAIN;
 }
 
+#define IS_DOT(de)	((de)->name[0] == '.')
+
 /*
- * Find directory entry for specified name in directory.
- * The fat vnode data is filled if success.
- *
- * @dvp: vnode for directory.
- * @name: file name
- * @np: pointer to fat node
+ * Compare the order of two 8.3 names. Case is ignored.
  */
-int
-fatfs_lookup_node(struct vnode *dvp, char *name, struct fatfs_node *np)
+static int
+fat_order_name(char *n1, char *n2)
 {
-	struct fatfsmount *fmp;
-	char fat_name[12];
-	__u32 cl, sec, i;
-	int error;
-	struct fatfs_node *dnp;
-
-	if (name == NULL)
-		return ENOENT;
-
-	dnp = dvp->v_data;
+	int i, c1, c2;
 
-	DPRINTF(("fat_lookup_denode: cl=%d name=%s\n", dnp->dirent.cluster, name));
+	for (i = 0; i < 11; i++) {
+		c1 = toupper((int)(unsigned char)n1[i]);
+		c2 = toupper((int)(unsigned char)n2[i]);
+		if (c1 != c2)
+			return c1 - c2;
+	}
+	return 0;
+}
 
-	fat_convert_name(name, fat_name);
-	*(fat_name + 11) = '\0';
+/*
+ * Names collected while scanning a whole directory
+ */
+struct name_scan {
+	struct fatfs_dir *dp;		/* directory data */
+	__u32	cl;			/* cluster# being scanned */
+	__u32	*hash;			/* name hashes for Bloom filter */
+	__u32	nr_hash;		/* number of hashes */
+	__u32	max_hash;		/* size of hash array */
+	char	prev[11];		/* previous name */
+	int	nr_named;		/* number of names seen */
+	int	unsorted;		/* names are not in order */
+	struct fat_lfn lfn;		/* long name being collected */
+	char	lname[NAME_MAX + 1];	/* long name of the entry */
+};
 
-	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+/*
+ * Add a name hash for the Bloom filter.
+ */
+static int
+scan_add_hash(struct name_scan *ns, __u32 hash)
+{
+	__u32 *array;
 
-	cl = dnp->dirent.cluster;
-	if (cl == CL_ROOT) {
-		/* Search entry in root directory */
-		for (sec = fmp->root_start; sec < fmp->data_start; sec++) {
-			error = fat_lookup_dirent(fmp, sec, fat_name, np);
-			if (error != EAGAIN)
-				return error;
-		}
-	} else {
-		/* Search entry in sub directory */
-		while (!IS_EOFCL(fmp, cl)) {
-			sec = cl_to_sec(fmp, cl);
-			for (i = 0; i < fmp->sec_per_cl; i++) {
-				error = fat_lookup_dirent(fmp, sec, fat_name,
-						   np);
-				if (error != EAGAIN)
-					return error;
-				sec++;
-			}
-			error = fat_next_cluster(fmp, cl, &cl);
-			if (error)
-				return error;
-		}
+	if (ns->nr_hash == ns->max_hash) {
+		ns->max_hash = ns->max_hash ? ns->max_hash * 2 : 256;
+		array = realloc(ns->hash, ns->max_hash * sizeof(__u32));
+		if (array == NULL)
+			return ENOMEM;
+		ns->hash = array;
 	}
-	return ENOENT;
+	ns->hash[ns->nr_hash++] = hash;
+	return 0;
 }
 
 /*
- * Get directory entry for specified index in sector.
- * The directory entry is filled if success.
+ * Collect all directory entries in specified sector.
+ * The entries are added to the name index unless it overflows.
  *
  * @fmp: fatfs mount point
  * @sec: sector#
- * @target: target index
- * @index: current index
- * @np: pointer to fat node
+ * @ns: scan data
  */
 static int
-fat_get_dirent(struct fatfsmount *fmp, __u32 sec, int target, int *index,
-	       struct fatfs_node *np)
+fat_scan_dirent(struct fatfsmount *fmp, __u32 sec, struct name_scan *ns)
 {
+	struct fatfs_dir *dp = ns->dp;
 	struct fat_dirent *de;
-	int error, i;
+	struct fatfs_lfnpos lfn;
+	int error, i, has_lname;
 
 	error = fat_read_dirent(fmp, sec);
 	if (error)
 		return error;
 
 	de = (struct fat_dirent *)fmp->dir_buf;
+
 	for (i = 0; i < DIR_PER_SEC; i++) {
-		if (IS_EMPTY(de))
-			return ENOENT;
-		if (!IS_DELETED(de) && !IS_VOL(de)) {
-			/* valid file */
-			if (*index == target) {
-				*(&np->dirent) = *de;
-				np->sector = sec;
-				np->offset = sizeof(struct fat_dirent) * i;
-				DPRINTF(("fat_get_dirent: found index=%d\n", *index));
-				return 0;
-			}
-			(*index)++;
+		if (IS_EMPTY(de)) {
+			/* Remember the end of directory for insertion */
+			dp->eod_cl = ns->cl;
+			dp->eod.sector = sec;
+			dp->eod.offset = sizeof(struct fat_dirent) * i;
+			return 0;
+		}
+		if (IS_DELETED(de))
+			dp->nr_deleted++;
+		else
+			dp->nr_live++;
+		if (IS_DELETED(de) && dp->nr_free < DIR_FREE_MAX) {
+			dp->free[dp->nr_free].sector = sec;
+			dp->free[dp->nr_free].offset =
+				sizeof(struct fat_dirent) * i;
+			dp->nr_free++;
+		}
+		if (IS_DELETED(de) || IS_VOL(de)) {
+			if (!IS_DELETED(de) && IS_LFN(de))
+				fat_lfn_add(&ns->lfn, de, ns->cl, sec,
+					    sizeof(struct fat_dirent) * i);
+			else
+				fat_lfn_reset(&ns->lfn);
+			de++;
+			continue;
+		}
+		lfn = ns->lfn.pos;
+		lfn.nr = fat_lfn_check(&ns->lfn, de);
+		has_lname = lfn.nr > 0 &&
+			fat_lfn_name(&ns->lfn, ns->lname, sizeof(ns->lname)) == 0;
+		fat_lfn_reset(&ns->lfn);
+		if (!(dp->flags & DIR_NOINDEX)) {
+			error = fatfs_index_add(dp, de, sec,
+					sizeof(struct fat_dirent) * i, &lfn);
+			if (error == 0 && has_lname)
+				error = fatfs_lindex_add(dp, ns->lname, de->name);
+			if (error == ENOSPC) {
+				fatfs_index_free(dp);
+				dp->flags |= DIR_NOINDEX;
+			} else if (error)
+				return error;
+		}
+		error = scan_add_hash(ns, fat_hash_name((char *)de->name));
+		if (error == 0 && has_lname)
+			error = scan_add_hash(ns, fat_hash_lname(ns->lname));
+		if (error)
+			return error;
+		if (!IS_DOT(de)) {
+			if (ns->nr_named++ > 0 &&
+			    fat_order_name(ns->prev, (char *)de->name) >= 0)
+				ns->unsorted = 1;
+			memcpy(ns->prev, de->name, 11);
 		}
-		DPRINTF(("fat_get_dirent: %s\n", de->name));
 		de++;
 	}
 	return EAGAIN;
 }
 
 /*
- * Get directory entry for specified index.
+ * Build the name index of the directory by reading all entries.
+ * If the directory is too large to index, build a Bloom filter
+ * instead, so that most lookups of missing names need no I/O.
  *
- * @dvp: vnode for directory.
- * @index: index of the entry
- * @np: pointer to fat node
+ * @fmp: fatfs mount point
+ * @dp: directory data
  */
-int
-fatfs_get_node(struct vnode *dvp, int index, struct fatfs_node *np)
+static int
+fat_scan_names(struct fatfsmount *fmp, struct fatfs_dir *dp)
 {
-	struct fatfsmount *fmp;
+	struct name_scan ns;
 	__u32 cl, sec, i;
-	int cur_index, error;
-	struct fatfs_node *dnp;
+	int error = 0;
 
-	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
-	dnp = dvp->v_data;
+	DPRINTF(("fat_scan_names: cl=%d\n", dp->cluster));
 
-	cl = dnp->dirent.cluster;
-	cur_index = 0;
+	memset(&ns, 0, sizeof(ns));
+	ns.dp = dp;
+	fat_lfn_reset(&ns.lfn);
+	if (CONFIG_LIBFATFS_DIRINDEX_MAX == 0)
+		dp->flags |= DIR_NOINDEX;
 
-	DPRINTF(("fatfs_get_node: index=%d\n", index));
+	/* Slot hints are collected again */
+	dp->flags &= ~(DIR_EOD | DIR_COUNTED | DIR_SORTED);
+	dp->nr_free = 0;
+	dp->nr_live = 0;
+	dp->nr_deleted = 0;
+	dp->eod.sector = SEC_INVAL;
 
+	cl = dp->cluster;
+	ns.cl = cl;
+	fat_prefetch_dir(fmp, cl);
 	if (cl == CL_ROOT) {
-		if (index == 0) {
-			memcpy(np->dirent.name, ".          ", 11);
-			np->dirent.attr = FA_SUBDIR;
-			np->dirent.cluster = cl;
-			np->dirent.time = 0;
-			np->dirent.date = 0;
-			/* These fatfs nodes do not exist on disk! */
-			np->sector = __U32_MAX;
-			return 0;
-		}
-		if (index == 1) {
-			memcpy(np->dirent.name, "..         ", 11);
-			np->dirent.attr = FA_SUBDIR;
-			np->dirent.cluster = cl;
-			np->dirent.time = 0;
-			np->dirent.date = 0;
-			np->sector = __U32_MAX;
-			return 0;
-		}
-		/* Get entry from the root directory */
 		for (sec = fmp->root_start; sec < fmp->data_start; sec++) {
-			error = fat_get_dirent(fmp, sec, index - 2, &cur_index, np);
+			error = fat_scan_dirent(fmp, sec, &ns);
 			if (error != EAGAIN)
-				return error;
+				goto out;
 		}
 	} else {
-		/* Get entry from the sub directory */
 		while (!IS_EOFCL(fmp, cl)) {
+			ns.cl = cl;
 			sec = cl_to_sec(fmp, cl);
 			for (i = 0; i < fmp->sec_per_cl; i++) {
-				error = fat_get_dirent(fmp, sec, index,
-						     &cur_index, np);
+				error = fat_scan_dirent(fmp, sec, &ns);
 				if (error != EAGAIN)
-					return error;
+					goto out;
 				sec++;
 			}
 			error = fat_next_cluster(fmp, cl, &cl);
 			if (error)
-				return error;
+				goto out;
 		}
 	}
-	return ENOENT;
+	/* No empty slot, the directory must be expanded for a new entry */
+	error = 0;
+ out:
+	dp->flags &= ~DIR_SEEDING;
+	if (error) {
+		dp->nr_free = 0;
+		fatfs_index_free(dp);
+	} else {
+		dp->last_cl = ns.cl;
+		dp->flags |= DIR_EOD | DIR_COUNTED;
+		if (!ns.unsorted)
+			dp->flags |= DIR_SORTED;
+	}
+	if (error == 0 && dp->index == NULL) {
+		/* A directory shrunk under the limit is indexed again */
+		if (CONFIG_LIBFATFS_DIRINDEX_MAX > 0 &&
+		    dp->nr_live <= CONFIG_LIBFATFS_DIRINDEX_MAX)
+			dp->flags &= ~DIR_NOINDEX;
+		error = fatfs_bloom_init(dp, ns.hash, ns.nr_hash);
+	}
+	free(ns.hash);
+	return error;
 }
 
 /*
- * Find empty directory entry and put new entry on it.
- *
- * @fmp: fatfs mount point
- * @sec: sector#
- * @np: pointer to fat node
+ * Check if the first sector of the directory has the sorted marker.
  */
 static int
-fat_add_dirent(struct fatfsmount *fmp, __u32 sec, struct fatfs_node *np)
+fat_check_marker(struct fatfsmount *fmp, struct fatfs_dir *dp)
 {
 	struct fat_dirent *de;
-	int error;
-	__u32 i;
+	__u32 sec;
+	int error, i;
 
+	sec = (dp->cluster == CL_ROOT) ? fmp->root_start :
+		cl_to_sec(fmp, dp->cluster);
 	error = fat_read_dirent(fmp, sec);
 	if (error)
 		return error;
 
+	dp->flags |= DIR_MARKED;
 	de = (struct fat_dirent *)fmp->dir_buf;
-	for (i = 0; i < DIR_PER_SEC; i++) {
-		if (IS_DELETED(de) || IS_EMPTY(de))
-			goto found;
-		DPRINTF(("fat_add_dirent: scan %s\n", de->name));
-		de++;
+	for (i = 0; i < DIR_PER_SEC; i++, de++) {
+		if (IS_EMPTY(de))
+			break;
+		if (!IS_DELETED(de) && IS_VOL(de) &&
+		    !memcmp(de->name, SORTED_MARK, 11)) {
+			dp->flags |= DIR_SORTED;
+			break;
+		}
 	}
-	return ENOENT;
-
- found:
-	DPRINTF(("fat_add_dirent: found. sec=%d\n", sec));
-	memcpy(de, &np->dirent, sizeof(struct fat_dirent));
-	error = fat_write_dirent(fmp, sec);
-	return error;
+	return 0;
 }
 
 /*
- * Find empty directory entry and put new entry on it.
- * This search is done only in directory of specified cluster.
- * @dvp: vnode for directory.
- * @np: pointer to fat node
+ * Resolve the cluster chain of the directory for binary search.
  */
-int
-fatfs_add_node(struct vnode *dvp, struct fatfs_node *np)
+static int
+fat_dir_chain(struct fatfsmount *fmp, struct fatfs_dir *dp)
 {
-	struct fatfsmount *fmp;
-	__u32 cl, sec, i, next;
+	__u32 *chain, cl, max = 0;
 	int error;
-	struct fatfs_node *dnp;
-
-	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
-	dnp = dvp->v_data;
-	cl = dnp->dirent.cluster;
-
-	DPRINTF(("fatfs_add_node: cl=%d\n", cl));
 
-	if (cl == CL_ROOT) {
-		/* Add entry in root directory */
-		for (sec = fmp->root_start; sec < fmp->data_start; sec++) {
-			error = fat_add_dirent(fmp, sec, np);
-			if (error != ENOENT)
-				return error;
-		}
-	} else {
-		/* Search entry in sub directory */
-		while (!IS_EOFCL(fmp, cl)) {
-			sec = cl_to_sec(fmp, cl);
-			for (i = 0; i < fmp->sec_per_cl; i++) {
-				error = fat_add_dirent(fmp, sec, np);
-				if (error != ENOENT)
-					return error;
-				sec++;
-			}
-			error = fat_next_cluster(fmp, cl, &next);
-			if (error)
-				return error;
-			cl = next;
+	dp->nr_chain = 0;
+	for (cl = dp->cluster; !IS_EOFCL(fmp, cl); ) {
+		if (dp->nr_chain == max) {
+			max = max ? max * 2 : 16;
+			chain = realloc(dp->chain, max * sizeof(__u32));
+			if (chain == NULL)
+				return ENOMEM;
+			dp->chain = chain;
 		}
-		/* No entry found, add one more free cluster for directory */
-		DPRINTF(("fatfs_add_node: expand dir\n"));
-		error = fat_expand_dir(fmp, cl, &next);
+		dp->chain[dp->nr_chain++] = cl;
+		error = fat_next_cluster(fmp, cl, &cl);
 		if (error)
 			return error;
-
-		/* Initialize free cluster. */
-		memset(fmp->dir_buf, 0, SEC_SIZE);
-		sec = cl_to_sec(fmp, next);
-		for (i = 0; i < fmp->sec_per_cl; i++) {
-			error = fat_write_dirent(fmp, sec);
-			if (error)
-				return error;
-			sec++;
-		}
-		/* Try again */
-		sec = cl_to_sec(fmp, next);
-		error = fat_add_dirent(fmp, sec, np);
-		return error;
 	}
-	return ENOENT;
+	return 0;
 }
 
 /*
- * Put directory entry.
- * @fmp: fat mount data
+ * Binary search the sectors of a sorted directory for specified name.
+ * The fat vnode data is filled if success.
+ * Return EAGAIN if a sector has no name to compare with.
+ *
+ * @fmp: fatfs mount point
+ * @dp: directory data
+ * @name: file name
  * @np: pointer to fat node
  */
-int
-fatfs_put_node(struct fatfsmount *fmp, struct fatfs_node *np)
+static int
+fat_bsearch_dirent(struct fatfsmount *fmp, struct fatfs_dir *dp, char *name,
+		   struct fatfs_node *np)
 {
-	int error;
+	struct fat_dirent *de, *first, *last;
+	__u32 lo, hi, mid, sec;
+	int error, i, cmp;
+
+	if (dp->cluster == CL_ROOT)
+		hi = fmp->data_start - fmp->root_start;
+	else {
+		if (dp->chain == NULL || dp->nr_chain == 0) {
+			error = fat_dir_chain(fmp, dp);
+			if (error)
+				return error;
+		}
+		hi = dp->nr_chain * fmp->sec_per_cl;
+	}
+
+	lo = 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dp->cluster == CL_ROOT)
+			sec = fmp->root_start + mid;
+		else
+			sec = cl_to_sec(fmp, dp->chain[mid / fmp->sec_per_cl]) +
+				mid % fmp->sec_per_cl;
+		error = fat_read_dirent(fmp, sec);
+		if (error)
+			return error;
+
+		/* Find the first and last names in the sector */
+		first = last = NULL;
+		de = (struct fat_dirent *)fmp->dir_buf;
+		for (i = 0; i < DIR_PER_SEC; i++, de++) {
+			if (IS_EMPTY(de))
+				break;
+			if (IS_DELETED(de) || IS_VOL(de) || IS_DOT(de))
+				continue;
+			if (first == NULL)
+				first = de;
+			last = de;
+		}
+		if (first == NULL) {
+			if (i == DIR_PER_SEC)
+				return EAGAIN;
+			hi = mid;	/* end of directory */
+			continue;
+		}
+
+		if (fat_order_name(name, (char *)first->name) < 0) {
+			hi = mid;
+			continue;
+		}
+		if (fat_order_name(name, (char *)last->name) > 0) {
+			if (i < DIR_PER_SEC)
+				return ENOENT;
+			lo = mid + 1;
+			continue;
+		}
+		for (de = first; de <= last; de++) {
+			if (IS_DELETED(de) || IS_VOL(de) || IS_DOT(de))
+				continue;
+			cmp = fat_order_name(name, (char *)de->name);
+			if (cmp < 0)
+				break;
+			if (cmp == 0) {
+				np->dirent = *de;
+				np->sector = sec;
+				np->offset = (char *)de - fmp->dir_buf;
+				return 0;
+			}
+		}
+		return ENOENT;
+	}
+	return ENOENT;
+}
+
+/*
+ * Find the long name entries of the directory entry found by its
+ * short name, or read from its location. They are placed just before
+ * the entry, so they are read backward from it.
+ *
+ * @fmp: fatfs mount point
+ * @np: pointer to fat node
+ */
+int
+fatfs_find_lfn(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fat_lfn_dirent *le;
+	__u32 sec, cl, prev, next;
+	int slot, ord, error;
+	__u8 csum;
+
+	np->lfn.nr = 0;
+	sec = np->sector;
+	slot = np->offset / sizeof(struct fat_dirent);
+	if (np->dcluster == CL_ROOT)
+		cl = CL_ROOT;
+	else
+		cl = (sec - fmp->data_start) / fmp->sec_per_cl + CL_FIRST;
+	csum = fat_lfn_checksum(np->dirent.name);
+
+	for (ord = 1; ord <= LFN_ENTRIES; ord++) {
+		/* Step back to the previous slot */
+		if (slot == 0) {
+			if (cl == CL_ROOT) {
+				if (sec == fmp->root_start)
+					return 0;
+			} else if (sec == cl_to_sec(fmp, cl)) {
+				/* Find the previous cluster in the chain */
+				if (cl == np->dcluster)
+					return 0;
+				prev = np->dcluster;
+				for (;;) {
+					error = fat_next_cluster(fmp, prev, &next);
+					if (error)
+						return error;
+					if (next == cl)
+						break;
+					if (IS_EOFCL(fmp, next))
+						return 0;
+					prev = next;
+				}
+				cl = prev;
+				sec = cl_to_sec(fmp, cl) + fmp->sec_per_cl;
+			}
+			sec--;
+			slot = DIR_PER_SEC;
+		}
+		slot--;
+
+		error = fat_read_dirent(fmp, sec);
+		if (error)
+			return error;
+		le = (struct fat_lfn_dirent *)fmp->dir_buf + slot;
+		if (IS_DELETED((struct fat_dirent *)le) ||
+		    !IS_LFN((struct fat_dirent *)le) || le->csum != csum ||
+		    (le->ord & LFN_ORD_MASK) != ord)
+			return 0;
+		if (le->ord & LFN_LAST) {
+			np->lfn.cluster = cl;
+			np->lfn.sector = sec;
+			np->lfn.offset = sizeof(struct fat_dirent) * slot;
+			np->lfn.nr = ord;
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find directory entry for specified short name in directory.
+ * The fat vnode data is filled if success.
+ *
+ * @dvp: vnode for directory.
+ * @fat_name: file name in 8.3 format
+ * @np: pointer to fat node
+ */
+static int
+fat_lookup_sfn(struct vnode *dvp, char *fat_name, struct fatfs_node *np)
+{
+	struct fatfsmount *fmp;
+	char key[FAT_KEY_SIZE];
+	__u32 cl, sec, i;
+	int error;
+	struct fatfs_node *dnp;
+	struct fatfs_dir *dp;
+	struct fatfs_index *ip;
+
+	dnp = dvp->v_data;
+	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+
+	cl = dnp->dirent.cluster;
+	np->dcluster = cl;
+
+	/*
+	 * Try the name index or the Bloom filter first. They are
+	 * built on the first lookup in the directory.
+	 */
+	dp = fatfs_dir_get(fmp, cl);
+
+	/*
+	 * Sorted directories on read-only mounts are binary searched,
+	 * unless they have been indexed.
+	 */
+	if (dp != NULL && (dvp->v_mount->m_flags & MNT_RDONLY)) {
+		if (!(dp->flags & DIR_MARKED) &&
+		    dp->index == NULL && dp->bloom == NULL)
+			fat_check_marker(fmp, dp);
+		if ((dp->flags & DIR_SORTED) && dp->index == NULL) {
+			error = fat_bsearch_dirent(fmp, dp, fat_name, np);
+			if (error == 0)
+				return fatfs_find_lfn(fmp, np);
+			if (error != EAGAIN)
+				return error;
+			dp->flags &= ~DIR_SORTED;
+		}
+	}
+
+	if (dp != NULL && ((dp->index == NULL && dp->bloom == NULL) ||
+			   (dp->flags & DIR_SEEDING)))
+		fat_scan_names(fmp, dp);
+	if (dp != NULL && dp->index != NULL) {
+		ip = fatfs_index_lookup(dp, fat_name);
+		if (ip == NULL)
+			return ENOENT;
+		np->dirent = ip->dirent;
+		np->sector = ip->sector;
+		np->offset = ip->offset;
+		np->lfn = ip->lfn;
+		return 0;
+	}
+	if (dp != NULL && dp->bloom != NULL &&
+	    !fatfs_bloom_test(dp, fat_hash_name(fat_name)))
+		return ENOENT;
+
+	fat_prefetch_dir(fmp, cl);
+	fat_make_key(fat_name, key);
+	if (cl == CL_ROOT) {
+		/* Search entry in root directory */
+		for (sec = fmp->root_start; sec < fmp->data_start; sec++) {
+			error = fat_lookup_dirent(fmp, sec, key, np);
+			if (error != EAGAIN)
+				goto out;
+		}
+	} else {
+		/* Search entry in sub directory */
+		while (!IS_EOFCL(fmp, cl)) {
+			sec = cl_to_sec(fmp, cl);
+			for (i = 0; i < fmp->sec_per_cl; i++) {
+				error = fat_lookup_dirent(fmp, sec, key, np);
+				if (error != EAGAIN)
+					goto out;
+				sec++;
+			}
+			error = fat_next_cluster(fmp, cl, &cl);
+			if (error)
+				return error;
+		}
+	}
+	return ENOENT;
+ out:
+	if (error == 0)
+		error = fatfs_find_lfn(fmp, np);
+	return error;
+}
+
+/*
+ * Find directory entry for specified long name in directory.
+ * The fat vnode data is filled if success.
+ *
+ * @dvp: vnode for directory.
+ * @name: long file name
+ * @np: pointer to fat node
+ */
+static int
+fat_lookup_long(struct vnode *dvp, char *name, struct fatfs_node *np)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp;
+	struct fatfs_dir *dp;
+	struct fatfs_index *ip;
+	struct fatfs_dirpos pos;
+	char lname[NAME_MAX + 1];
+	int error;
+
+	if (!fat_valid_lname(name))
+		return ENOENT;
+
+	dnp = dvp->v_data;
+	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+	np->dcluster = dnp->dirent.cluster;
+
+	dp = fatfs_dir_get(fmp, dnp->dirent.cluster);
+	if (dp != NULL && ((dp->index == NULL && dp->bloom == NULL) ||
+			   (dp->flags & DIR_SEEDING)))
+		fat_scan_names(fmp, dp);
+	if (dp != NULL && dp->index != NULL) {
+		ip = fatfs_lindex_lookup(dp, name);
+		if (ip == NULL)
+			return ENOENT;
+		np->dirent = ip->dirent;
+		np->sector = ip->sector;
+		np->offset = ip->offset;
+		np->lfn = ip->lfn;
+		return 0;
+	}
+	if (dp != NULL && dp->bloom != NULL &&
+	    !fatfs_bloom_test(dp, fat_hash_lname(name)))
+		return ENOENT;
+
+	/* Read all entries with their long names */
+	memset(&pos, 0, sizeof(pos));
+	pos.sector = SEC_INVAL;
+	for (;;) {
+		error = fatfs_read_node(dvp, &pos, np, lname);
+		if (error)
+			return error;
+		if (np->lfn.nr > 0 && !strcasecmp(lname, name))
+			return 0;
+	}
+}
+
+/*
+ * Find directory entry for specified name in directory.
+ * The fat vnode data is filled if success.
+ *
+ * Names which are not valid in 8.3 format are looked up by their
+ * long names.
+ *
+ * @dvp: vnode for directory.
+ * @name: file name
+ * @np: pointer to fat node
+ */
+int
+fatfs_lookup_node(struct vnode *dvp, char *name, struct fatfs_node *np)
+{
+	char fat_name[12];
+
+	if (name == NULL || NODE_REMOVED((struct fatfs_node *)dvp->v_data))
+		return ENOENT;
+
+	DPRINTF(("fat_lookup_denode: cl=%d name=%s\n",
+		 ((struct fatfs_node *)dvp->v_data)->dirent.cluster, name));
+
+	if (!fat_valid_name(name))
+		return fat_lookup_long(dvp, name, np);
+
+	fat_convert_name(name, fat_name);
+	*(fat_name + 11) = '\0';
+	return fat_lookup_sfn(dvp, fat_name, np);
+}
+
+/*
+ * Advance the directory position to the next entry slot.
+ * Return ENOENT at the end of the directory.
+ *
+ * @fmp: fatfs mount point
+ * @pos: directory position
+ */
+static int
+fat_next_slot(struct fatfsmount *fmp, struct fatfs_dirpos *pos)
+{
+	__u32 cl;
+	int error;
+
+	if (++pos->slot < DIR_PER_SEC)
+		return 0;
+	pos->slot = 0;
+	pos->sector++;
+
+	if (pos->cluster == CL_ROOT)
+		return (pos->sector < fmp->data_start) ? 0 : ENOENT;
+
+	if (pos->sector < cl_to_sec(fmp, pos->cluster) + fmp->sec_per_cl)
+		return 0;
+	error = fat_next_cluster(fmp, pos->cluster, &cl);
+	if (error)
+		return error;
+	if (IS_EOFCL(fmp, cl))
+		return ENOENT;
+	pos->cluster = cl;
+	pos->sector = cl_to_sec(fmp, cl);
+	return 0;
+}
+
+/*
+ * Fill the node for the fake "." or ".." entry of the root directory.
+ */
+static void
+fat_root_dot(int index, struct fatfs_node *np)
+{
+	memcpy(np->dirent.name, index ? "..         " : ".          ", 11);
+	np->dirent.attr = FA_SUBDIR;
+	np->dirent.cluster = CL_ROOT;
+	np->dirent.time = 0;
+	np->dirent.date = 0;
+	np->lfn.nr = 0;
+	/* These fatfs nodes do not exist on disk! */
+	np->sector = __U32_MAX;
+}
+
+/*
+ * Get the next directory entry for the directory position.
+ * The directory entry is filled and the position is advanced if success.
+ *
+ * The position remembers the slot of the last returned entry, so the
+ * next call continues from there. If the position is not set, or the
+ * directory layout has changed, entries are counted from the start of
+ * the directory up to pos->index.
+ *
+ * The long name entries before the entry are collected on the way.
+ *
+ * @dvp: vnode for directory.
+ * @pos: directory position
+ * @np: pointer to fat node
+ * @lname: buffer of NAME_MAX + 1 bytes for long name, or NULL.
+ *         It is set empty if the entry has no long name.
+ */
+int
+fatfs_read_node(struct vnode *dvp, struct fatfs_dirpos *pos,
+		struct fatfs_node *np, char *lname)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp;
+	struct fatfs_dir *dp;
+	struct fatfs_dirpos cur;
+	struct fat_dirent *de;
+	struct fat_lfn lfn;
+	__u32 sec;
+	int skip, error;
+
+	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	np->dcluster = dnp->dirent.cluster;
+	if (NODE_REMOVED(dnp))
+		return ENOENT;
+
+	DPRINTF(("fatfs_read_node: index=%d\n", pos->index));
+
+	if (lname != NULL)
+		*lname = '\0';
+
+	if (dnp->dirent.cluster == CL_ROOT && pos->index < 2) {
+		fat_root_dot(pos->index, np);
+		pos->index++;
+		pos->sector = SEC_INVAL;
+		return 0;
+	}
+
+	dp = fatfs_dir_get(fmp, dnp->dirent.cluster);
+	cur = *pos;
+	if (cur.sector != SEC_INVAL && dp != NULL && cur.gen == dp->gen) {
+		/* Continue after the last returned entry */
+		skip = 0;
+		error = fat_next_slot(fmp, &cur);
+		if (error)
+			return error;
+	} else {
+		/* Count entries from the start of the directory */
+		skip = pos->index;
+		cur.cluster = dnp->dirent.cluster;
+		if (cur.cluster == CL_ROOT) {
+			skip -= 2;
+			cur.sector = fmp->root_start;
+		} else
+			cur.sector = cl_to_sec(fmp, cur.cluster);
+		cur.slot = 0;
+		cur.gen = dp ? dp->gen : 0;
+		fat_prefetch_dir(fmp, cur.cluster);
+	}
+
+	error = fat_read_dirent(fmp, cur.sector);
+	if (error)
+		return error;
+	fat_lfn_reset(&lfn);
+	for (;;) {
+		de = (struct fat_dirent *)fmp->dir_buf + cur.slot;
+		if (IS_EMPTY(de))
+			return ENOENT;
+		if (IS_DELETED(de) || IS_VOL(de)) {
+			if (!IS_DELETED(de) && IS_LFN(de))
+				fat_lfn_add(&lfn, de, cur.cluster, cur.sector,
+					    sizeof(struct fat_dirent) * cur.slot);
+			else
+				fat_lfn_reset(&lfn);
+		} else {
+			if (skip == 0)
+				break;
+			skip--;
+			fat_lfn_reset(&lfn);
+		}
+		sec = cur.sector;
+		error = fat_next_slot(fmp, &cur);
+		if (error)
+			return error;
+		if (cur.sector != sec) {
+			error = fat_read_dirent(fmp, cur.sector);
+			if (error)
+				return error;
+		}
+	}
+
+	np->dirent = *de;
+	np->sector = cur.sector;
+	np->offset = sizeof(struct fat_dirent) * cur.slot;
+	np->lfn = lfn.pos;
+	np->lfn.nr = fat_lfn_check(&lfn, de);
+	if (lname != NULL && np->lfn.nr > 0 &&
+	    fat_lfn_name(&lfn, lname, NAME_MAX + 1))
+		*lname = '\0';
+	cur.index++;
+	*pos = cur;
+	return 0;
+}
+
+/*
+ * Get directory entry for specified index.
+ *
+ * @dvp: vnode for directory.
+ * @index: index of the entry
+ * @np: pointer to fat node
+ */
+int
+fatfs_get_node(struct vnode *dvp, int index, struct fatfs_node *np)
+{
+	struct fatfs_dirpos pos;
+
+	DPRINTF(("fatfs_get_node: index=%d\n", index));
+
+	pos.sector = SEC_INVAL;
+	pos.index = index;
+	return fatfs_read_node(dvp, &pos, np, NULL);
+}
+
+/*
+ * Put new entry on the free directory slot.
+ * Return ENOENT if the slot is in use.
+ *
+ * @fmp: fatfs mount point
+ * @sec: sector#
+ * @offset: offset of the slot in sector
+ * @np: pointer to fat node
+ */
+static int
+fat_add_dirent_at(struct fatfsmount *fmp, __u32 sec, __u32 offset,
+		  struct fatfs_node *np)
+{
+	struct fat_dirent *de, old;
+	int error;
+
+	error = fat_read_dirent(fmp, sec);
+	if (error)
+		return error;
+
+	de = (struct fat_dirent *)(fmp->dir_buf + offset);
+	if (!IS_DELETED(de) && !IS_EMPTY(de))
+		return ENOENT;
+
+	DPRINTF(("fat_add_dirent: found. sec=%d\n", sec));
+	old = *de;
+	memcpy(de, &np->dirent, sizeof(struct fat_dirent));
+	error = fat_write_dirent(fmp, sec);
+	if (error)
+		return error;
+
+	np->sector = sec;
+	np->offset = offset;
+	fatfs_dir_update(fmp, &old, np);
+	return 0;
+}
+
+/*
+ * Check the entries in specified sector for a duplicate name, and
+ * remember the first free slot on the way.
+ * Return 0 at the end of directory, EAGAIN to continue with the
+ * next sector.
+ *
+ * @fmp: fatfs mount point
+ * @sec: sector#
+ * @key: name key made by fat_make_key()
+ * @slot: first free slot, or SEC_INVAL
+ */
+static int
+fat_find_slot(struct fatfsmount *fmp, __u32 sec, char *key,
+	      struct fatfs_slot *slot)
+{
+	struct fat_slotmap map;
+	__u16 used, free;
+	int error;
+
+	error = fat_read_dirent(fmp, sec);
+	if (error)
+		return error;
+
+	fat_scan_sector(fmp->dir_buf, key, &map);
+	used = SLOTS_BEFORE(map.empty);
+	if (map.match & ~map.vol & ~map.deleted & used)
+		return EEXIST;
+
+	free = (map.deleted & used) | map.empty;
+	if (free && slot->sector == SEC_INVAL) {
+		slot->sector = sec;
+		slot->offset = sizeof(struct fat_dirent) * __builtin_ctz(free);
+	}
+	/* No entry exists after the end of directory */
+	return map.empty ? 0 : EAGAIN;
+}
+
+/*
+ * Add one more cluster to the directory and clear it.
+ *
+ * @fmp: fatfs mount point
+ * @cl: cluster# of directory, preferably its last one
+ * @new_cl: added cluster#
+ */
+static int
+fat_grow_dir(struct fatfsmount *fmp, __u32 cl, __u32 *new_cl)
+{
+	__u32 sec, i;
+	int error;
+
+	DPRINTF(("fatfs_add_node: expand dir\n"));
+	error = fat_expand_dir(fmp, cl, new_cl);
+	if (error)
+		return error;
+
+	/* Initialize free cluster. */
+	error = fatfs_flush_dirent(fmp);
+	if (error)
+		return error;
+	fmp->dir_sec = SEC_INVAL;
+	memset(fmp->dir_buf, 0, SEC_SIZE);
+	sec = cl_to_sec(fmp, *new_cl);
+	for (i = 0; i < fmp->sec_per_cl; i++) {
+		error = fat_write_dirent(fmp, sec);
+		if (error)
+			return error;
+		sec++;
+	}
+	return 0;
+}
+
+/*
+ * Move the end of directory hint to the next slot.
+ *
+ * @fmp: fatfs mount point
+ * @dp: directory data
+ */
+static int
+fat_next_eod(struct fatfsmount *fmp, struct fatfs_dir *dp)
+{
+	struct fatfs_dirpos pos;
+	int error;
+
+	pos.cluster = dp->eod_cl;
+	pos.sector = dp->eod.sector;
+	pos.slot = dp->eod.offset / sizeof(struct fat_dirent);
+	error = fat_next_slot(fmp, &pos);
+	if (error == ENOENT) {
+		/* The directory is full */
+		dp->last_cl = pos.cluster;
+		dp->eod.sector = SEC_INVAL;
+		return 0;
+	}
+	if (error)
+		return error;
+	dp->eod_cl = pos.cluster;
+	dp->eod.sector = pos.sector;
+	dp->eod.offset = sizeof(struct fat_dirent) * pos.slot;
+	return 0;
+}
+
+/*
+ * Put new entry on a slot known from the directory data, without
+ * scanning the directory. Deleted slots are reused first, then the
+ * entry is appended at the end of directory.
+ * Return EAGAIN if the free slots are not known.
+ *
+ * @fmp: fatfs mount point
+ * @dp: directory data
+ * @np: pointer to fat node
+ */
+static int
+fat_add_hint(struct fatfsmount *fmp, struct fatfs_dir *dp,
+	     struct fatfs_node *np)
+{
+	struct fatfs_slot slot;
+	__u32 next;
+	int error;
+
+	while (dp->nr_free > 0) {
+		slot = dp->free[--dp->nr_free];
+		error = fat_add_dirent_at(fmp, slot.sector, slot.offset, np);
+		if (error != ENOENT)
+			return error;
+	}
+
+	if (!(dp->flags & DIR_EOD))
+		return EAGAIN;
+
+	if (dp->eod.sector == SEC_INVAL) {
+		if (dp->cluster == CL_ROOT)
+			return ENOENT;	/* root directory is full */
+		error = fat_grow_dir(fmp, dp->last_cl, &next);
+		if (error)
+			return error;
+		dp->eod_cl = next;
+		dp->eod.sector = cl_to_sec(fmp, next);
+		dp->eod.offset = 0;
+	}
+
+	error = fat_add_dirent_at(fmp, dp->eod.sector, dp->eod.offset, np);
+	if (error == ENOENT) {
+		/* Stale hint */
+		dp->flags &= ~DIR_EOD;
+		return EAGAIN;
+	}
+	if (error)
+		return error;
+
+	error = fat_next_eod(fmp, dp);
+	if (error)
+		dp->flags &= ~DIR_EOD;
+	else
+		dp->flags |= DIR_EOD;
+	return 0;
+}
+
+/*
+ * Put new entry in the directory. Return EEXIST if the name is
+ * already used.
+ *
+ * The duplicate check and the search of a free slot are done in the
+ * same pass. The name index and the slot hints replace the pass
+ * when they are available.
+ *
+ * @dvp: vnode for directory.
+ * @np: pointer to fat node
+ */
+int
+fatfs_add_node(struct vnode *dvp, struct fatfs_node *np)
+{
+	struct fatfsmount *fmp;
+	char *name, key[FAT_KEY_SIZE];
+	__u32 cl, last, sec, i, next;
+	int error;
+	struct fatfs_node *dnp;
+	struct fatfs_dir *dp;
+	struct fatfs_slot slot;
+
+	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	cl = dnp->dirent.cluster;
+	np->dcluster = cl;
+	np->lfn.nr = 0;
+	name = (char *)np->dirent.name;
+
+	DPRINTF(("fatfs_add_node: cl=%d\n", cl));
+
+	dp = fatfs_dir_get(fmp, cl);
+	if (dp != NULL && ((dp->index == NULL && dp->bloom == NULL) ||
+			   (dp->flags & DIR_SEEDING)))
+		fat_scan_names(fmp, dp);
+	if (dp != NULL && (dp->index != NULL || (dp->bloom != NULL &&
+	    !fatfs_bloom_test(dp, fat_hash_name(name))))) {
+		if (dp->index != NULL && fatfs_index_lookup(dp, name) != NULL)
+			return EEXIST;
+		error = fat_add_hint(fmp, dp, np);
+		if (error != EAGAIN)
+			return error;
+	}
+
+	slot.sector = SEC_INVAL;
+	fat_prefetch_dir(fmp, cl);
+	fat_make_key(name, key);
+	if (cl == CL_ROOT) {
+		/* Scan root directory */
+		for (sec = fmp->root_start; sec < fmp->data_start; sec++) {
+			error = fat_find_slot(fmp, sec, key, &slot);
+			if (error == 0)
+				break;
+			if (error != EAGAIN)
+				return error;
+		}
+		if (slot.sector == SEC_INVAL)
+			return ENOENT;
+	} else {
+		/* Scan sub directory */
+		last = cl;
+		while (!IS_EOFCL(fmp, cl)) {
+			sec = cl_to_sec(fmp, cl);
+			for (i = 0; i < fmp->sec_per_cl; i++) {
+				error = fat_find_slot(fmp, sec, key, &slot);
+				if (error == 0)
+					goto found;
+				if (error != EAGAIN)
+					return error;
+				sec++;
+			}
+			last = cl;
+			error = fat_next_cluster(fmp, cl, &next);
+			if (error)
+				return error;
+			cl = next;
+		}
+		if (slot.sector == SEC_INVAL) {
+			/* No free entry, add one more cluster for directory */
+			error = fat_grow_dir(fmp, last, &next);
+			if (error)
+				return error;
+			slot.sector = cl_to_sec(fmp, next);
+			slot.offset = 0;
+		}
+	}
+ found:
+	return fat_add_dirent_at(fmp, slot.sector, slot.offset, np);
+}
+
+/*
+ * Find a run of free slots for the entries of a long name.
+ * The run may continue after the end of directory, where the
+ * directory is expanded as needed. If the sector of the run is
+ * SEC_INVAL, it starts in a new cluster after run->cluster.
+ *
+ * @fmp: fatfs mount point
+ * @cl: cluster# of directory
+ * @nr: number of slots
+ * @run: first slot of the run to return
+ */
+static int
+fat_find_run(struct fatfsmount *fmp, __u32 cl, int nr,
+	     struct fatfs_dirpos *run)
+{
+	struct fatfs_dirpos pos;
+	struct fat_dirent *de;
+	int len = 0, error;
+
+	pos.cluster = cl;
+	pos.sector = (cl == CL_ROOT) ? fmp->root_start : cl_to_sec(fmp, cl);
+	pos.slot = 0;
+	fat_prefetch_dir(fmp, cl);
+	for (;;) {
+		error = fat_read_dirent(fmp, pos.sector);
+		if (error)
+			return error;
+		de = (struct fat_dirent *)fmp->dir_buf + pos.slot;
+		if (IS_DELETED(de) || IS_EMPTY(de)) {
+			if (len++ == 0)
+				*run = pos;
+			if (len == nr)
+				return 0;
+			/* No entry exists after the end of directory */
+			if (IS_EMPTY(de) && cl != CL_ROOT)
+				return 0;
+		} else
+			len = 0;
+		error = fat_next_slot(fmp, &pos);
+		if (error == ENOENT)
+			break;
+		if (error)
+			return error;
+	}
+	if (cl == CL_ROOT)
+		return ENOENT;	/* root directory is full */
+	if (len == 0) {
+		run->cluster = pos.cluster;
+		run->sector = SEC_INVAL;
+	}
+	return 0;
+}
+
+/*
+ * Take back the first entries of a run written by fat_put_run().
+ * The index is set back also for the entries which did not reach
+ * the disk.
+ *
+ * @fmp: fatfs mount point
+ * @np: pointer to fat node, with the first slot of the run
+ * @ent: entries of the run
+ * @nr: number of entries to take back
+ */
+static void
+fat_drop_run(struct fatfsmount *fmp, struct fatfs_node *np,
+	     struct fat_dirent *ent, int nr)
+{
+	struct fatfs_node tmp;
+	struct fatfs_dirpos pos;
+	struct fat_dirent *de;
+	int i, dirty = 0;
+
+	pos.cluster = np->lfn.cluster;
+	pos.sector = np->lfn.sector;
+	pos.slot = np->lfn.offset / sizeof(struct fat_dirent);
+	tmp.dcluster = np->dcluster;
+	tmp.lfn.nr = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (i > 0) {
+			if (pos.slot == DIR_PER_SEC - 1 && dirty) {
+				fat_write_dirent(fmp, pos.sector);
+				dirty = 0;
+			}
+			if (fat_next_slot(fmp, &pos))
+				break;
+		}
+		tmp.dirent = ent[i];
+		tmp.dirent.name[0] = 0xe5;
+		tmp.sector = pos.sector;
+		tmp.offset = sizeof(struct fat_dirent) * pos.slot;
+		fatfs_dir_update(fmp, &ent[i], &tmp);
+
+		if (fat_read_dirent(fmp, pos.sector))
+			continue;
+		de = (struct fat_dirent *)fmp->dir_buf + pos.slot;
+		if (!memcmp(de, &ent[i], sizeof(struct fat_dirent))) {
+			de->name[0] = 0xe5;
+			dirty = 1;
+		}
+	}
+	if (dirty)
+		fat_write_dirent(fmp, pos.sector);
+	np->lfn.nr = 0;
+}
+
+/*
+ * Write the entries of a long name on a run of free slots. The last
+ * entry is the short name entry of the node.
+ * Return EAGAIN if the first slot is not free. On other errors the
+ * entries written are taken back, so no orphan long name is left.
+ *
+ * @fmp: fatfs mount point
+ * @pos: first slot of the run, the last slot to return
+ * @ent: long name entries and short name entry
+ * @nr: number of entries
+ * @np: pointer to fat node
+ * @eod: set if the end of directory is moved
+ */
+static int
+fat_put_run(struct fatfsmount *fmp, struct fatfs_dirpos *pos,
+	    struct fat_dirent *ent, int nr, struct fatfs_node *np, int *eod)
+{
+	struct fatfs_node tmp;
+	struct fat_dirent *de, old;
+	__u32 next;
+	int i, error;
+
+	for (i = 0; i < nr; i++) {
+		if (i > 0)
+			error = fat_next_slot(fmp, pos);
+		else
+			error = (pos->sector == SEC_INVAL) ? ENOENT : 0;
+		if (error == ENOENT && pos->cluster != CL_ROOT) {
+			error = fat_grow_dir(fmp, pos->cluster, &next);
+			if (error)
+				goto fail;
+			pos->cluster = next;
+			pos->sector = cl_to_sec(fmp, next);
+			pos->slot = 0;
+		} else if (error)
+			goto fail;
+
+		error = fat_read_dirent(fmp, pos->sector);
+		if (error)
+			goto fail;
+		de = (struct fat_dirent *)fmp->dir_buf + pos->slot;
+		if (!IS_DELETED(de) && !IS_EMPTY(de)) {
+			error = (i == 0) ? EAGAIN : EIO;
+			goto fail;
+		}
+		if (IS_EMPTY(de))
+			*eod = 1;
+		old = *de;
+		*de = ent[i];
+		if (i == nr - 1 || pos->slot == DIR_PER_SEC - 1) {
+			error = fat_write_dirent(fmp, pos->sector);
+			if (error)
+				goto fail;
+		}
+
+		if (i == 0) {
+			np->lfn.cluster = pos->cluster;
+			np->lfn.sector = pos->sector;
+			np->lfn.offset = sizeof(struct fat_dirent) * pos->slot;
+			np->lfn.nr = nr - 1;
+		}
+		if (i == nr - 1) {
+			np->sector = pos->sector;
+			np->offset = sizeof(struct fat_dirent) * pos->slot;
+			fatfs_dir_update(fmp, &old, np);
+		} else {
+			tmp.dirent = ent[i];
+			tmp.sector = pos->sector;
+			tmp.offset = sizeof(struct fat_dirent) * pos->slot;
+			tmp.dcluster = np->dcluster;
+			tmp.lfn.nr = 0;
+			fatfs_dir_update(fmp, &old, &tmp);
+		}
+	}
+	return 0;
+
+ fail:
+	/* The entries before the i-th one are in the index */
+	if (i > 0)
+		fat_drop_run(fmp, np, ent, i);
+	return error;
+}
+
+/*
+ * Put new entry with a long name in the directory. A unique short
+ * name with numeric tail is made for the entry.
+ * Return EEXIST if the name is already used by another entry.
+ *
+ * @dvp: vnode for directory.
+ * @np: pointer to fat node
+ * @name: long file name
+ * @self: entry renamed to a name matching its own, or NULL
+ */
+int
+fatfs_add_long(struct vnode *dvp, struct fatfs_node *np, char *name,
+	       struct fatfs_node *self)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp, tmp;
+	struct fatfs_dir *dp;
+	struct fatfs_dirpos pos;
+	struct fat_dirent ent[LFN_ENTRIES + 1];
+	char sfn[12];
+	__u32 cl;
+	int tail, nr, eod = 0, error;
+
+	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	cl = dnp->dirent.cluster;
+	np->dcluster = cl;
+
+	DPRINTF(("fatfs_add_long: cl=%d name=%s\n", cl, name));
+
+	error = fat_lookup_long(dvp, name, &tmp);
+	if (error == 0 && (self == NULL || tmp.sector != self->sector ||
+			   tmp.offset != self->offset))
+		return EEXIST;
+	if (error != 0 && error != ENOENT)
+		return error;
+
+	/* Find a short name not used yet */
+	sfn[11] = '\0';
+	for (tail = 1; ; tail++) {
+		if (tail > SFN_TAIL_MAX)
+			return EEXIST;
+		fat_make_sfn(name, tail, sfn);
+		error = fat_lookup_sfn(dvp, sfn, &tmp);
+		if (error == ENOENT)
+			break;
+		if (error)
+			return error;
+	}
+	memcpy(np->dirent.name, sfn, 11);
+
+	error = fat_lfn_build(name, np->dirent.name, ent, &nr);
+	if (error)
+		return error;
+	ent[nr++] = np->dirent;
+
+	/* Append at the end of directory if it is known */
+	dp = fatfs_dir_get(fmp, cl);
+	error = EAGAIN;
+	if (dp != NULL && (dp->flags & DIR_EOD)) {
+		pos.cluster = dp->eod_cl;
+		pos.slot = dp->eod.offset / sizeof(struct fat_dirent);
+		if (dp->eod.sector != SEC_INVAL) {
+			pos.sector = dp->eod.sector;
+			if (cl != CL_ROOT || (fmp->data_start - pos.sector) *
+			    DIR_PER_SEC - pos.slot >= (__u32)nr)
+				error = fat_put_run(fmp, &pos, ent, nr, np,
+						    &eod);
+		} else if (cl != CL_ROOT) {
+			pos.cluster = dp->last_cl;
+			pos.sector = SEC_INVAL;
+			error = fat_put_run(fmp, &pos, ent, nr, np, &eod);
+		}
+	}
+	if (error == EAGAIN) {
+		error = fat_find_run(fmp, cl, nr, &pos);
+		if (error)
+			return error;
+		error = fat_put_run(fmp, &pos, ent, nr, np, &eod);
+	}
+	if (error)
+		return error;
+
+	if (dp != NULL && eod) {
+		/* The slot after the run is the new end of directory */
+		dp->eod_cl = pos.cluster;
+		dp->eod.sector = pos.sector;
+		dp->eod.offset = sizeof(struct fat_dirent) * pos.slot;
+		if (fat_next_eod(fmp, dp))
+			dp->flags &= ~DIR_EOD;
+		else
+			dp->flags |= DIR_EOD;
+	}
+	fatfs_dir_add_lname(fmp, np, name);
+	return 0;
+}
+
+/*
+ * Put new entry in the directory, with a long name if the name is
+ * not valid in 8.3 format.
+ *
+ * @dvp: vnode for directory.
+ * @np: pointer to fat node
+ * @name: file name
+ */
+int
+fatfs_add_name(struct vnode *dvp, struct fatfs_node *np, char *name)
+{
+	if (NODE_REMOVED((struct fatfs_node *)dvp->v_data))
+		return ENOENT;
+	if (fat_valid_name(name)) {
+		fat_convert_name(name, (char *)np->dirent.name);
+		return fatfs_add_node(dvp, np);
+	}
+	return fatfs_add_long(dvp, np, name, NULL);
+}
+
+/*
+ * Delete the long name entries of the node.
+ * This is called after its short name entry is deleted.
+ *
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ */
+int
+fatfs_del_lfn(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fatfs_node tmp;
+	struct fatfs_dirpos pos;
+	struct fat_dirent *de, old;
+	int i, dirty = 0, error = 0;
+
+	pos.cluster = np->lfn.cluster;
+	pos.sector = np->lfn.sector;
+	pos.slot = np->lfn.offset / sizeof(struct fat_dirent);
+	tmp.dcluster = np->dcluster;
+	tmp.lfn.nr = 0;
+
+	for (i = 0; i < np->lfn.nr; i++) {
+		if (i > 0) {
+			if (pos.slot == DIR_PER_SEC - 1 && dirty) {
+				error = fat_write_dirent(fmp, pos.sector);
+				if (error)
+					return error;
+				dirty = 0;
+			}
+			error = fat_next_slot(fmp, &pos);
+			if (error)
+				break;
+		}
+		error = fat_read_dirent(fmp, pos.sector);
+		if (error)
+			break;
+		de = (struct fat_dirent *)fmp->dir_buf + pos.slot;
+		if (IS_DELETED(de) || !IS_LFN(de))
+			break;
+		old = *de;
+		de->name[0] = 0xe5;
+		dirty = 1;
+
+		tmp.dirent = *de;
+		tmp.sector = pos.sector;
+		tmp.offset = sizeof(struct fat_dirent) * pos.slot;
+		fatfs_dir_update(fmp, &old, &tmp);
+	}
+	if (dirty && !error)
+		error = fat_write_dirent(fmp, pos.sector);
+	np->lfn.nr = 0;
+	return error;
+}
+
+/*
+ * Put directory entry.
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ */
+int
+fatfs_put_node(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fat_dirent old;
+	int error;
+
+	error = fat_read_dirent(fmp, np->sector);
+	if (error)
+		return error;
+
+	memcpy(&old, fmp->dir_buf + np->offset, sizeof(struct fat_dirent));
+	memcpy(fmp->dir_buf + np->offset, &np->dirent,
+	       sizeof(struct fat_dirent));
+
+	error = fat_write_dirent(fmp, np->sector);
+	if (error)
+		return error;
+
+	/* Keep the name index of the parent directory coherent */
+	fatfs_dir_update(fmp, &old, np);
+	return 0;
+}
+
+/*
+ * Take the pending updates off a dirty node.
+ * Return 1 if they are to be written to the entry read in dir_buf.
+ *
+ * The usage aggregates count the size kept in memory, so they are
+ * set back to the entry on disk here. fatfs_put_node() applies the
+ * change again when the node is written.
+ */
+static int
+node_pending(struct fatfsmount *fmp, struct fatfs_node *np, int *error)
+{
+	struct fat_dirent *de;
+
+	*error = 0;
+	if (!np->dirty)
+		return 0;
+	np->dirty = 0;
+	if (NODE_REMOVED(np))
+		return 0;
+
+	*error = fat_read_dirent(fmp, np->sector);
+	if (*error)
+		return 0;
+
+	/* The entry may have been removed since */
+	de = (struct fat_dirent *)(fmp->dir_buf + np->offset);
+	if (memcmp(de->name, np->dirent.name, 11) ||
+	    de->cluster != np->dirent.cluster)
+		return 0;
+
+	fatfs_usage_change(fmp, np->dcluster, &np->dirent, de);
+	return 1;
+}
+
+/*
+ * Write the size and times kept in memory to the directory entry.
+ *
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ */
+int
+fatfs_sync_node(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	int error;
+
+	if (node_pending(fmp, np, &error))
+		error = fatfs_put_node(fmp, np);
+	return error;
+}
+
+/*
+ * Forget the pending updates of a node whose entry was removed.
+ *
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ * @de: the entry as it was on disk
+ */
+void
+fatfs_drop_node(struct fatfsmount *fmp, struct fatfs_node *np,
+		struct fat_dirent *de)
+{
+	if (!np->dirty)
+		return;
+	np->dirty = 0;
+	fatfs_usage_change(fmp, np->dcluster, &np->dirent, de);
+}
+
+/*
+ * Write all the dirty nodes of the mount.
+ *
+ * @fmp: fat mount data
+ */
+int
+fatfs_sync_nodes(struct fatfsmount *fmp)
+{
+	struct fatfs_node *np;
+	int error, rc = 0;
+
+	fatfs_batch_begin(fmp);
+	uk_list_for_each_entry(np, &fmp->nodes, link) {
+		error = fatfs_sync_node(fmp, np);
+		if (error && !rc)
+			rc = error;
+	}
+	error = fatfs_batch_end(fmp);
+	return rc ? rc : error;
+}
+
+/*
+ * Begin reading the size and chain of a node without lock.
+ * Return the sequence count to check with fatfs_node_read_retry().
+ *
+ * @np: pointer to fat node
+ */
+__u32
+fatfs_node_read_begin(struct fatfs_node *np)
+{
+	__u32 seq;
+
+	/* Writers never block while the count is odd */
+	while ((seq = __atomic_load_n(&np->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+/*
+ * Check if the size or chain of a node changed since
+ * fatfs_node_read_begin(). If so, what was read must be read again.
+ *
+ * @np: pointer to fat node
+ * @seq: sequence count returned by fatfs_node_read_begin()
+ */
+int
+fatfs_node_read_retry(struct fatfs_node *np, __u32 seq)
+{
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&np->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Begin a change of the size or chain of a node.
+ * The caller must hold the lock.
+ *
+ * @np: pointer to fat node
+ */
+void
+fatfs_node_write_begin(struct fatfs_node *np)
+{
+
+	__atomic_store_n(&np->seq, np->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * End a change of the size or chain of a node.
+ *
+ * @np: pointer to fat node
+ */
+void
+fatfs_node_write_end(struct fatfs_node *np)
+{
+
+	__atomic_store_n(&np->seq, np->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Drop the last run known of a node whose chain grows, as the run may
+ * grow with it. Called between fatfs_node_write_begin() and _end().
+ *
+ * @np: pointer to fat node
+ */
+void
+fatfs_node_trim(struct fatfs_node *np)
+{
+
+	if (np->nr_ext > 0) {
+		np->nr_ext--;
+		np->ext_next = np->ext[np->nr_ext].cluster;
+	}
+}
+
+/*
+ * Mark the node of a removed entry, before its clusters are freed.
+ * Readers without lock see it and stop using the chain.
+ * The caller must hold the lock.
+ *
+ * @np: pointer to fat node
+ */
+void
+fatfs_node_gone(struct fatfs_node *np)
+{
+
+	fatfs_node_write_begin(np);
+	np->dirent.name[0] = SLOT_DELETED;
+	np->nr_ext = 0;
+	np->dirty = 0;
+	fatfs_node_write_end(np);
+}
+
+/*
+ * Find the known run of a node holding a cluster index of the file,
+ * without lock. Return 1 if found.
+ *
+ * @np: pointer to fat node
+ * @index: cluster index in file
+ * @ext: run to return
+ */
+int
+fatfs_node_find_ext(struct fatfs_node *np, __u32 index,
+		    struct fatfs_extent *ext)
+{
+	__u32 i, n;
+
+	/* Runs are published before their count */
+	n = __atomic_load_n(&np->nr_ext, __ATOMIC_ACQUIRE);
+	if (n > NODE_EXT_MAX)
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (index < np->ext[i].index + np->ext[i].count) {
+			*ext = np->ext[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Get the run of a node holding a cluster index of the file, walking
+ * the chain from the last run known. The runs found are kept in the
+ * node while there is room.
+ * The caller must hold the lock.
+ *
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ * @index: cluster index in file
+ * @ext: run to return
+ */
+int
+fatfs_node_map(struct fatfsmount *fmp, struct fatfs_node *np, __u32 index,
+	       struct fatfs_extent *ext)
+{
+	struct fatfs_extent run;
+	__u32 cl, next;
+	int error;
+
+	if (NODE_REMOVED(np))
+		return ENOENT;
+	if (fatfs_node_find_ext(np, index, ext))
+		return 0;
+
+	if (np->nr_ext == 0) {
+		run.index = 0;
+		cl = np->dirent.cluster;
+	} else {
+		run.index = np->ext[np->nr_ext - 1].index +
+			np->ext[np->nr_ext - 1].count;
+		cl = np->ext_next;
+	}
+	for (;;) {
+		/* The chain must not end before the file */
+		if (cl < CL_FIRST || cl >= fmp->last_cluster)
+			return EIO;
+
+		run.cluster = cl;
+		run.count = 1;
+		for (;;) {
+			error = fat_next_cluster(fmp, cl, &next);
+			if (error)
+				return error;
+			if (next != cl + 1)
+				break;
+			cl = next;
+			run.count++;
+		}
+
+		if (np->nr_ext < NODE_EXT_MAX) {
+			np->ext[np->nr_ext] = run;
+			np->ext_next = next;
+			__atomic_store_n(&np->nr_ext, np->nr_ext + 1,
+					 __ATOMIC_RELEASE);
+		}
+		if (index < run.index + run.count) {
+			*ext = run;
+			return 0;
+		}
+		run.index += run.count;
+		cl = next;
+	}
+}
+
+
+/*
+ * Get the inode number derived from a directory entry.
+ *
+ * The first cluster is used when the entry has one, and the location
+ * of the entry otherwise, above the range of cluster numbers. Neither
+ * lasts as long as the file: the vnode keeps the number it got, see
+ * fat_get_vnode().
+ *
+ * @np: pointer to fat node
+ */
+__u64
+fatfs_node_ino(struct fatfs_node *np)
+{
+	if (np->dirent.cluster >= CL_FIRST)
+		return np->dirent.cluster;
+	return (1ULL << 63) | ((__u64)np->sector * DIR_PER_SEC +
+			       np->offset / sizeof(struct fat_dirent));
+}
+
+/*
+ * Mark the nodes of looked up vnodes for a directory entry being
+ * removed. A directory node is also found by its first cluster, as
+ * it may come from a "." or ".." entry. The nodes of a file keep its
+ * chain, see fatfs_remove_chain().
+ * Return the first node marked, or NULL if the entry has none.
+ *
+ * @fmp: fat mount data
+ * @np: node of the entry
+ */
+struct fatfs_node *
+fatfs_nodes_gone(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fatfs_node *vnp, *first = NULL;
+	int dir;
+
+	dir = IS_DIR(&np->dirent) && np->dirent.cluster >= CL_FIRST;
+	uk_list_for_each_entry(vnp, &fmp->nodes, link) {
+		if (NODE_REMOVED(vnp))
+			continue;
+		if ((vnp->dcluster == np->dcluster &&
+		     vnp->sector == np->sector && vnp->offset == np->offset) ||
+		    (dir && IS_DIR(&vnp->dirent) &&
+		     vnp->dirent.cluster == np->dirent.cluster)) {
+			fatfs_node_gone(vnp);
+			vnp->orphan = !dir && np->dirent.cluster >= CL_FIRST;
+			if (first == NULL)
+				first = vnp;
+		}
+	}
+	return first;
+}
+
+/*
+ * Free the chain of a file whose entry is being removed.
+ *
+ * A writer of the file may be writing its data without the mount
+ * lock, so the chain of a file with vnodes is kept until the last of
+ * them is released, see fatfs_free_orphan(). A crash meanwhile only
+ * leaves lost clusters.
+ *
+ * @fmp: fat mount data
+ * @np: node of the entry
+ */
+int
+fatfs_remove_chain(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	if (fatfs_nodes_gone(fmp, np) != NULL ||
+	    np->dirent.cluster < CL_FIRST)
+		return 0;
+	return fat_free_clusters(fmp, np->dirent.cluster);
+}
+
+/*
+ * Free the chain kept for the node of a removed file, once no other
+ * node of the file holds it. The caller must hold the lock.
+ *
+ * @fmp: fat mount data
+ * @np: node being released
+ */
+int
+fatfs_free_orphan(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fatfs_node *vnp;
+
+	if (!np->orphan)
+		return 0;
+	np->orphan = 0;
+	uk_list_for_each_entry(vnp, &fmp->nodes, link) {
+		if (vnp->orphan && vnp->dirent.cluster == np->dirent.cluster)
+			return 0;
+	}
+	return fat_free_clusters(fmp, np->dirent.cluster);
+}
+
+/*
+ * Read the directory entry of the node again from its location.
+ *
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ */
+int
+fatfs_reload_node(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	int error;
 
 	error = fat_read_dirent(fmp, np->sector);
 	if (error)
 		return error;
-
-	memcpy(fmp->dir_buf + np->offset, &np->dirent,
+	memcpy(&np->dirent, fmp->dir_buf + np->offset,
 	       sizeof(struct fat_dirent));
+	return 0;
+}
 
-	error = fat_write_dirent(fmp, np->sector);
-	return error;
+/*
+ * Allocate a cleared fat node from the pool of the mount.
+ * Return NULL if no memory.
+ *
+ * @fmp: fat mount data
+ */
+struct fatfs_node *
+fatfs_node_alloc(struct fatfsmount *fmp)
+{
+	struct fatfs_node *np;
+
+	uk_mutex_lock(&fmp->lock);
+	np = fatfs_pool_get(&fmp->node_pool);
+	uk_mutex_unlock(&fmp->lock);
+	if (np == NULL)
+		return NULL;
+	memset(np, 0, sizeof(struct fatfs_node));
+	UK_INIT_LIST_HEAD(&np->link);
+	uk_mutex_init(&np->lock);
+	return np;
+}
+
+/*
+ * Put the fat node back to the pool of the mount.
+ *
+ * @fmp: fat mount data
+ * @np: pointer to fat node
+ */
+void
+fatfs_node_free(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	uk_mutex_lock(&fmp->lock);
+	uk_list_del(&np->link);
+	fatfs_pool_put(&fmp->node_pool, np);
+	uk_mutex_unlock(&fmp->lock);
+}
+
+/*
+ * Update the nodes of looked up vnodes for a renamed directory entry.
+ *
+ * @fmp: fat mount data
+ * @from: node at the old location
+ * @to: node at the new location, with the new name
+ */
+void
+fatfs_node_moved(struct fatfsmount *fmp, struct fatfs_node *from,
+		 struct fatfs_node *to)
+{
+	struct fatfs_node *np;
+
+	uk_list_for_each_entry(np, &fmp->nodes, link) {
+		if (np->dcluster == from->dcluster &&
+		    np->sector == from->sector && np->offset == from->offset) {
+			np->dcluster = to->dcluster;
+			np->sector = to->sector;
+			np->offset = to->offset;
+			np->lfn = to->lfn;
+			memcpy(np->dirent.name, to->dirent.name, 11);
+		}
+	}
+}
+
+/*
+ * Write a sector of the directory being compacted.
+ */
+static int
+compact_write(struct fatfsmount *fmp, __u32 sec, void *buf)
+{
+	if (fmp->dir_sec == sec) {
+		fmp->dir_sec = SEC_INVAL;
+		fmp->dir_dirty = 0;
+	}
+	fatfs_ra_invalidate(fmp, sec, 1);
+	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec, 1, buf);
+}
+
+/*
+ * Update the nodes of looked up vnodes for a moved directory entry.
+ */
+static void
+compact_move(struct fatfsmount *fmp, __u32 dcl, struct fatfs_dirpos *from,
+	     struct fatfs_dirpos *to)
+{
+	struct fatfs_node *np;
+
+	uk_list_for_each_entry(np, &fmp->nodes, link) {
+		if (np->dcluster == dcl && np->sector == from->sector &&
+		    np->offset == sizeof(struct fat_dirent) * from->slot) {
+			np->sector = to->sector;
+			np->offset = sizeof(struct fat_dirent) * to->slot;
+		}
+		if (np->dcluster == dcl && np->lfn.nr > 0 &&
+		    np->lfn.sector == from->sector &&
+		    np->lfn.offset == sizeof(struct fat_dirent) * from->slot) {
+			np->lfn.cluster = to->cluster;
+			np->lfn.sector = to->sector;
+			np->lfn.offset = sizeof(struct fat_dirent) * to->slot;
+		}
+	}
 }
 
+/*
+ * Compact the directory. The live entries are moved down over the
+ * deleted ones in the same order, and the clusters left empty at the
+ * end are released.
+ *
+ * Each entry is written to its new slot before its old slot is
+ * overwritten, so an interrupted compaction can leave a duplicate
+ * entry, but never loses one.
+ *
+ * @dvp: vnode for directory.
+ */
+int
+fatfs_compact_node(struct vnode *dvp)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp;
+	struct fatfs_dir *dp;
+	struct fatfs_dirpos rd, wr;
+	struct fat_dirent *de, *buf;
+	__u32 cl, prev, keep, last, last_cl, sec, end, next;
+	int error;
+
+	fmp = (struct fatfsmount *)dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	cl = dnp->dirent.cluster;
+	if (NODE_REMOVED(dnp))
+		return ENOENT;
+
+	/* Nothing to do if the last scan found no deleted entry since */
+	dp = fatfs_dir_find(fmp, cl);
+	if (dp != NULL && (dp->flags & DIR_COUNTED) && dp->nr_deleted == 0)
+		return 0;
+
+	DPRINTF(("fatfs_compact_node: cl=%d\n", cl));
+
+	buf = fatfs_buf_get(&fmp->sec_bufs);
+	if (buf == NULL)
+		return ENOMEM;
+
+	rd.cluster = cl;
+	rd.sector = (cl == CL_ROOT) ? fmp->root_start : cl_to_sec(fmp, cl);
+	rd.slot = 0;
+	wr = rd;
+	fat_prefetch_dir(fmp, cl);
+	/* Entries are moved, cached paths are stale */
+	fmp->path_gen++;
+	prev = cl;
+
+	/* Move live entries to the write position */
+	for (;;) {
+		last = rd.sector;
+		last_cl = rd.cluster;
+		error = fat_read_dirent(fmp, rd.sector);
+		if (error)
+			goto out;
+		de = (struct fat_dirent *)fmp->dir_buf + rd.slot;
+		if (IS_EMPTY(de)) {
+			if (wr.sector == rd.sector && wr.slot == rd.slot)
+				goto out;	/* no hole */
+			break;
+		}
+		if (!IS_DELETED(de)) {
+			buf[wr.slot] = *de;
+			if (wr.sector != rd.sector || wr.slot != rd.slot)
+				compact_move(fmp, cl, &rd, &wr);
+			if (wr.slot == DIR_PER_SEC - 1) {
+				error = compact_write(fmp, wr.sector, buf);
+				if (error)
+					goto release;
+			}
+			next = wr.cluster;
+			error = fat_next_slot(fmp, &wr);
+			if (error == ENOENT) {
+				/* All slots are in use */
+				error = 0;
+				goto out;
+			}
+			if (error)
+				goto release;
+			if (wr.cluster != next)
+				prev = next;
+		}
+		error = fat_next_slot(fmp, &rd);
+		if (error == ENOENT)
+			break;
+		if (error)
+			goto release;
+	}
+
+	/* Clear the slots after the last live entry */
+	memset(&buf[wr.slot], 0,
+	       sizeof(struct fat_dirent) * (DIR_PER_SEC - wr.slot));
+	if (cl != CL_ROOT && wr.cluster != cl && wr.slot == 0 &&
+	    wr.sector == cl_to_sec(fmp, wr.cluster)) {
+		/* The cluster is left empty */
+		keep = prev;
+	} else {
+		keep = wr.cluster;
+		if (cl == CL_ROOT || last_cl == wr.cluster)
+			end = last;
+		else
+			end = cl_to_sec(fmp, wr.cluster) + fmp->sec_per_cl - 1;
+		for (sec = wr.sector; sec <= end; sec++) {
+			error = compact_write(fmp, sec, buf);
+			if (error)
+				goto release;
+			if (sec == wr.sector)
+				memset(buf, 0, SEC_SIZE);
+		}
+	}
+
+	/* Release the clusters after the last live entry */
+	if (cl != CL_ROOT) {
+		error = fat_next_cluster(fmp, keep, &next);
+		if (error)
+			goto release;
+		if (!IS_EOFCL(fmp, next)) {
+			error = fat_set_cluster(fmp, keep, fmp->fat_eof);
+			if (error)
+				goto release;
+			error = fat_free_clusters(fmp, next);
+		}
+	}
+ release:
+	/* The locations kept in the directory data are stale */
+	fatfs_dir_drop(fmp, cl);
+ out:
+	fatfs_buf_put(&fmp->sec_bufs, buf);
+	return error;
+}
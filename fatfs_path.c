@@ -0,0 +1,406 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <vfscore/vnode.h>
+#include <vfscore/mount.h>
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <fatfs/ioctl.h>
+#include "fatfs.h"
+
+/* The slot of a path is taken from the low bits of its hash */
+#if CONFIG_LIBFATFS_PATH_CACHE & (CONFIG_LIBFATFS_PATH_CACHE - 1)
+#error "CONFIG_LIBFATFS_PATH_CACHE must be a power of 2"
+#endif
+
+/*
+ * Hash a path from the base directory. Case of ASCII letters is
+ * ignored, like the names.
+ */
+static __u32
+path_hash(__u32 base, const char *path, size_t len)
+{
+	__u32 hash = 2166136261U ^ base;	/* FNV-1a */
+	size_t i;
+	int c;
+
+	for (i = 0; i < len; i++) {
+		c = (__u8)path[i];
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		hash ^= (__u32)c;
+		hash *= 16777619U;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Find a path in the path cache.
+ * Return 0 and fill the node if it is cached and still valid.
+ */
+static int
+path_find(struct fatfsmount *fmp, __u32 base, const char *path, size_t len,
+	  struct fatfs_node *np)
+{
+	struct fatfs_pathent *pe;
+	__u32 hash;
+
+	if (fmp->path_cache == NULL)
+		return ENOENT;
+
+	hash = path_hash(base, path, len);
+	pe = &fmp->path_cache[hash & (CONFIG_LIBFATFS_PATH_CACHE - 1)];
+	if (pe->hash != hash || pe->base != base ||
+	    pe->gen != fmp->path_gen || strncasecmp(pe->path, path, len) ||
+	    pe->path[len] != '\0')
+		return ENOENT;
+
+	np->dirent.cluster = pe->cluster;
+	np->dirent.attr = pe->attr;
+	np->dcluster = pe->dcluster;
+	np->sector = pe->sector;
+	np->offset = pe->offset;
+	np->lfn = pe->lfn;
+	return 0;
+}
+
+/*
+ * Add a path to the path cache, replacing the path in the same slot.
+ */
+static void
+path_add(struct fatfsmount *fmp, __u32 base, const char *path, size_t len,
+	 struct fatfs_node *np)
+{
+	struct fatfs_pathent *pe;
+	__u32 hash;
+	char *copy;
+
+	if (fmp->path_cache == NULL) {
+		fmp->path_cache = calloc(CONFIG_LIBFATFS_PATH_CACHE,
+					 sizeof(struct fatfs_pathent));
+		if (fmp->path_cache == NULL)
+			return;
+	}
+
+	copy = malloc(len + 1);
+	if (copy == NULL)
+		return;
+	memcpy(copy, path, len);
+	copy[len] = '\0';
+
+	hash = path_hash(base, path, len);
+	pe = &fmp->path_cache[hash & (CONFIG_LIBFATFS_PATH_CACHE - 1)];
+	free(pe->path);
+	pe->path = copy;
+	pe->hash = hash;
+	pe->base = base;
+	pe->gen = fmp->path_gen;
+	pe->cluster = np->dirent.cluster;
+	pe->attr = np->dirent.attr;
+	pe->dcluster = np->dcluster;
+	pe->sector = np->sector;
+	pe->offset = np->offset;
+	pe->lfn = np->lfn;
+}
+
+/*
+ * Release the path cache of the mount point.
+ */
+void
+fatfs_path_cleanup(struct fatfsmount *fmp)
+{
+	__u32 i;
+
+	if (fmp->path_cache == NULL)
+		return;
+	for (i = 0; i < CONFIG_LIBFATFS_PATH_CACHE; i++)
+		free(fmp->path_cache[i].path);
+	free(fmp->path_cache);
+	fmp->path_cache = NULL;
+}
+
+/*
+ * Copy the path without empty components. Return EINVAL if the path
+ * is empty, has "." or ".." components, or ends with '/', which would
+ * leave no name for the entry.
+ */
+static int
+path_copy(const char *path, char **buf, size_t *len)
+{
+	const char *p, *end;
+	char *q;
+
+	if (*path != '\0' && path[strlen(path) - 1] == '/')
+		return EINVAL;
+
+	*buf = malloc(strlen(path) + 1);
+	if (*buf == NULL)
+		return ENOMEM;
+
+	q = *buf;
+	for (p = path; *p != '\0'; p = end) {
+		if (*p == '/') {
+			end = p + 1;
+			continue;
+		}
+		end = strchr(p, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		if ((end - p == 1 && p[0] == '.') ||
+		    (end - p == 2 && p[0] == '.' && p[1] == '.'))
+			goto inval;
+		if (q != *buf)
+			*q++ = '/';
+		memcpy(q, p, end - p);
+		q += end - p;
+	}
+	if (q == *buf)
+		goto inval;
+	*q = '\0';
+	*len = q - *buf;
+	return 0;
+ inval:
+	free(*buf);
+	return EINVAL;
+}
+
+/*
+ * Find the directory entry of a path from the directory.
+ *
+ * The longest prefix of the path found in the path cache is used,
+ * so a repeated lookup costs one hash probe. The components after it
+ * are looked up in their directories and added to the cache.
+ * The cache is invalidated as a whole when any entry is removed or
+ * renamed, see fatfs_dir_update().
+ *
+ * @dvp: vnode of base directory
+ * @path: path from the base directory, separated by '/'
+ * @np: pointer to fat node
+ */
+int
+fatfs_path_lookup(struct vnode *dvp, const char *path, struct fatfs_node *np)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp, dir;
+	struct vnode tmp;
+	char *buf, *name, *sep, *end;
+	size_t len;
+	__u32 base;
+	int error;
+
+	fmp = dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	base = dnp->dirent.cluster;
+
+	error = path_copy(path, &buf, &len);
+	if (error)
+		return error;
+
+	/* Find the longest cached prefix */
+	end = buf + len;
+	while (end != NULL) {
+		if (CONFIG_LIBFATFS_PATH_CACHE > 0 &&
+		    path_find(fmp, base, buf, end - buf, np) == 0)
+			break;
+		do {
+			end = (end == buf) ? NULL : end - 1;
+		} while (end != NULL && *end != '/');
+	}
+	if (end == buf + len) {
+		error = fatfs_reload_node(fmp, np);
+		goto out;
+	}
+
+	if (end == NULL) {
+		dir.dirent.cluster = base;
+		name = buf;
+	} else {
+		if (!IS_DIR(&np->dirent)) {
+			error = ENOTDIR;
+			goto out;
+		}
+		dir.dirent.cluster = np->dirent.cluster;
+		name = end + 1;
+	}
+
+	/* Look up the rest in a directory vnode of our own */
+	dir.dirent.name[0] = '\0';
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.v_mount = dvp->v_mount;
+	tmp.v_type = VDIR;
+	tmp.v_data = &dir;
+	for (;;) {
+		sep = strchr(name, '/');
+		if (sep != NULL)
+			*sep = '\0';
+		error = fatfs_lookup_node(&tmp, name, np);
+		if (error)
+			goto out;
+		if (sep == NULL)
+			break;
+		*sep = '/';
+		if (!IS_DIR(&np->dirent)) {
+			error = ENOTDIR;
+			goto out;
+		}
+		if (CONFIG_LIBFATFS_PATH_CACHE > 0)
+			path_add(fmp, base, buf, sep - buf, np);
+		dir.dirent.cluster = np->dirent.cluster;
+		name = sep + 1;
+	}
+	if (CONFIG_LIBFATFS_PATH_CACHE > 0)
+		path_add(fmp, base, buf, len, np);
+ out:
+	free(buf);
+	return error;
+}
+
+/*
+ * Add the low bytes of a value to a hash.
+ */
+static __u32
+handle_mix(__u32 hash, __u32 val, int bytes)
+{
+
+	for (; bytes > 0; bytes--, val >>= 8) {
+		hash ^= val & 0xff;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Check value of a directory entry for its handle. It is made from
+ * the creation time, which no rename or write changes.
+ *
+ * Some systems write no creation time. For such entries the check of
+ * the short name is taken too, so the handle does not survive a
+ * rename. An entry replaced at the same slot, with the same first
+ * cluster and the same creation time, can not be told apart.
+ */
+static __u32
+handle_gen(struct fat_dirent *de)
+{
+	__u32 hash = 2166136261U;	/* FNV-1a */
+
+	hash = handle_mix(hash, de->ctime_ms, 1);
+	hash = handle_mix(hash, de->ctime, 2);
+	hash = handle_mix(hash, de->cdate, 2);
+	if (de->ctime_ms == 0 && de->ctime == 0 && de->cdate == 0)
+		hash = handle_mix(hash, fat_lfn_checksum(de->name), 1);
+	return hash;
+}
+
+/*
+ * Check if the directory entry is the one of the handle.
+ */
+static int
+handle_match(struct fat_dirent *de, struct fatfs_handle *fh)
+{
+
+	if (IS_EMPTY(de) || IS_DELETED(de) || IS_VOL(de) || de->name[0] == '.')
+		return 0;
+	return de->cluster == fh->cluster && handle_gen(de) == fh->gen;
+}
+
+/*
+ * Make the persistent handle of a looked up node.
+ *
+ * @np: pointer to fat node
+ * @fh: handle to return
+ */
+void
+fatfs_handle_make(struct fatfs_node *np, struct fatfs_handle *fh)
+{
+
+	fh->dcluster = np->dcluster;
+	fh->sector = np->sector;
+	fh->slot = np->offset / sizeof(struct fat_dirent);
+	fh->cluster = np->dirent.cluster;
+	fh->gen = handle_gen(&np->dirent);
+}
+
+/*
+ * Find the entry of a handle moved in its directory.
+ */
+static int
+handle_scan(struct vnode *vp, struct fatfs_handle *fh, struct fatfs_node *np)
+{
+	struct fatfs_node dir;
+	struct fatfs_dirpos pos;
+	struct vnode tmp;
+	int error;
+
+	memset(&dir, 0, sizeof(dir));
+	dir.dirent.cluster = fh->dcluster;
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.v_mount = vp->v_mount;
+	tmp.v_type = VDIR;
+	tmp.v_data = &dir;
+	memset(&pos, 0, sizeof(pos));
+	pos.sector = SEC_INVAL;
+	for (;;) {
+		error = fatfs_read_node(&tmp, &pos, np, NULL);
+		if (error)
+			return error == ENOENT ? ESTALE : error;
+		if (handle_match(&np->dirent, fh))
+			return 0;
+	}
+}
+
+/*
+ * Find the directory entry of a persistent handle.
+ * Only the sector of the handle is read, unless the entry has moved
+ * in its directory. Return ESTALE if the entry is gone.
+ *
+ * The caller must hold the lock.
+ *
+ * @vp: vnode on the mount
+ * @fh: handle made by fatfs_handle_make()
+ * @np: pointer to fat node
+ */
+int
+fatfs_handle_lookup(struct vnode *vp, struct fatfs_handle *fh,
+		    struct fatfs_node *np)
+{
+	struct fatfsmount *fmp;
+	int error;
+
+	fmp = vp->v_mount->m_data;
+
+	/* The sector must be in the directory area of the handle */
+	if (fh->slot >= DIR_PER_SEC)
+		return ESTALE;
+	if (fh->dcluster == CL_ROOT) {
+		if (fh->sector < fmp->root_start ||
+		    fh->sector >= fmp->data_start)
+			return ESTALE;
+	} else if (fh->dcluster < CL_FIRST ||
+		   fh->dcluster >= fmp->last_cluster ||
+		   fh->sector < fmp->data_start ||
+		   fh->sector >= cl_to_sec(fmp, fmp->last_cluster))
+		return ESTALE;
+
+	np->dcluster = fh->dcluster;
+	np->sector = fh->sector;
+	np->offset = fh->slot * sizeof(struct fat_dirent);
+	error = fatfs_reload_node(fmp, np);
+	if (error)
+		return error;
+	if (handle_match(&np->dirent, fh))
+		return fatfs_find_lfn(fmp, np);
+
+	/* Moved in the directory by a rename or a compaction */
+	if (fh->cluster < CL_FIRST)
+		return ESTALE;
+	DPRINTF(("fatfs_handle_lookup: scan dir=%d\n", fh->dcluster));
+	return handle_scan(vp, fh, np);
+}
@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "fatfs.h"
+
+/*
+ * Check if the object is a part of the preallocated block.
+ */
+static inline int
+pool_in_block(struct fatfs_pool *pool, void *obj)
+{
+	return (char *)obj >= pool->block &&
+		(char *)obj < pool->block + pool->nr_block * pool->size;
+}
+
+/*
+ * Initialize object pool.
+ *
+ * @pool: object pool
+ * @size: size of an object
+ * @prealloc: number of objects allocated at once
+ * @max_free: number of free objects to keep, at least prealloc
+ */
+int
+fatfs_pool_init(struct fatfs_pool *pool, size_t size, __u32 prealloc,
+		__u32 max_free)
+{
+	char *obj;
+	__u32 i;
+
+	memset(pool, 0, sizeof(struct fatfs_pool));
+	pool->size = ALIGN_UP(MAX(size, sizeof(void *)), sizeof(long));
+	pool->max_free = MAX(max_free, prealloc);
+	if (prealloc == 0)
+		return 0;
+
+	pool->block = malloc(prealloc * pool->size);
+	if (pool->block == NULL)
+		return ENOMEM;
+	pool->nr_block = prealloc;
+	for (i = 0; i < prealloc; i++) {
+		obj = pool->block + i * pool->size;
+		*(void **)obj = pool->free;
+		pool->free = obj;
+	}
+	pool->nr_free = prealloc;
+	return 0;
+}
+
+/*
+ * Release the free objects and the preallocated block.
+ * All objects must have been put back.
+ */
+void
+fatfs_pool_destroy(struct fatfs_pool *pool)
+{
+	void *obj, *next;
+
+	for (obj = pool->free; obj != NULL; obj = next) {
+		next = *(void **)obj;
+		if (!pool_in_block(pool, obj))
+			free(obj);
+	}
+	free(pool->block);
+	memset(pool, 0, sizeof(struct fatfs_pool));
+}
+
+/*
+ * Get an object from the pool.
+ * Return NULL if no memory.
+ */
+void *
+fatfs_pool_get(struct fatfs_pool *pool)
+{
+	void *obj;
+
+	obj = pool->free;
+	if (obj == NULL)
+		return malloc(pool->size);
+	pool->free = *(void **)obj;
+	pool->nr_free--;
+	return obj;
+}
+
+/*
+ * Put the object back to the pool.
+ * Objects over the number to keep are freed.
+ */
+void
+fatfs_pool_put(struct fatfs_pool *pool, void *obj)
+{
+	if (obj == NULL)
+		return;
+	if (pool->nr_free >= pool->max_free && !pool_in_block(pool, obj)) {
+		free(obj);
+		return;
+	}
+	*(void **)obj = pool->free;
+	pool->free = obj;
+	pool->nr_free++;
+}
+
+/*
+ * Allocate an I/O buffer of the pool.
+ */
+static void *
+bufpool_alloc(struct fatfs_bufpool *pool)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, pool->align, pool->size))
+		return NULL;
+	return buf;
+}
+
+/*
+ * Initialize I/O buffer pool.
+ *
+ * @pool: buffer pool
+ * @size: size of a buffer
+ * @align: alignment required by the device
+ * @prealloc: number of buffers allocated now
+ * @max_free: number of free buffers to keep, at least prealloc
+ */
+int
+fatfs_bufpool_init(struct fatfs_bufpool *pool, size_t size, size_t align,
+		   __u32 prealloc, __u32 max_free)
+{
+	void *buf;
+	__u32 i;
+
+	memset(pool, 0, sizeof(struct fatfs_bufpool));
+	pool->size = ALIGN_UP(MAX(size, sizeof(void *)), sizeof(long));
+	pool->align = MAX(align, sizeof(void *));
+	pool->max_free = MAX(max_free, prealloc);
+	uk_mutex_init(&pool->lock);
+
+	for (i = 0; i < prealloc; i++) {
+		buf = bufpool_alloc(pool);
+		if (buf == NULL) {
+			fatfs_bufpool_destroy(pool);
+			return ENOMEM;
+		}
+		*(void **)buf = pool->free;
+		pool->free = buf;
+		pool->nr_free++;
+	}
+	return 0;
+}
+
+/*
+ * Release the free buffers. All buffers must have been put back.
+ */
+void
+fatfs_bufpool_destroy(struct fatfs_bufpool *pool)
+{
+	void *buf, *next;
+
+	for (buf = pool->free; buf != NULL; buf = next) {
+		next = *(void **)buf;
+		free(buf);
+	}
+	pool->free = NULL;
+	pool->nr_free = 0;
+}
+
+/*
+ * Get an I/O buffer from the pool.
+ * Return NULL if no memory.
+ */
+void *
+fatfs_buf_get(struct fatfs_bufpool *pool)
+{
+	void *buf;
+
+	uk_mutex_lock(&pool->lock);
+	buf = pool->free;
+	if (buf != NULL) {
+		pool->free = *(void **)buf;
+		pool->nr_free--;
+	}
+	uk_mutex_unlock(&pool->lock);
+	if (buf == NULL)
+		buf = bufpool_alloc(pool);
+	return buf;
+}
+
+/*
+ * Put the I/O buffer back to the pool.
+ * Buffers over the number to keep are freed.
+ */
+void
+fatfs_buf_put(struct fatfs_bufpool *pool, void *buf)
+{
+	if (buf == NULL)
+		return;
+	uk_mutex_lock(&pool->lock);
+	if (pool->nr_free < pool->max_free) {
+		*(void **)buf = pool->free;
+		pool->free = buf;
+		pool->nr_free++;
+		buf = NULL;
+	}
+	uk_mutex_unlock(&pool->lock);
+	free(buf);
+}
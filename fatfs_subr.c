@@ -30,6 +30,10 @@
 
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "fatfs.h"
 
@@ -100,6 +104,105 @@ fat_compare_name(char *n1, char *n2)
 	return 0;
 }
 
+/*
+ * Hash 8.3 file name. Case is ignored like fat_compare_name().
+ */
+__u32
+fat_hash_name(char *name)
+{
+	__u32 hash = 2166136261U;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < 11; i++, name++) {
+		hash ^= (__u8)toupper((int)*name);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Make the key for fat_scan_sector() from 8.3 file name.
+ *
+ * @name: 8.3 file name
+ * @key: FAT_KEY_SIZE bytes of upper case name, zero padded
+ */
+void
+fat_make_key(char *name, char *key)
+{
+	int i;
+
+	memset(key, 0, FAT_KEY_SIZE);
+	for (i = 0; i < 11; i++)
+		key[i] = (char)toupper((int)name[i]);
+}
+
+#if defined(__SSE2__)
+/*
+ * Scan all entries of directory sector with SSE2. One directory entry
+ * is 32 bytes, and its name and attribute fit in the first 16 bytes.
+ */
+void
+fat_scan_sector(const char *buf, const char *key, struct fat_slotmap *map)
+{
+	const __m128i k = _mm_loadu_si128((const __m128i *)key);
+	const __m128i lo = _mm_set1_epi8('a' - 1);
+	const __m128i hi = _mm_set1_epi8('z' + 1);
+	const __m128i bit = _mm_set1_epi8(0x20);
+	__m128i v, lower;
+	__u16 match = 0, empty = 0, deleted = 0, vol = 0;
+	int i;
+
+	for (i = 0; i < DIR_PER_SEC; i++, buf += sizeof(struct fat_dirent)) {
+		v = _mm_loadu_si128((const __m128i *)buf);
+		/* Upper case 'a'-'z', other bytes are kept */
+		lower = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+				      _mm_cmplt_epi8(v, hi));
+		v = _mm_sub_epi8(v, _mm_and_si128(lower, bit));
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, k)) & 0x7ff) == 0x7ff)
+			match |= 1 << i;
+		if (buf[0] == SLOT_EMPTY)
+			empty |= 1 << i;
+		else if ((__u8)buf[0] == SLOT_DELETED)
+			deleted |= 1 << i;
+		if (buf[11] & FA_VOLID)
+			vol |= 1 << i;
+	}
+	map->match = match;
+	map->empty = empty;
+	map->deleted = deleted;
+	map->vol = vol;
+}
+#else
+/*
+ * Scan all entries of directory sector.
+ */
+void
+fat_scan_sector(const char *buf, const char *key, struct fat_slotmap *map)
+{
+	const struct fat_dirent *de = (const struct fat_dirent *)buf;
+	int i, j, c;
+
+	memset(map, 0, sizeof(*map));
+	for (i = 0; i < DIR_PER_SEC; i++, de++) {
+		for (j = 0; j < 11; j++) {
+			c = de->name[j];
+			if (c >= 'a' && c <= 'z')
+				c -= 'a' - 'A';
+			if (c != (__u8)key[j])
+				break;
+		}
+		if (j == 11)
+			map->match |= 1 << i;
+		if (IS_EMPTY(de))
+			map->empty |= 1 << i;
+		else if (IS_DELETED(de))
+			map->deleted |= 1 << i;
+		if (IS_VOL(de))
+			map->vol |= 1 << i;
+	}
+}
+#endif
+
 /*
  * Check specified name is valid as FAT file name.
  * Return true if valid.
@@ -147,6 +250,118 @@ fat_valid_name(char *name)
 	return 1;
 }
 
+/*
+ * Days since 1970-01-01 for the date in the proleptic Gregorian calendar.
+ */
+static long
+days_from_civil(long y, int m, int d)
+{
+	long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * FAT date and time -> seconds since the Epoch
+ *
+ *  Time bits: 15-11 hours (0-23), 10-5 min, 4-0 sec /2
+ *  Date bits: 15-9 year - 1980, 8-5 month, 4-0 day
+ */
+time_t
+fat_time_to_unix(__u16 date, __u16 time)
+{
+	int mon, day;
+
+	mon = (date >> 5) & 0xf;
+	day = date & 0x1f;
+	if (mon == 0)
+		mon = 1;
+	if (day == 0)
+		day = 1;
+
+	return (time_t)days_from_civil(1980 + (date >> 9), mon, day) * 86400 +
+		(time >> 11) * 3600 + ((time >> 5) & 0x3f) * 60 +
+		(time & 0x1f) * 2;
+}
+
+/*
+ * Seconds since the Epoch -> FAT date and time
+ *
+ * Times before 1980 are set to the first day of 1980, the earliest
+ * date FAT can hold.
+ */
+void
+fat_unix_to_time(time_t t, __u16 *date, __u16 *time)
+{
+	long days, era, doe, yoe, y, doy, mp, secs;
+	int mon, day;
+
+	if (t < (time_t)days_from_civil(1980, 1, 1) * 86400) {
+		*date = (1 << 5) | 1;
+		*time = 0;
+		return;
+	}
+	days = (long)(t / 86400);
+	secs = (long)(t % 86400);
+
+	/* Inverse of days_from_civil() */
+	days += 719468;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = (int)(doy - (153 * mp + 2) / 5 + 1);
+	mon = (int)(mp < 10 ? mp + 3 : mp - 9);
+	y += mon <= 2;
+	if (y > 1980 + 127)
+		y = 1980 + 127;
+
+	*date = (__u16)(((y - 1980) << 9) | (mon << 5) | day);
+	*time = (__u16)(((secs / 3600) << 11) | (((secs / 60) % 60) << 5) |
+			((secs % 60) / 2));
+}
+
+/*
+ * Set timestamps of a directory entry to the current time.
+ * Return 1 if any of them has changed.
+ *
+ * @de: directory entry
+ * @flags: STAMP_* of the timestamps to set
+ */
+int
+fat_stamp(struct fat_dirent *de, int flags)
+{
+	time_t now;
+	__u16 d, t;
+	int changed = 0;
+
+	now = time(NULL);
+	fat_unix_to_time(now, &d, &t);
+	if (flags & STAMP_CREATE) {
+		de->ctime_ms = (__u8)((now & 1) * 100);
+		de->ctime = t;
+		de->cdate = d;
+		changed = 1;
+	}
+	if ((flags & STAMP_MODIFY) && (de->time != t || de->date != d)) {
+		de->time = t;
+		de->date = d;
+		changed = 1;
+	}
+	if ((flags & STAMP_ACCESS) && de->adate != d) {
+		de->adate = d;
+		changed = 1;
+	}
+	return changed;
+}
+
 /*
  * mode -> attribute
  */
@@ -0,0 +1,520 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <vfscore/vnode.h>
+#include <vfscore/mount.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <fatfs/ioctl.h>
+#include "fatfs.h"
+
+/*
+ * Clusters and directories of a subtree being removed
+ */
+struct rmtree {
+	__u32	*cls;		/* clusters to free */
+	__u32	nr_cls;		/* number of clusters */
+	__u32	max_cls;	/* size of cls */
+	__u32	*dirs;		/* first cluster# of directories */
+	__u32	nr_dirs;	/* number of directories */
+	__u32	max_dirs;	/* size of dirs */
+	__u32	*keep;		/* clusters of files still open */
+	__u32	nr_keep;	/* number of clusters kept */
+	__u32	max_keep;	/* size of keep */
+	size_t	nr;		/* number of entries removed */
+};
+
+static int
+tree_cmp(const void *a, const void *b)
+{
+	__u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Append a cluster# to a growing array.
+ */
+static int
+tree_push(__u32 **array, __u32 *nr, __u32 *max, __u32 cl)
+{
+	__u32 *p, size;
+
+	if (*nr == *max) {
+		size = *max ? *max * 2 : 64;
+		p = realloc(*array, size * sizeof(__u32));
+		if (p == NULL)
+			return ENOMEM;
+		*array = p;
+		*max = size;
+	}
+	(*array)[(*nr)++] = cl;
+	return 0;
+}
+
+/*
+ * Collect the clusters of a chain.
+ * A FAT with a loop would give more clusters than the volume has.
+ */
+static int
+rmtree_chain(struct fatfsmount *fmp, __u32 **array, __u32 *nr, __u32 *max,
+	     __u32 cl)
+{
+	int error;
+
+	while (cl >= CL_FIRST && cl < fmp->last_cluster) {
+		if (*nr >= fmp->last_cluster)
+			return EIO;
+		error = tree_push(array, nr, max, cl);
+		if (error)
+			return error;
+		error = fat_next_cluster(fmp, cl, &cl);
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+/*
+ * Walk the directories of the subtree, each once, collecting the
+ * clusters of all the entries. Subdirectories found are appended to
+ * rt->dirs and walked in turn.
+ *
+ * @dvp: vnode of a directory on the mount
+ * @rt: subtree data, with the top directory in rt->dirs
+ */
+static int
+rmtree_walk(struct vnode *dvp, struct rmtree *rt)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node dir, np;
+	struct fatfs_dirpos pos;
+	struct vnode tmp;
+	struct fat_dirent *de;
+	__u32 d;
+	int error;
+
+	fmp = dvp->v_mount->m_data;
+
+	/* Read the directories through a vnode of our own */
+	memset(&dir, 0, sizeof(dir));
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.v_mount = dvp->v_mount;
+	tmp.v_type = VDIR;
+	tmp.v_data = &dir;
+	for (d = 0; d < rt->nr_dirs; d++) {
+		dir.dirent.cluster = rt->dirs[d];
+		error = rmtree_chain(fmp, &rt->cls, &rt->nr_cls, &rt->max_cls,
+				     dir.dirent.cluster);
+		if (error)
+			return error;
+
+		memset(&pos, 0, sizeof(pos));
+		pos.sector = SEC_INVAL;
+		for (;;) {
+			error = fatfs_read_node(&tmp, &pos, &np, NULL);
+			if (error == ENOENT)
+				break;
+			if (error)
+				return error;
+			de = &np.dirent;
+			if (de->name[0] == '.')
+				continue;	/* "." or ".." */
+			rt->nr++;
+			if (!IS_DIR(de))
+				error = rmtree_chain(fmp, &rt->cls, &rt->nr_cls,
+						     &rt->max_cls, de->cluster);
+			else if (de->cluster >= CL_FIRST &&
+				 de->cluster < fmp->last_cluster)
+				error = tree_push(&rt->dirs, &rt->nr_dirs,
+						  &rt->max_dirs, de->cluster);
+			if (error)
+				return error;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Remove an entry of a directory with its whole subtree.
+ *
+ * The subtree is read first, every directory once. The top entry is
+ * deleted next, so that a crash leaves lost clusters only. All the
+ * clusters are then freed in FAT order within one batch, so each FAT
+ * sector is written once. The entries below the top are not marked
+ * deleted, their directory clusters are freed with the rest.
+ *
+ * Looked up nodes in the subtree are marked deleted, and the vnode
+ * operations on them fail with ENOENT. The clusters of a file with a
+ * vnode are freed when the vnode is released, as its data may still
+ * be written without the lock.
+ *
+ * The caller must hold the lock.
+ *
+ * @dvp: vnode of the directory
+ * @name: name of the entry
+ * @nr: number of entries removed
+ */
+int
+fatfs_rmtree(struct vnode *dvp, char *name, size_t *nr)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node top, *np;
+	struct rmtree rt;
+	__u32 i;
+	int error, error2;
+
+	fmp = dvp->v_mount->m_data;
+	*nr = 0;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return EINVAL;
+	error = fatfs_lookup_node(dvp, name, &top);
+	if (error)
+		return error;
+	if (!IS_DIR(&top.dirent) && !IS_FILE(&top.dirent))
+		return EPERM;
+
+	DPRINTF(("fatfs_rmtree: %s cl=%d\n", name, top.dirent.cluster));
+
+	memset(&rt, 0, sizeof(rt));
+	rt.nr = 1;
+	fatfs_batch_begin(fmp);
+
+	if (!IS_DIR(&top.dirent))
+		error = rmtree_chain(fmp, &rt.cls, &rt.nr_cls, &rt.max_cls,
+				     top.dirent.cluster);
+	else if (top.dirent.cluster >= CL_FIRST) {
+		error = tree_push(&rt.dirs, &rt.nr_dirs, &rt.max_dirs,
+				  top.dirent.cluster);
+		if (!error)
+			error = rmtree_walk(dvp, &rt);
+	}
+	if (error)
+		goto out;
+
+	top.dirent.name[0] = SLOT_DELETED;
+	error = fatfs_put_node(fmp, &top);
+	if (!error && top.lfn.nr > 0)
+		error = fatfs_del_lfn(fmp, &top);
+	if (!error)
+		error = fatfs_flush_dirent(fmp);
+	if (error)
+		goto out;
+
+	/* Mark the nodes of the subtree, before their clusters are freed */
+	qsort(rt.dirs, rt.nr_dirs, sizeof(__u32), tree_cmp);
+	uk_list_for_each_entry(np, &fmp->nodes, link) {
+		if (NODE_REMOVED(np))
+			continue;
+		if ((np->dcluster == top.dcluster &&
+		     np->sector == top.sector && np->offset == top.offset) ||
+		    bsearch(&np->dcluster, rt.dirs, rt.nr_dirs,
+			    sizeof(__u32), tree_cmp) != NULL) {
+			fatfs_node_gone(np);
+			if (IS_DIR(&np->dirent) || np->dirent.cluster < CL_FIRST)
+				continue;
+			np->orphan = 1;
+			error = rmtree_chain(fmp, &rt.keep, &rt.nr_keep,
+					     &rt.max_keep, np->dirent.cluster);
+			if (error)
+				goto out;
+		}
+	}
+
+	/* Free the clusters in FAT order, skipping cross-linked ones */
+	qsort(rt.cls, rt.nr_cls, sizeof(__u32), tree_cmp);
+	qsort(rt.keep, rt.nr_keep, sizeof(__u32), tree_cmp);
+	for (i = 0; i < rt.nr_cls; i++) {
+		if (i > 0 && rt.cls[i] == rt.cls[i - 1])
+			continue;
+		if (bsearch(&rt.cls[i], rt.keep, rt.nr_keep, sizeof(__u32),
+			    tree_cmp) != NULL)
+			continue;
+		error = fat_set_cluster(fmp, rt.cls[i], CL_FREE);
+		if (error)
+			goto out;
+	}
+
+	/* Forget the directories of the subtree */
+	for (i = 0; i < rt.nr_dirs; i++)
+		fatfs_dir_release(fmp, rt.dirs[i]);
+	*nr = rt.nr;
+ out:
+	error2 = fatfs_batch_end(fmp);
+	free(rt.cls);
+	free(rt.dirs);
+	free(rt.keep);
+	return error ? error : error2;
+}
+
+/*
+ * Directory waiting to be scanned
+ */
+struct walk_dir {
+	__u32	cluster;	/* first cluster# */
+	char	*path;		/* path from the top, "" for the top */
+};
+
+/*
+ * State of a subtree scan, kept in the open file between calls
+ */
+struct fatfs_walk {
+	struct walk_dir	*heap;		/* directories to scan, by cluster# */
+	__u32		nr_heap;	/* number of directories */
+	__u32		max_heap;	/* size of heap */
+	struct walk_dir	cur;		/* directory being scanned */
+	struct fatfs_dirpos pos;	/* position in cur */
+	__u32		nr_dirs;	/* directories taken from heap */
+};
+
+/*
+ * Add a directory to the heap of the scan.
+ */
+static int
+walk_push(struct fatfs_walk *w, __u32 cl, char *path)
+{
+	struct walk_dir *p, tmp;
+	__u32 i, parent, size;
+
+	if (w->nr_heap == w->max_heap) {
+		size = w->max_heap ? w->max_heap * 2 : 32;
+		p = realloc(w->heap, size * sizeof(struct walk_dir));
+		if (p == NULL)
+			return ENOMEM;
+		w->heap = p;
+		w->max_heap = size;
+	}
+	i = w->nr_heap++;
+	w->heap[i].cluster = cl;
+	w->heap[i].path = path;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (w->heap[parent].cluster <= w->heap[i].cluster)
+			break;
+		tmp = w->heap[parent];
+		w->heap[parent] = w->heap[i];
+		w->heap[i] = tmp;
+		i = parent;
+	}
+	return 0;
+}
+
+/*
+ * Take the directory with the lowest cluster# from the heap.
+ */
+static void
+walk_pop(struct fatfs_walk *w, struct walk_dir *dir)
+{
+	struct walk_dir tmp;
+	__u32 i, child;
+
+	*dir = w->heap[0];
+	w->heap[0] = w->heap[--w->nr_heap];
+	i = 0;
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= w->nr_heap)
+			break;
+		if (child + 1 < w->nr_heap &&
+		    w->heap[child + 1].cluster < w->heap[child].cluster)
+			child++;
+		if (w->heap[i].cluster <= w->heap[child].cluster)
+			break;
+		tmp = w->heap[i];
+		w->heap[i] = w->heap[child];
+		w->heap[child] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * Start reading a directory from its first entry.
+ */
+static void
+walk_start(struct fatfs_walk *w)
+{
+
+	memset(&w->pos, 0, sizeof(w->pos));
+	w->pos.sector = SEC_INVAL;
+}
+
+/*
+ * Release the state of a subtree scan.
+ *
+ * @walk: scan state, or NULL
+ */
+void
+fatfs_scan_free(struct fatfs_walk *walk)
+{
+	__u32 i;
+
+	if (walk == NULL)
+		return;
+	for (i = 0; i < walk->nr_heap; i++)
+		free(walk->heap[i].path);
+	free(walk->heap);
+	free(walk->cur.path);
+	free(walk);
+}
+
+/*
+ * Fill a scan record for an entry.
+ */
+static void
+scan_fill(struct fatfs_scanent *ep, size_t reclen, struct fat_dirent *de,
+	  const char *path, size_t pathlen)
+{
+
+	ep->reclen = (unsigned short)reclen;
+	ep->pathlen = (unsigned short)pathlen;
+	fat_attr_to_mode(de->attr, &ep->mode);
+	ep->size = IS_DIR(de) ? 0 : de->size;
+	ep->mtime = fat_time_to_unix(de->date, de->time);
+	ep->cluster = de->cluster;
+	ep->attr = de->attr;
+	ep->date = de->date;
+	ep->time = de->time;
+	memcpy(ep->path, path, pathlen + 1);
+}
+
+/*
+ * Fill the buffer with records of the entries below a directory.
+ *
+ * The directories found are kept in a heap by cluster#, and the one
+ * lowest on the disk is read next. Each directory is read from its
+ * start, with its chain read ahead by fatfs_read_node(). The state is
+ * kept in the readdir position of the open file, so the next call
+ * continues after the last record returned.
+ *
+ * The caller must hold the lock.
+ *
+ * @dvp: vnode of the top directory
+ * @pos: readdir position of the open file
+ * @sc: scan argument
+ */
+int
+fatfs_scan(struct vnode *dvp, struct fatfs_dirpos *pos, struct fatfs_scan *sc)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp, dir, np;
+	struct fatfs_dirpos save;
+	struct fatfs_walk *w;
+	struct fat_dirent *de;
+	struct vnode tmp;
+	char lname[NAME_MAX + 1], sfn[13], *path, *name;
+	size_t len, reclen;
+	int error = 0;
+
+	fmp = dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	if (NODE_REMOVED(dnp))
+		return ENOENT;
+	sc->len = 0;
+	sc->nr = 0;
+
+	w = pos->walk;
+	if (w == NULL || (sc->flags & FATFS_SCAN_RESTART)) {
+		fatfs_scan_free(w);
+		pos->walk = NULL;
+		w = calloc(1, sizeof(struct fatfs_walk));
+		if (w == NULL)
+			return ENOMEM;
+		w->cur.cluster = dnp->dirent.cluster;
+		w->cur.path = strdup("");
+		if (w->cur.path == NULL) {
+			free(w);
+			return ENOMEM;
+		}
+		walk_start(w);
+		pos->walk = w;
+	}
+
+	path = malloc(PATH_MAX);
+	if (path == NULL)
+		return ENOMEM;
+
+	/* Read the directories through a vnode of our own */
+	memset(&dir, 0, sizeof(dir));
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.v_mount = dvp->v_mount;
+	tmp.v_type = VDIR;
+	tmp.v_data = &dir;
+	for (;;) {
+		if (w->cur.path == NULL) {
+			if (w->nr_heap == 0)
+				break;		/* end of the subtree */
+			/* More directories than clusters is a loop */
+			if (++w->nr_dirs > fmp->last_cluster) {
+				error = EIO;
+				break;
+			}
+			walk_pop(w, &w->cur);
+			walk_start(w);
+		}
+		dir.dirent.cluster = w->cur.cluster;
+		save = w->pos;
+		error = fatfs_read_node(&tmp, &w->pos, &np, lname);
+		if (error == ENOENT) {
+			free(w->cur.path);
+			w->cur.path = NULL;
+			error = 0;
+			continue;
+		}
+		if (error)
+			break;
+		de = &np.dirent;
+		if (de->name[0] == '.')
+			continue;	/* "." or ".." */
+
+		/* Make the path of the entry */
+		name = lname;
+		if (*name == '\0') {
+			fat_restore_name((char *)de->name, sfn);
+			name = sfn;
+		}
+		len = strlen(w->cur.path);
+		if (len + 1 + strlen(name) >= PATH_MAX)
+			continue;
+		if (len > 0) {
+			memcpy(path, w->cur.path, len);
+			path[len++] = '/';
+		}
+		strcpy(path + len, name);
+		len += strlen(name);
+
+		reclen = (offsetof(struct fatfs_scanent, path) + len + 8) & ~7UL;
+		if (sc->len + reclen > sc->size) {
+			/* Return this entry by the next call */
+			w->pos = save;
+			if (sc->nr == 0)
+				error = EINVAL;	/* not room for one record */
+			break;
+		}
+		if (IS_DIR(de) && de->cluster >= CL_FIRST) {
+			name = strdup(path);
+			if (name == NULL ||
+			    walk_push(w, de->cluster, name)) {
+				free(name);
+				w->pos = save;
+				error = ENOMEM;
+				break;
+			}
+		}
+		scan_fill((struct fatfs_scanent *)((char *)sc->buf + sc->len),
+			  reclen, de, path, len);
+		sc->len += reclen;
+		sc->nr++;
+	}
+	free(path);
+	return error;
+}
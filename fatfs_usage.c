@@ -0,0 +1,460 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <vfscore/vnode.h>
+#include <vfscore/mount.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <fatfs/ioctl.h>
+#include "fatfs.h"
+
+/*
+ * Usage aggregates of a directory and everything below it
+ *
+ * When a directory has a record, all the directories below it have
+ * one too, so a change anywhere below is added up the parent links.
+ * Records are only dropped with their directory or all together.
+ */
+struct fatfs_dirusage {
+	struct fatfs_dirusage	*next;		/* next in hash chain */
+	__u32			cluster;	/* first cluster# of directory */
+	__u32			parent;		/* cluster# of parent directory */
+	__u64			bytes;		/* total size of files */
+	__u32			files;		/* number of files */
+	__u32			dirs;		/* number of directories */
+	__u32			clusters;	/* clusters of file data */
+};
+
+#define USAGE_HASH_SIZE	256
+#define USAGE_HASH(cl)	((cl) & (USAGE_HASH_SIZE - 1))
+
+/*
+ * Check if the entry is a file or directory to account.
+ */
+static int
+usage_entry(struct fat_dirent *de)
+{
+
+	return !IS_EMPTY(de) && !IS_DELETED(de) && !IS_VOL(de) &&
+		de->name[0] != '.';
+}
+
+/*
+ * Clusters of file data, as needed by the file size.
+ */
+static __u32
+usage_clusters(struct fatfsmount *fmp, struct fat_dirent *de)
+{
+
+	if (de->cluster < CL_FIRST)
+		return 0;
+	if (de->size == 0)
+		return 1;
+	return (de->size + fmp->cluster_size - 1) / fmp->cluster_size;
+}
+
+static struct fatfs_dirusage *
+usage_find(struct fatfsmount *fmp, __u32 cl)
+{
+	struct fatfs_dirusage *up;
+
+	if (fmp->usage == NULL)
+		return NULL;
+	for (up = fmp->usage[USAGE_HASH(cl)]; up != NULL; up = up->next) {
+		if (up->cluster == cl)
+			return up;
+	}
+	return NULL;
+}
+
+/*
+ * Add a new record, the caller checks the limit.
+ */
+static struct fatfs_dirusage *
+usage_add(struct fatfsmount *fmp, __u32 cl, __u32 parent)
+{
+	struct fatfs_dirusage *up;
+
+	if (fmp->usage == NULL) {
+		fmp->usage = calloc(USAGE_HASH_SIZE,
+				    sizeof(struct fatfs_dirusage *));
+		if (fmp->usage == NULL)
+			return NULL;
+	}
+	up = calloc(1, sizeof(struct fatfs_dirusage));
+	if (up == NULL)
+		return NULL;
+	up->cluster = cl;
+	up->parent = parent;
+	up->next = fmp->usage[USAGE_HASH(cl)];
+	fmp->usage[USAGE_HASH(cl)] = up;
+	fmp->nr_usage++;
+	return up;
+}
+
+/*
+ * Drop all the usage records of the mount.
+ *
+ * @fmp: fat mount data
+ */
+void
+fatfs_usage_cleanup(struct fatfsmount *fmp)
+{
+	struct fatfs_dirusage *up, *next;
+	int i;
+
+	if (fmp->usage == NULL)
+		return;
+	for (i = 0; i < USAGE_HASH_SIZE; i++) {
+		for (up = fmp->usage[i]; up != NULL; up = next) {
+			next = up->next;
+			free(up);
+		}
+	}
+	free(fmp->usage);
+	fmp->usage = NULL;
+	fmp->nr_usage = 0;
+}
+
+/*
+ * Drop the usage record of a removed directory.
+ * Its usage has been taken from the parents with its entry.
+ *
+ * @fmp: fat mount data
+ * @cl: cluster# of directory
+ */
+void
+fatfs_usage_release(struct fatfsmount *fmp, __u32 cl)
+{
+	struct fatfs_dirusage **upp, *up;
+
+	if (fmp->usage == NULL)
+		return;
+	for (upp = &fmp->usage[USAGE_HASH(cl)]; *upp != NULL;
+	     upp = &(*upp)->next) {
+		if ((*upp)->cluster == cl) {
+			up = *upp;
+			*upp = up->next;
+			fmp->nr_usage--;
+			free(up);
+			return;
+		}
+	}
+}
+
+/*
+ * Prepare the usage records for a directory being moved to another
+ * parent. A directory without a record can not go below one with a
+ * record, so the records of the new parent and the directories above
+ * it are dropped then, to be computed again on the next query.
+ *
+ * @fmp: fat mount data
+ * @cl: cluster# of the directory moved
+ * @dcl: cluster# of the new parent directory
+ */
+void
+fatfs_usage_move(struct fatfsmount *fmp, __u32 cl, __u32 dcl)
+{
+	struct fatfs_dirusage *up;
+	__u32 n, parent;
+	int root;
+
+	if (cl < CL_FIRST || usage_find(fmp, cl) != NULL)
+		return;
+
+	/* A loop of parent links would not end */
+	n = fmp->nr_usage;
+	for (up = usage_find(fmp, dcl); up != NULL && n > 0; n--) {
+		parent = up->parent;
+		root = (up->cluster == CL_ROOT);
+		fatfs_usage_release(fmp, up->cluster);
+		if (root)
+			break;
+		up = usage_find(fmp, parent);
+	}
+}
+
+/*
+ * Add a change to a directory and to the directories above it.
+ */
+static void
+usage_apply(struct fatfsmount *fmp, __u32 cl, struct fatfs_dirusage *d,
+	    int sign)
+{
+	struct fatfs_dirusage *up;
+	__u32 n;
+
+	/* A loop of parent links would not end */
+	n = fmp->nr_usage;
+	for (up = usage_find(fmp, cl); up != NULL && n > 0; n--) {
+		if (sign > 0) {
+			up->bytes += d->bytes;
+			up->files += d->files;
+			up->dirs += d->dirs;
+			up->clusters += d->clusters;
+		} else {
+			up->bytes -= d->bytes;
+			up->files -= d->files;
+			up->dirs -= d->dirs;
+			up->clusters -= d->clusters;
+		}
+		if (up->cluster == CL_ROOT)
+			break;
+		up = usage_find(fmp, up->parent);
+	}
+}
+
+/*
+ * Usage of a directory entry, with the subtree of a directory.
+ */
+static void
+usage_of(struct fatfsmount *fmp, struct fat_dirent *de,
+	 struct fatfs_dirusage *d)
+{
+	struct fatfs_dirusage *up;
+
+	memset(d, 0, sizeof(*d));
+	if (!IS_DIR(de)) {
+		d->bytes = de->size;
+		d->files = 1;
+		d->clusters = usage_clusters(fmp, de);
+		return;
+	}
+	d->dirs = 1;
+	up = usage_find(fmp, de->cluster);
+	if (up != NULL) {
+		d->bytes = up->bytes;
+		d->files = up->files;
+		d->dirs += up->dirs;
+		d->clusters = up->clusters;
+	}
+}
+
+/*
+ * Keep the usage aggregates coherent with a directory entry update.
+ * This is called by fatfs_dir_update() for every entry written.
+ *
+ * @fmp: fat mount data
+ * @dcl: cluster# of the directory
+ * @old: directory entry on disk before update
+ * @new: directory entry written
+ */
+void
+fatfs_usage_change(struct fatfsmount *fmp, __u32 dcl, struct fat_dirent *old,
+		   struct fat_dirent *new)
+{
+	struct fatfs_dirusage d, *up;
+
+	if (usage_find(fmp, dcl) == NULL) {
+		/* A directory moved here stops adding up to the old parent */
+		if (usage_entry(new) && IS_DIR(new) &&
+		    new->cluster >= CL_FIRST) {
+			up = usage_find(fmp, new->cluster);
+			if (up != NULL)
+				up->parent = dcl;
+		}
+		return;		/* not counted */
+	}
+
+	if (usage_entry(old) && usage_entry(new) &&
+	    IS_DIR(old) && IS_DIR(new) && old->cluster == new->cluster)
+		return;		/* renamed in place */
+
+	if (usage_entry(old)) {
+		usage_of(fmp, old, &d);
+		usage_apply(fmp, dcl, &d, -1);
+	}
+	if (usage_entry(new)) {
+		if (IS_DIR(new) && new->cluster >= CL_FIRST) {
+			up = usage_find(fmp, new->cluster);
+			if (up == NULL) {
+				/* A new directory is empty */
+				if (fmp->nr_usage >= CONFIG_LIBFATFS_USAGE_MAX ||
+				    usage_add(fmp, new->cluster, dcl) == NULL) {
+					fatfs_usage_cleanup(fmp);
+					return;
+				}
+			} else
+				up->parent = dcl;
+		}
+		usage_of(fmp, new, &d);
+		usage_apply(fmp, dcl, &d, 1);
+	}
+}
+
+/*
+ * Directory read while computing the usage of a subtree
+ */
+struct usage_dir {
+	__u32			cluster;	/* first cluster# */
+	__u32			parent;		/* index of parent, or -1 */
+	struct fatfs_dirusage	u;		/* usage of the subtree */
+	int			known;		/* had a record already */
+};
+
+/*
+ * Compute the usage of a subtree, reading each directory without a
+ * record once. The records are kept for all the directories read if
+ * they fit in the limit.
+ */
+static int
+usage_walk(struct vnode *dvp, struct fatfs_dirusage *res)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp, dir, np;
+	struct fatfs_dirpos pos;
+	struct fatfs_dirusage *up, d;
+	struct usage_dir *dirs, *p;
+	struct fat_dirent *de;
+	struct vnode tmp;
+	__u32 nr = 0, max = 32, i;
+	int error = 0;
+
+	fmp = dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+
+	dirs = malloc(max * sizeof(struct usage_dir));
+	if (dirs == NULL)
+		return ENOMEM;
+	memset(&dirs[0], 0, sizeof(struct usage_dir));
+	dirs[0].cluster = dnp->dirent.cluster;
+	dirs[0].parent = (__u32)-1;
+	nr = 1;
+
+	/* Read the directories through a vnode of our own */
+	memset(&dir, 0, sizeof(dir));
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.v_mount = dvp->v_mount;
+	tmp.v_type = VDIR;
+	tmp.v_data = &dir;
+	for (i = 0; i < nr; i++) {
+		if (dirs[i].known)
+			continue;
+		dir.dirent.cluster = dirs[i].cluster;
+		memset(&pos, 0, sizeof(pos));
+		pos.sector = SEC_INVAL;
+		for (;;) {
+			error = fatfs_read_node(&tmp, &pos, &np, NULL);
+			if (error == ENOENT)
+				break;
+			if (error)
+				goto out;
+			de = &np.dirent;
+			if (!usage_entry(de))
+				continue;
+			if (!IS_DIR(de)) {
+				usage_of(fmp, de, &d);
+				dirs[i].u.bytes += d.bytes;
+				dirs[i].u.files += d.files;
+				dirs[i].u.clusters += d.clusters;
+				continue;
+			}
+			dirs[i].u.dirs++;
+			if (de->cluster < CL_FIRST)
+				continue;
+			/* More directories than clusters is a loop */
+			if (nr >= fmp->last_cluster) {
+				error = EIO;
+				goto out;
+			}
+			if (nr == max) {
+				p = realloc(dirs, max * 2 * sizeof(*p));
+				if (p == NULL) {
+					error = ENOMEM;
+					goto out;
+				}
+				dirs = p;
+				max *= 2;
+			}
+			p = &dirs[nr++];
+			memset(p, 0, sizeof(*p));
+			p->cluster = de->cluster;
+			p->parent = i;
+			up = usage_find(fmp, de->cluster);
+			if (up != NULL) {
+				p->u = *up;
+				p->known = 1;
+			}
+		}
+	}
+	error = 0;
+
+	/* Add up from the bottom, children follow their parents */
+	for (i = nr - 1; i > 0; i--) {
+		p = &dirs[dirs[i].parent];
+		p->u.bytes += dirs[i].u.bytes;
+		p->u.files += dirs[i].u.files;
+		p->u.dirs += dirs[i].u.dirs;
+		p->u.clusters += dirs[i].u.clusters;
+	}
+	*res = dirs[0].u;
+
+	/* Keep the records if they all fit */
+	if (fmp->nr_usage + nr > CONFIG_LIBFATFS_USAGE_MAX)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		if (dirs[i].known)
+			continue;
+		up = usage_add(fmp, dirs[i].cluster, i == 0 ? dnp->dcluster :
+			       dirs[dirs[i].parent].cluster);
+		if (up == NULL) {
+			fatfs_usage_cleanup(fmp);
+			break;
+		}
+		up->bytes = dirs[i].u.bytes;
+		up->files = dirs[i].u.files;
+		up->dirs = dirs[i].u.dirs;
+		up->clusters = dirs[i].u.clusters;
+	}
+ out:
+	free(dirs);
+	return error;
+}
+
+/*
+ * Get the usage of a directory and everything below it.
+ * It is computed once, then kept up to date by the entry updates.
+ *
+ * The caller must hold the lock.
+ *
+ * @dvp: vnode of the directory
+ * @u: usage to return
+ */
+int
+fatfs_usage_get(struct vnode *dvp, struct fatfs_usage *u)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *dnp;
+	struct fatfs_dirusage *up, res;
+	int error;
+
+	fmp = dvp->v_mount->m_data;
+	dnp = dvp->v_data;
+	if (NODE_REMOVED(dnp))
+		return ENOENT;
+
+	up = usage_find(fmp, dnp->dirent.cluster);
+	if (up == NULL) {
+		/* The walk reads sizes from disk */
+		error = fatfs_sync_nodes(fmp);
+		if (error)
+			return error;
+		DPRINTF(("fatfs_usage_get: walk cl=%d\n", dnp->dirent.cluster));
+		error = usage_walk(dvp, &res);
+		if (error)
+			return error;
+		up = &res;
+	}
+	u->bytes = (off_t)up->bytes;
+	u->files = up->files;
+	u->dirs = up->dirs;
+	u->clusters = up->clusters;
+	return 0;
+}
@@ -29,6 +29,7 @@
 
 #include <vfscore/vnode.h>
 #include <vfscore/mount.h>
+#include <vfscore/dentry.h>
 
 #include <uk/blkdev.h>
 
@@ -41,7 +42,7 @@
 
 static int fatfs_mount	(struct mount *mp, const char *dev, int flags, const void *data);
 static int fatfs_unmount(struct mount *mp, int flags);
-#define fatfs_sync	((vfsop_sync_t)vfscore_nullop)
+static int fatfs_sync	(struct mount *mp);
 static int fatfs_vget	(struct mount *mp, struct vnode* vp);
 #define fatfs_statfs	((vfsop_statfs_t)vfscore_nullop)
 
@@ -221,16 +222,56 @@ static int fatfs_close_blkdev(struct uk_blkdev *blkdev) {
 	return 0;
 }
 
+/*
+ * Get the number of nodes to preallocate from the mount options.
+ * The options are a comma separated string, "nodes=<n>" is known.
+ */
+static __u32
+fat_mount_nodes(const char *opts)
+{
+	const char *p;
+	char *end;
+	unsigned long n;
+
+	if (opts == NULL)
+		return CONFIG_LIBFATFS_NODE_POOL;
+	for (p = opts; p != NULL && *p != '\0'; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (strncmp(p, "nodes=", 6))
+			continue;
+		n = strtoul(p + 6, &end, 10);
+		if (end != p + 6 && (*end == '\0' || *end == ','))
+			return (__u32)n;
+	}
+	return CONFIG_LIBFATFS_NODE_POOL;
+}
+
+/*
+ * Allocate an I/O buffer of the mount, aligned for the device.
+ */
+static void *
+fat_iobuf(size_t size, size_t align)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, align, size))
+		return NULL;
+	return buf;
+}
+
 /*
  * Mount file system.
  */
 static int
 fatfs_mount(struct mount *mp, const char *dev, int flags __unused,
-	    const void *data __unused)
+	    const void *data)
 {
 	struct fatfsmount *fmp;
 	struct fatfs_node *vnp;
 	struct vnode *vp;
+	__u32 nodes;
+	size_t align;
 	int error = 0;
 
 	DPRINTF(("fatfs_mount device=%s\n", dev));
@@ -247,30 +288,76 @@ fatfs_mount(struct mount *mp, const char *dev, int flags __unused,
 	if (fat_read_bpb(fmp) != 0)
 		goto err1;
 
+	/* Data and directory clusters are moved through pooled buffers */
 	error = ENOMEM;
-	fmp->io_buf = malloc(fmp->sec_per_cl * SEC_SIZE);
-	if (fmp->io_buf == NULL)
+	align = MAX(uk_blkdev_ioalign(fmp->dev), sizeof(void *));
+	if (fatfs_bufpool_init(&fmp->cl_bufs, fmp->cluster_size, align, 1,
+			       CONFIG_LIBFATFS_BUF_POOL))
 		goto err1;
+	if (fatfs_bufpool_init(&fmp->sec_bufs, SEC_SIZE, align, 1,
+			       CONFIG_LIBFATFS_BUF_POOL))
+		goto err2;
 
-	fmp->fat_buf = malloc(SEC_SIZE * 2);
+	fmp->fat_buf = fat_iobuf(SEC_SIZE * 2, align);
 	if (fmp->fat_buf == NULL)
-		goto err2;
+		goto err3;
+	fmp->fat_sec = SEC_INVAL;
+	fmp->fat_nr = 0;
+	fmp->fat_dirty = 0;
 
-	fmp->dir_buf = malloc(SEC_SIZE);
+	fmp->dir_buf = fat_iobuf(SEC_SIZE, align);
 	if (fmp->dir_buf == NULL)
-		goto err3;
+		goto err4;
+	fmp->dir_sec = SEC_INVAL;
+	fmp->dir_dirty = 0;
+	fmp->batch = 0;
+
+	/* Read-ahead is optional, scans work without it */
+	fmp->ra_buf = NULL;
+	fmp->nr_ra = 0;
+	if (CONFIG_LIBFATFS_DIR_READAHEAD > 0)
+		fmp->ra_buf = fat_iobuf(CONFIG_LIBFATFS_DIR_READAHEAD * SEC_SIZE,
+				       align);
+
+	/* Nodes and readdir positions are taken from the pools */
+	nodes = fat_mount_nodes(data);
+	if (fatfs_pool_init(&fmp->node_pool, sizeof(struct fatfs_node),
+			    nodes, POOL_KEEP))
+		goto err5;
+	if (fatfs_pool_init(&fmp->pos_pool, sizeof(struct fatfs_dirpos),
+			    nodes, POOL_KEEP))
+		goto err6;
 
 	uk_mutex_init(&fmp->lock);
+	uk_mutex_init(&fmp->fat_lock);
+	fatfs_dir_init(fmp);
+	UK_INIT_LIST_HEAD(&fmp->nodes);
+	fmp->ino_gen = 0;
+	fmp->path_cache = NULL;
+	fmp->path_gen = 0;
+	fmp->usage = NULL;
+	fmp->nr_usage = 0;
+	vnp = fatfs_node_alloc(fmp);
+	if (vnp == NULL)
+		goto err7;
+	vnp->dirent.cluster = CL_ROOT;
 	mp->m_data = fmp;
 	vp = mp->m_root->d_vnode;
-	vnp = malloc(sizeof(struct fatfs_node));
-	vnp->dirent.cluster = CL_ROOT;
 	vp->v_data = vnp;
 	return 0;
- err3:
+ err7:
+	fatfs_pool_destroy(&fmp->pos_pool);
+ err6:
+	fatfs_pool_destroy(&fmp->node_pool);
+ err5:
+	free(fmp->ra_buf);
+	free(fmp->dir_buf);
+ err4:
 	free(fmp->fat_buf);
+ err3:
+	fatfs_bufpool_destroy(&fmp->sec_bufs);
  err2:
-	free(fmp->io_buf);
+	fatfs_bufpool_destroy(&fmp->cl_bufs);
  err1:
 	fatfs_close_blkdev(fmp->dev);
 	free(fmp);
@@ -284,26 +371,64 @@ static int
 fatfs_unmount(struct mount *mp, int flags __unused)
 {
 	struct fatfsmount *fmp;
+	int busy;
 
-	// FIXME: free dentries?
 	fmp = mp->m_data;
+
+	/*
+	 * Dropping the cached dentries releases their vnodes, and the
+	 * nodes go back to the pool through fatfs_inactive. A node left
+	 * is still referenced by an open file.
+	 */
+	vfscore_release_mp_dentries(mp);
+	uk_mutex_lock(&fmp->lock);
+	busy = !uk_list_empty(&fmp->nodes);
+	uk_mutex_unlock(&fmp->lock);
+	if (busy)
+		return EBUSY;
+
+	fatfs_sync(mp);
+
 	fatfs_close_blkdev(fmp->dev);
+	fatfs_dir_cleanup(fmp);
+	fatfs_path_cleanup(fmp);
+	fatfs_usage_cleanup(fmp);
+	fatfs_pool_destroy(&fmp->pos_pool);
+	fatfs_pool_destroy(&fmp->node_pool);
+	free(fmp->ra_buf);
 	free(fmp->dir_buf);
 	free(fmp->fat_buf);
-	free(fmp->io_buf);
+	fatfs_bufpool_destroy(&fmp->sec_bufs);
+	fatfs_bufpool_destroy(&fmp->cl_bufs);
 	free(fmp);
 	return 0;
 }
 
+/*
+ * Write the size and times kept in the nodes of open files.
+ */
+static int
+fatfs_sync(struct mount *mp)
+{
+	struct fatfsmount *fmp;
+	int error;
+
+	fmp = mp->m_data;
+	uk_mutex_lock(&fmp->lock);
+	error = fatfs_sync_nodes(fmp);
+	uk_mutex_unlock(&fmp->lock);
+	return error;
+}
+
 /*
  * Prepare the FAT specific node and fill the vnode.
  */
 static int
-fatfs_vget(struct mount *mp __unused, struct vnode *vp)
+fatfs_vget(struct mount *mp, struct vnode *vp)
 {
 	struct fatfs_node *np;
 
-	np = malloc(sizeof(struct fatfs_node));
+	np = fatfs_node_alloc(mp->m_data);
 	if (np == NULL)
 		return ENOMEM;
 	vp->v_data = np;
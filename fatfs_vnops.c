@@ -36,27 +36,25 @@
 #include <vfscore/file.h>
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include <fatfs/ioctl.h>
 #include "fatfs.h"
 
-static __u64 inode_count = 1; /* inode 0 is reserved to root */
-
 /*
  *  Time bits: 15-11 hours (0-23), 10-5 min, 4-0 sec /2
  *  Date bits: 15-9 year - 1980, 8-5 month, 4-0 day
  */
-#define TEMP_DATE   0x3021
-#define TEMP_TIME   0
 
 #define fatfs_open	((vnop_open_t)vfscore_vop_nullop)
-#define fatfs_close	((vnop_close_t)vfscore_vop_nullop)
+static int fatfs_close	(struct vnode *, struct vfscore_file *);
 static int fatfs_read   (struct vnode *, struct vfscore_file *, struct uio *, int);
 static int fatfs_write	(struct vnode *, struct uio *, int);
 #define fatfs_seek	((vnop_seek_t)vfscore_vop_nullop)
-#define fatfs_ioctl	((vnop_ioctl_t)vfscore_vop_einval)
-#define fatfs_fsync	((vnop_fsync_t)vfscore_vop_nullop)
+static int fatfs_ioctl	(struct vnode *, struct vfscore_file *, unsigned long, void *);
+static int fatfs_fsync	(struct vnode *, struct vfscore_file *);
 static int fatfs_readdir(struct vnode *, struct vfscore_file *, struct dirent *);
 static int fatfs_lookup	(struct vnode *, char *, struct vnode **);
 static int fatfs_create	(struct vnode *, char *, mode_t);
@@ -104,41 +102,354 @@ struct vnops fatfs_vnops = {
 };
 
 /*
- * Read one cluster to buffer.
+ * Read clusters contiguous on disk to a buffer.
  */
 static int
-fat_read_cluster(struct fatfsmount *fmp, __u32 cluster)
+fat_read_run(struct fatfsmount *fmp, __u32 cluster, __u32 nr, void *buf)
 {
 	__u32 sec;
 
 	sec = cl_to_sec(fmp, cluster);
-	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec, fmp->sec_per_cl, fmp->io_buf);
+	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_READ, sec,
+				 nr * fmp->sec_per_cl, buf);
 }
 
 /*
- * Write one cluster from buffer.
+ * Drop the directory data cached for sectors being written.
+ * The caller must hold the lock.
+ */
+static void
+fat_drop_cached(struct fatfsmount *fmp, __u32 sec, __u32 nr)
+{
+
+	if (fmp->dir_sec - sec < nr) {
+		fmp->dir_sec = SEC_INVAL;
+		fmp->dir_dirty = 0;
+	}
+	fatfs_ra_invalidate(fmp, sec, nr);
+}
+
+/*
+ * Write clusters contiguous on disk from a buffer.
+ * The caller must hold the lock.
  */
 static int
-fat_write_cluster(struct fatfsmount *fmp, __u32 cluster)
+fat_write_run(struct fatfsmount *fmp, __u32 cluster, __u32 nr, void *buf)
 {
 	__u32 sec;
 
 	sec = cl_to_sec(fmp, cluster);
-	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec, fmp->sec_per_cl, fmp->io_buf);
+	/* Directory data may be written through this buffer */
+	fat_drop_cached(fmp, sec, nr * fmp->sec_per_cl);
+	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec,
+				 nr * fmp->sec_per_cl, buf);
+}
+
+/*
+ * Write file data to clusters contiguous on disk. Only the file data
+ * lock is held over the I/O.
+ */
+static int
+fat_write_data(struct fatfsmount *fmp, __u32 cluster, __u32 nr, void *buf)
+{
+	__u32 sec;
+
+	sec = cl_to_sec(fmp, cluster);
+	uk_mutex_lock(&fmp->lock);
+	fat_drop_cached(fmp, sec, nr * fmp->sec_per_cl);
+	uk_mutex_unlock(&fmp->lock);
+	return uk_blkdev_sync_io(fmp->dev, 0, UK_BLKREQ_WRITE, sec,
+				 nr * fmp->sec_per_cl, buf);
+}
+
+/*
+ * Clear the part of a file between its end and a new end, before the
+ * new size is seen, so that no stale data of the volume is read from
+ * it. The clusters are written whole. The caller holds the file data
+ * lock.
+ *
+ * @fmp: fat mount data
+ * @start: first cluster# of the file
+ * @from: current size of the file
+ * @to: new size of the file, or the offset of a write past the end
+ * @buf: cluster buffer
+ */
+static int
+fat_write_hole(struct fatfsmount *fmp, __u32 start, off_t from, off_t to,
+	       char *buf)
+{
+	size_t pos;
+	__u32 cl;
+	int error;
+
+	error = fat_seek_cluster(fmp, start, (__u32)from, &cl);
+	if (error)
+		return error;
+
+	pos = from % fmp->cluster_size;
+	while (from < to) {
+		if (pos == 0)
+			memset(buf, 0, fmp->cluster_size);
+		else if (fat_read_run(fmp, cl, 1, buf))
+			return EIO;
+		else
+			memset(buf + pos, 0, fmp->cluster_size - pos);
+		if (fat_write_data(fmp, cl, 1, buf))
+			return EIO;
+		from += fmp->cluster_size - pos;
+		pos = 0;
+		if (from < to) {
+			error = fat_next_cluster(fmp, cl, &cl);
+			if (error)
+				return error;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Count the clusters contiguous on disk from a cluster, up to max.
+ * The cluster following them in the chain is returned in next.
+ */
+static int
+fat_run_length(struct fatfsmount *fmp, __u32 cl, __u32 max, __u32 *nr,
+	       __u32 *next)
+{
+	__u32 n;
+	int error;
+
+	for (n = 1; ; n++, cl++) {
+		error = fat_next_cluster(fmp, cl, next);
+		if (error)
+			return error;
+		if (n >= max || *next != cl + 1)
+			break;
+	}
+	*nr = n;
+	return 0;
+}
+
+/*
+ * Get the iovec to transfer next, skipping empty ones.
+ */
+static struct iovec *
+fat_uio_iov(struct uio *uio)
+{
+
+	while (uio->uio_iovcnt > 0 && uio->uio_iov->iov_len == 0) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+	}
+	return uio->uio_iovcnt > 0 ? uio->uio_iov : NULL;
+}
+
+/*
+ * Get the number of whole clusters which can be moved between the
+ * device and the current iovec, without the cluster buffer.
+ */
+static __u32
+fat_uio_direct(struct fatfsmount *fmp, struct uio *uio, size_t size)
+{
+	struct iovec *iov;
+	size_t align;
+
+	iov = fat_uio_iov(uio);
+	if (iov == NULL)
+		return 0;
+	align = uk_blkdev_ioalign(fmp->dev);
+	if (align > 1 && (uintptr_t)iov->iov_base % align)
+		return 0;
+	if (size > iov->iov_len)
+		size = iov->iov_len;
+	return size / fmp->cluster_size;
+}
+
+/*
+ * Account for data moved to or from the current iovec.
+ */
+static void
+fat_uio_skip(struct uio *uio, size_t n)
+{
+	struct iovec *iov = uio->uio_iov;
+
+	iov->iov_base = (char *)iov->iov_base + n;
+	iov->iov_len -= n;
+	uio->uio_resid -= (ssize_t)n;
+	uio->uio_offset += (off_t)n;
+}
+
+static int
+fatfs_close(struct vnode *vp, struct vfscore_file *fp)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *np;
+	int error;
+
+	fmp = vp->v_mount->m_data;
+	np = vp->v_data;
+	uk_mutex_lock(&np->lock);
+	uk_mutex_lock(&fmp->lock);
+
+	/* Write size and times kept in memory */
+	error = fatfs_sync_node(fmp, np);
+
+	/* Release readdir position */
+	if (fp->f_data != NULL) {
+		fatfs_scan_free(((struct fatfs_dirpos *)fp->f_data)->walk);
+		fatfs_pool_put(&fmp->pos_pool, fp->f_data);
+		fp->f_data = NULL;
+	}
+	uk_mutex_unlock(&fmp->lock);
+	uk_mutex_unlock(&np->lock);
+	return error;
+}
+
+static int
+fatfs_fsync(struct vnode *vp, struct vfscore_file *fp __unused)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *np;
+	int error;
+
+	/* Wait for the writes in progress */
+	fmp = vp->v_mount->m_data;
+	np = vp->v_data;
+	uk_mutex_lock(&np->lock);
+	uk_mutex_lock(&fmp->lock);
+	error = fatfs_sync_node(fmp, np);
+	uk_mutex_unlock(&fmp->lock);
+	uk_mutex_unlock(&np->lock);
+	return error;
+}
+
+/*
+ * Set the vnode attributes from the directory entry.
+ */
+static void
+fat_vnode_attr(struct vnode *vp, struct fat_dirent *de)
+{
+
+	vp->v_type = IS_DIR(de) ? VDIR : VREG;
+	fat_attr_to_mode(de->attr, &vp->v_mode);
+	vp->v_mode = UK_ALLPERMS;
+	vp->v_size = de->size;
+}
+
+/*
+ * Find the node of a looked up vnode for a directory entry.
+ * A file is found by the location of its entry, which rename and
+ * compaction keep up to date, and a directory by its first cluster
+ * too. A node whose entry was replaced behind it is not used.
+ * Return NULL if there is none.
+ */
+static struct fatfs_node *
+fat_find_vnode(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fatfs_node *vnp;
+	struct fat_dirent *de = &np->dirent;
+
+	uk_list_for_each_entry(vnp, &fmp->nodes, link) {
+		if (NODE_REMOVED(vnp))
+			continue;
+		if (vnp->dcluster == np->dcluster &&
+		    vnp->sector == np->sector && vnp->offset == np->offset) {
+			if (!memcmp(vnp->dirent.name, de->name, 11) &&
+			    vnp->dirent.cluster == de->cluster)
+				return vnp;
+			continue;
+		}
+		if (IS_DIR(de) && de->cluster >= CL_FIRST &&
+		    IS_DIR(&vnp->dirent) && vnp->dirent.cluster == de->cluster)
+			return vnp;
+	}
+	return NULL;
+}
+
+/*
+ * Get the inode number for a new vnode of a directory entry.
+ * The number derived from the entry is used, unless a vnode alive
+ * holds it, as the first cluster of a file truncated to zero can be
+ * given to another file.
+ */
+static __u64
+fat_new_ino(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	struct fatfs_node *vnp;
+	__u64 ino;
+
+	ino = fatfs_node_ino(np);
+	uk_list_for_each_entry(vnp, &fmp->nodes, link) {
+		if (vnp->ino == ino)
+			return (1ULL << 62) | ++fmp->ino_gen;
+	}
+	return ino;
+}
+
+/*
+ * Get the vnode of a directory entry, from the vnode cache or new.
+ * The caller must hold the lock.
+ *
+ * @mp: mount point
+ * @np: fat node of the entry
+ * @vpp: vnode to return
+ */
+static int
+fat_get_vnode(struct mount *mp, struct fatfs_node *np, struct vnode **vpp)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *vnp;
+	struct vnode *vp;
+	__u64 ino;
+
+	fmp = mp->m_data;
+	vnp = fat_find_vnode(fmp, np);
+	ino = (vnp != NULL) ? vnp->ino : fat_new_ino(fmp, np);
+	if (vfscore_vget(mp, ino, &vp)) {
+		/* found in cache */
+		vnp = vp->v_data;
+		if (np->dirent.name[0] != '.') {
+			/* The node of a directory may come from ".." */
+			vnp->dcluster = np->dcluster;
+			vnp->sector = np->sector;
+			vnp->offset = np->offset;
+			vnp->lfn = np->lfn;
+			memcpy(vnp->dirent.name, np->dirent.name, 11);
+		}
+		*vpp = vp;
+		return 0;
+	}
+	if (vp == NULL)
+		return ENOMEM;
+
+	/* The node is allocated by fatfs_vget() */
+	vnp = vp->v_data;
+	*vnp = *np;
+	vnp->dirty = 0;
+	vnp->orphan = 0;
+	vnp->seq = 0;
+	vnp->nr_ext = 0;
+	vnp->ino = ino;
+	uk_mutex_init(&vnp->lock);
+	uk_list_add(&vnp->link, &fmp->nodes);
+	fat_vnode_attr(vp, &np->dirent);
+
+	DPRINTF(("fat_get_vnode: cl=%d\n", np->dirent.cluster));
+	*vpp = vp;
+	return 0;
 }
 
 /*
  * Lookup vnode for the specified file/directory.
  * The vnode data will be set properly.
+ *
+ * The vnode of an entry already looked up is found by the location
+ * of the entry, and keeps its inode number until it is released.
  */
 static int
 fatfs_lookup(struct vnode *dvp, char *name, struct vnode **vpp)
 {
 	struct fatfsmount *fmp;
-	struct fat_dirent *de;
 	struct fatfs_node np;
-	struct fatfs_node *vnp;
-	struct vnode *vp;
 	int error;
 
 	*vpp = NULL;
@@ -158,279 +469,789 @@ fatfs_lookup(struct vnode *dvp, char *name, struct vnode **vpp)
 		return error;
 	}
 
-	if (vfscore_vget(dvp->v_mount, inode_count++, &vp)) {
-		/* found in cache */
-		*vpp = vp;
-		uk_mutex_unlock(&fmp->lock);
-		return 0;
-	}
-
-	vnp = malloc(sizeof(np));
-	if (vp->v_data == NULL) {
-		return ENOMEM;
-	}
-	vp->v_data = vnp;
-	*vnp = np;
-
-	de = &np.dirent;
-	vp->v_type = IS_DIR(de) ? VDIR : VREG;
-	fat_attr_to_mode(de->attr, &vp->v_mode);
-	vp->v_mode = UK_ALLPERMS;
-	vp->v_size = de->size;
-
-	DPRINTF(("fatfs_lookup: cl=%d\n", de->cluster));
+	error = fat_get_vnode(dvp->v_mount, &np, vpp);
 	uk_mutex_unlock(&fmp->lock);
-
-	*vpp = vp;
-
-	return 0;
+	return error;
 }
 
+/*
+ * Read the whole uio in one pass over the cluster chain. Runs of
+ * whole clusters contiguous on disk are read to the user buffer with
+ * one request, other data is copied through a cluster buffer.
+ *
+ * No lock is taken while the runs of the file are known to the node.
+ * Each piece read to the cluster buffer is checked with the sequence
+ * count of the node before it is copied out, and read again if the
+ * size or the chain changed meanwhile. A piece which keeps failing is
+ * read with the file data lock held, and so are the reads to the user
+ * buffer, which can not be taken back.
+ */
 static int
 fatfs_read(struct vnode *vp, struct vfscore_file *fp __unused, struct uio *uio,
 	   int ioflag __unused)
 {
 	struct fatfsmount *fmp;
-	size_t nr_read, nr_copy, buf_pos, size;
-	int error;
-	__u32 cl;
-	off_t file_pos;
-	struct iovec *iov;
 	struct fatfs_node *np;
-	void *buf;
+	struct fatfs_extent ext;
+	size_t nr_copy, buf_pos;
+	ssize_t resid;
+	off_t size;
+	__u32 seq, index, cl, nr;
+	__u16 d, t;
+	char *buf = NULL;
+	int removed, found, retry = 0, locked = 0;
+	int error = 0;
 
 	DPRINTF(("fatfs_read: vp=%p\n", vp));
 
 	fmp = vp->v_mount->m_data;
+	np = vp->v_data;
 
 	if (vp->v_type == VDIR)
 		return EISDIR;
 	if (vp->v_type != VREG)
 		return EINVAL;
+	if (uio->uio_offset < 0)
+		return EINVAL;
+
+	resid = uio->uio_resid;
+	while (uio->uio_resid > 0) {
+		/* Take the size and the run to read from the node */
+		seq = fatfs_node_read_begin(np);
+		removed = NODE_REMOVED(np);
+		size = vp->v_size;
+		index = uio->uio_offset / fmp->cluster_size;
+		found = !removed && uio->uio_offset < size &&
+			fatfs_node_find_ext(np, index, &ext);
+		if (fatfs_node_read_retry(np, seq))
+			continue;
+
+		if (!found && !removed && uio->uio_offset < size) {
+			/* Walk the chain for the runs not known yet */
+			uk_mutex_lock(&fmp->lock);
+			seq = np->seq;
+			removed = NODE_REMOVED(np);
+			size = vp->v_size;
+			if (!removed && uio->uio_offset < size)
+				error = fatfs_node_map(fmp, np, index, &ext);
+			uk_mutex_unlock(&fmp->lock);
+			if (error)
+				break;
+		}
+		if (removed) {
+			error = ENOENT;
+			break;
+		}
+		if (uio->uio_offset >= size)
+			break;	/* end of file */
+
+		cl = ext.cluster + (index - ext.index);
+		buf_pos = uio->uio_offset % fmp->cluster_size;
+		nr_copy = (size_t)uio->uio_resid;
+		if ((size_t)(size - uio->uio_offset) < nr_copy)
+			nr_copy = size - uio->uio_offset;
+
+		nr = buf_pos == 0 ? fat_uio_direct(fmp, uio, nr_copy) : 0;
+		if (nr > ext.index + ext.count - index)
+			nr = ext.index + ext.count - index;
+		if (nr > 0 && !locked) {
+			/* The user buffer only gets data of the file */
+			uk_mutex_lock(&np->lock);
+			locked = 1;
+			continue;
+		}
+		if (nr > 0) {
+			/* Whole clusters go to the user buffer */
+			if (fat_read_run(fmp, cl, nr, uio->uio_iov->iov_base)) {
+				error = EIO;
+				break;
+			}
+			nr_copy = (size_t)nr * fmp->cluster_size;
+		} else {
+			if (buf == NULL) {
+				buf = fatfs_buf_get(&fmp->cl_bufs);
+				if (buf == NULL) {
+					error = ENOMEM;
+					break;
+				}
+			}
+			if (fat_read_run(fmp, cl, 1, buf)) {
+				error = EIO;
+				break;
+			}
+			if (nr_copy > fmp->cluster_size - buf_pos)
+				nr_copy = fmp->cluster_size - buf_pos;
+		}
 
-	/* Check if current file position is already end of file. */
-	file_pos = uio->uio_offset;
-	if (file_pos >= vp->v_size)
+		if (fatfs_node_read_retry(np, seq)) {
+			/* The clusters may not be the file's any more */
+			if (++retry >= NODE_READ_RETRY && !locked) {
+				uk_mutex_lock(&np->lock);
+				locked = 1;
+			}
+			continue;
+		}
+		retry = 0;
+		if (nr > 0)
+			fat_uio_skip(uio, nr_copy);
+		else {
+			error = vfscore_uiomove(buf + buf_pos, (int)nr_copy,
+						uio);
+			if (error)
+				break;
+		}
+	}
+
+	/* The access date is written back with the node, once a day */
+	if (!error && uio->uio_resid != resid) {
+		fat_unix_to_time(time(NULL), &d, &t);
+		if (np->dirent.adate != d) {
+			uk_mutex_lock(&fmp->lock);
+			if (fat_stamp(&np->dirent, STAMP_ACCESS))
+				np->dirty = 1;
+			uk_mutex_unlock(&fmp->lock);
+		}
+	}
+	if (locked)
+		uk_mutex_unlock(&np->lock);
+	fatfs_buf_put(&fmp->cl_bufs, buf);
+	return error;
+}
+
+/*
+ * Write the whole uio in one pass over the cluster chain, after the
+ * file is expanded once for all of it.
+ *
+ * Only the file data lock is held over the I/O, the mount lock is
+ * taken for the directory entry alone.
+ */
+static int
+fatfs_write(struct vnode *vp, struct uio *uio, int ioflag)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node *np;
+	struct fat_dirent *de, old;
+	size_t size, nr_copy, buf_pos;
+	off_t end_pos, old_size;
+	__u32 cl, nr, next;
+	char *buf = NULL;
+	int error;
+
+	DPRINTF(("fatfs_write: vp=%p\n", vp));
+
+	fmp = vp->v_mount->m_data;
+	np = vp->v_data;
+
+	if (vp->v_type == VDIR)
+		return EISDIR;
+	if (vp->v_type != VREG)
+		return EINVAL;
+	if (uio->uio_offset < 0)
+		return EINVAL;
+	if (uio->uio_offset >= LONG_MAX)
+		return EFBIG;
+	if (uio->uio_resid == 0)
 		return 0;
 
-	/* find first non-empty iovec */
-	iov = uio->uio_iov;
-	while (!iov->iov_len) {
-		uio->uio_iov++;
-		uio->uio_iovcnt--;
+	uk_mutex_lock(&np->lock);
+
+	if (ioflag & IO_APPEND)
+		uio->uio_offset = vp->v_size;
+
+	/* The size of a file is 32 bits in its entry */
+	end_pos = uio->uio_offset + uio->uio_resid;
+	if (end_pos > (off_t)0xffffffffU) {
+		error = EFBIG;
+		goto out;
 	}
-	buf = iov->iov_base;
-	size = iov->iov_len;
 
 	uk_mutex_lock(&fmp->lock);
 
-	np = vp->v_data;
+	if (NODE_REMOVED(np)) {
+		error = ENOENT;
+		goto out_unlock;
+	}
+
+	/* Check if file position exceeds the end of file. */
+	old_size = vp->v_size;
+	de = &np->dirent;
+	if (end_pos > old_size) {
 
-	/* Get the actual read size. */
-	if ((size_t)(vp->v_size - file_pos) < size)
-		size = vp->v_size - file_pos;
+		/*
+		 * Expand the chain before writing to it. The new size is
+		 * set once the data is written, as readers without lock
+		 * would read the clusters as they are on disk.
+		 */
+		cl = de->cluster;
+		error = fat_expand_file(fmp, &cl, (__u32)end_pos);
+		if (error) {
+			error = EIO;
+			goto out_unlock;
+		}
+
+		if (de->cluster != cl) {
+			/*
+			 * The first cluster is written at once, so that
+			 * the chain is never lost by a crash or a remove.
+			 */
+			error = fatfs_sync_node(fmp, np);
+			if (error)
+				goto out_unlock;
+			fatfs_node_write_begin(np);
+			de->cluster = cl;
+			fatfs_node_write_end(np);
+			error = fatfs_put_node(fmp, np);
+			if (error)
+				goto out_unlock;
+		} else {
+			fatfs_node_write_begin(np);
+			fatfs_node_trim(np);
+			fatfs_node_write_end(np);
+		}
+	}
+	cl = de->cluster;
+	uk_mutex_unlock(&fmp->lock);
+
+	if (uio->uio_offset > old_size) {
+		/* The gap up to the write reads as zeros */
+		buf = fatfs_buf_get(&fmp->cl_bufs);
+		if (buf == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+		error = fat_write_hole(fmp, cl, old_size, uio->uio_offset, buf);
+		if (error)
+			goto out;
+	}
 
 	/* Seek to the cluster for the file offset */
-	error = fat_seek_cluster(fmp, np->dirent.cluster, file_pos, &cl);
+	error = fat_seek_cluster(fmp, cl, uio->uio_offset, &cl);
 	if (error)
 		goto out;
 
-	/* Read and copy data */
-	nr_read = 0;
-	buf_pos = file_pos % fmp->cluster_size;
-	do {
-		if (fat_read_cluster(fmp, cl)) {
+	size = (size_t)uio->uio_resid;
+	buf_pos = uio->uio_offset % fmp->cluster_size;
+	while (size > 0 && !IS_EOFCL(fmp, cl)) {
+		nr = buf_pos == 0 ? fat_uio_direct(fmp, uio, size) : 0;
+		if (nr > 0) {
+			error = fat_run_length(fmp, cl, nr, &nr, &next);
+			if (error)
+				goto out;
+			if (fat_write_data(fmp, cl, nr, uio->uio_iov->iov_base)) {
+				error = EIO;
+				goto out;
+			}
+			nr_copy = (size_t)nr * fmp->cluster_size;
+			fat_uio_skip(uio, nr_copy);
+			size -= nr_copy;
+			cl = next;
+			continue;
+		}
+
+		if (buf == NULL) {
+			buf = fatfs_buf_get(&fmp->cl_bufs);
+			if (buf == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+		}
+		nr_copy = fmp->cluster_size - buf_pos;
+		if (nr_copy > size)
+			nr_copy = size;
+		if (nr_copy < fmp->cluster_size) {
+			/* Keep the rest of the cluster, or clear it past the end */
+			if (uio->uio_offset - (off_t)buf_pos >= old_size)
+				memset(buf, 0, fmp->cluster_size);
+			else if (fat_read_run(fmp, cl, 1, buf)) {
+				error = EIO;
+				goto out;
+			}
+		}
+		error = vfscore_uiomove(buf + buf_pos, (int)nr_copy, uio);
+		if (error)
+			goto out;
+		if (fat_write_data(fmp, cl, 1, buf)) {
 			error = EIO;
 			goto out;
 		}
+		size -= nr_copy;
+		buf_pos = 0;
+		if (size > 0) {
+			error = fat_next_cluster(fmp, cl, &cl);
+			if (error)
+				goto out;
+		}
+	}
 
-		nr_copy = fmp->cluster_size;
-		if (buf_pos > 0)
-			nr_copy -= buf_pos;
-		if (buf_pos + size < fmp->cluster_size)
-			nr_copy = size;
-		memcpy(buf, fmp->io_buf + buf_pos, nr_copy);
+	/* The size and modification time are written back with the node */
+	uk_mutex_lock(&fmp->lock);
+	if (uio->uio_offset > old_size && !NODE_REMOVED(np)) {
+		old = *de;
+		fatfs_node_write_begin(np);
+		de->size = (__u32)uio->uio_offset;
+		vp->v_size = uio->uio_offset;
+		fatfs_node_write_end(np);
+		fatfs_usage_change(fmp, np->dcluster, &old, de);
+		np->dirty = 1;
+	}
+	if (fat_stamp(de, STAMP_MODIFY))
+		np->dirty = 1;
+ out_unlock:
+	uk_mutex_unlock(&fmp->lock);
+ out:
+	uk_mutex_unlock(&np->lock);
+	fatfs_buf_put(&fmp->cl_bufs, buf);
+	return error;
+}
 
-		file_pos += (off_t)nr_copy;
-		nr_read += nr_copy;
-		size -= nr_copy;
-		if (size <= 0)
-			break;
+/*
+ * Get the readdir position kept in the open file.
+ * The caller must hold the lock.
+ */
+static struct fatfs_dirpos *
+fatfs_dirpos(struct fatfsmount *fmp, struct vfscore_file *fp)
+{
+	struct fatfs_dirpos *pos;
+
+	pos = fp->f_data;
+	if (pos == NULL) {
+		pos = fatfs_pool_get(&fmp->pos_pool);
+		if (pos == NULL)
+			return NULL;
+		pos->index = -1;
+		pos->walk = NULL;
+		fp->f_data = pos;
+	}
+	if (pos->index != (int)fp->f_offset) {
+		/* seekdir() or rewinddir() was called */
+		pos->index = (int)fp->f_offset;
+		pos->sector = SEC_INVAL;
+		pos->seed = 0;
+	}
+	return pos;
+}
 
-		error = fat_next_cluster(fmp, cl, &cl);
-		if (error)
-			goto out;
+/*
+ * Fill dirent from fat node.
+ * The long name is returned if the entry has one.
+ */
+static void
+fatfs_fill_dirent(struct fatfs_node *np, char *lname, off_t off,
+		  struct dirent *dir)
+{
+	struct fat_dirent *de = &np->dirent;
 
-		buf = (void *)((char*)buf + nr_copy);
-		buf_pos = 0;
-	} while (!IS_EOFCL(fmp, cl));
+	if (*lname != '\0' && strlen(lname) < sizeof(dir->d_name))
+		strcpy(dir->d_name, lname);
+	else
+		fat_restore_name((char *)&de->name, dir->d_name);
 
-	uio->uio_resid -= (off_t)nr_read;
-	uio->uio_offset += (off_t)nr_read;
+	if (de->attr & FA_SUBDIR)
+		dir->d_type = DT_DIR;
+	else if (de->attr & FA_DEVICE)
+		dir->d_type = DT_BLK;
+	else
+		dir->d_type = DT_REG;
+
+	dir->d_fileno = off;
+}
 
-	iov->iov_base = buf;
-	iov->iov_len -= nr_read;
+static int
+fatfs_readdir(struct vnode *vp, struct vfscore_file *fp, struct dirent *dir)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node np;
+	struct fatfs_dirpos *pos;
+	char lname[NAME_MAX + 1];
+	int error;
 
+	fmp = vp->v_mount->m_data;
+	uk_mutex_lock(&fmp->lock);
+
+	/* The position of the last entry is kept in the open file */
+	pos = fatfs_dirpos(fmp, fp);
+	if (pos == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	error = fatfs_read_node(vp, pos, &np, lname);
+	if (error)
+		goto out;
+	fatfs_fill_dirent(&np, lname, fp->f_offset, dir);
+
+	fp->f_offset++;
 	error = 0;
  out:
 	uk_mutex_unlock(&fmp->lock);
 	return error;
 }
 
+/*
+ * Fill direntplus from fat node.
+ */
+static void
+fatfs_fill_direntplus(struct fatfs_node *np, char *lname, off_t off,
+		      struct fatfs_direntplus *ep)
+{
+	struct fat_dirent *de = &np->dirent;
+
+	fatfs_fill_dirent(np, lname, off, &ep->d);
+	fat_attr_to_mode(de->attr, &ep->mode);
+	ep->size = IS_DIR(de) ? 0 : de->size;
+	ep->mtime = fat_time_to_unix(de->date, de->time);
+	ep->cluster = de->cluster;
+	ep->attr = de->attr;
+	ep->date = de->date;
+	ep->time = de->time;
+}
+
+/*
+ * Read as many directory entries as fit in the buffer.
+ * The file system lock is taken once, and each directory sector
+ * is read once for all its entries.
+ *
+ * @vp: vnode of directory
+ * @fp: open file, keeping the readdir position
+ * @buf: array of struct dirent, or struct fatfs_direntplus if plus
+ * @count: number of entries in buf
+ * @nr: number of entries returned
+ * @plus: return attributes too
+ */
 static int
-fatfs_write(struct vnode *vp, struct uio *uio, int ioflag __unused)
+fatfs_getdents(struct vnode *vp, struct vfscore_file *fp, void *buf,
+	       size_t count, size_t *nr, int plus)
 {
 	struct fatfsmount *fmp;
-	struct fatfs_node *np;
-	struct fat_dirent *de;
-	struct iovec *iov;
-	size_t nr_copy, nr_write, buf_pos, i, cl_size;
-	int error;
-	__u32 file_pos, end_pos;
-	__u32 cl;
+	struct fatfs_node np;
+	struct fatfs_dirpos *pos;
+	char lname[NAME_MAX + 1];
+	int error = 0;
 
-	DPRINTF(("fatfs_write: vp=%p\n", vp));
+	if (vp->v_type != VDIR)
+		return ENOTDIR;
 
 	fmp = vp->v_mount->m_data;
-	np = vp->v_data;
+	uk_mutex_lock(&fmp->lock);
 
-	if (vp->v_type == VDIR)
-		return EISDIR;
-	if (vp->v_type != VREG)
-		return EINVAL;
-	if (uio->uio_offset < 0)
-		return EINVAL;
-	if (uio->uio_offset >= LONG_MAX)
-		return EFBIG;
-	if (uio->uio_resid == 0)
-		return 0;
+	*nr = 0;
+	pos = fatfs_dirpos(fmp, fp);
+	if (pos == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	while (*nr < count) {
+		error = fatfs_read_node(vp, pos, &np, lname);
+		if (plus)
+			fatfs_index_seed(fmp, pos, &np, lname, error);
+		if (error)
+			break;
+		if (plus)
+			fatfs_fill_direntplus(&np, lname, fp->f_offset,
+				(struct fatfs_direntplus *)buf + *nr);
+		else
+			fatfs_fill_dirent(&np, lname, fp->f_offset,
+				(struct dirent *)buf + *nr);
+		fp->f_offset++;
+		(*nr)++;
+	}
+	if (error == ENOENT)
+		error = 0;
+ out:
+	uk_mutex_unlock(&fmp->lock);
+	return error;
+}
+
+/*
+ * Number of clusters for a new file of the given size.
+ */
+static __u32
+fat_file_clusters(struct fatfsmount *fmp, off_t size)
+{
+
+	if (size == 0)
+		return 1;
+	return (__u32)((size + fmp->cluster_size - 1) / fmp->cluster_size);
+}
+
+/*
+ * Link the clusters of a new file.
+ *
+ * @fmp: fatfs mount point
+ * @cls: cluster#s of the file, each marked as end of chain
+ * @nr: number of clusters
+ */
+static int
+fat_link_clusters(struct fatfsmount *fmp, __u32 *cls, __u32 nr)
+{
+	__u32 i;
+	int error;
+
+	for (i = 0; i + 1 < nr; i++) {
+		error = fat_set_cluster(fmp, cls[i], cls[i + 1]);
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+/*
+ * Clear the data of the new files. Clusters which follow each other
+ * on the disk are cleared by one request, across files as well.
+ *
+ * @fmp: fatfs mount point
+ * @cp: files to create
+ * @cls: cluster#s of the files, in the order of the files
+ * @zero: cleared buffer of zero_nr clusters
+ * @zero_nr: max clusters cleared by one request
+ */
+static int
+fat_zero_clusters(struct fatfsmount *fmp, struct fatfs_create *cp,
+		  __u32 *cls, void *zero, __u32 zero_nr)
+{
+	struct fatfs_create_ent *ent;
+	__u32 k = 0, start = 0, run = 0, nr, i;
+	size_t n;
+
+	for (n = 0; n < cp->count; n++) {
+		ent = &cp->ents[n];
+		if (ent->error)
+			continue;
+		nr = fat_file_clusters(fmp, ent->size);
+		for (i = 0; ent->size > 0 && i < nr; i++) {
+			if (run > 0 && run < zero_nr &&
+			    cls[k + i] == start + run) {
+				run++;
+				continue;
+			}
+			if (run > 0 && fat_write_run(fmp, start, run, zero))
+				return EIO;
+			start = cls[k + i];
+			run = 1;
+		}
+		k += nr;
+	}
+	if (run > 0 && fat_write_run(fmp, start, run, zero))
+		return EIO;
+	return 0;
+}
 
-	if (ioflag & IO_APPEND)
-		uio->uio_offset = vp->v_size;
+/*
+ * Create many regular files in a directory. See FATFS_IOC_CREATE.
+ */
+static int
+fat_create_many(struct vnode *dvp, struct fatfs_create *cp)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_create_ent *ent;
+	struct fatfs_node np;
+	struct fat_dirent *de;
+	void *zero = NULL;
+	__u32 *cls = NULL, total = 0, zero_nr, k, nr, i;
+	size_t n;
+	int error = 0, error2;
 
-	/* find first non-empty iovec */
-	iov = uio->uio_iov;
-	while (!iov->iov_len) {
-		uio->uio_iov++;
-		uio->uio_iovcnt--;
-	}
+	fmp = dvp->v_mount->m_data;
+	cp->nr = 0;
 
 	uk_mutex_lock(&fmp->lock);
+	fatfs_batch_begin(fmp);
 
-	/* Check if file position exceeds the end of file. */
-	end_pos = vp->v_size;
-	file_pos = uio->uio_offset;
-	if (file_pos + iov->iov_len > end_pos) {
-
-		/* Expand the file size before writing to it */
-		end_pos = file_pos + iov->iov_len;
-		cl = np->dirent.cluster;
-		error = fat_expand_file(fmp, &cl, end_pos);
-		if (error) {
-			error = EIO;
+	/*
+	 * Check the names and count the clusters of all the files. A
+	 * name in use fails here, before any data is written for it.
+	 */
+	for (n = 0; n < cp->count; n++) {
+		ent = &cp->ents[n];
+		ent->error = 0;
+		if (ent->size < 0)
+			ent->error = EINVAL;
+		else if (ent->size > (off_t)0xffffffff)
+			ent->error = EFBIG;
+		else if (!fat_valid_name((char *)ent->name) &&
+			 !fat_valid_lname((char *)ent->name))
+			ent->error = EINVAL;
+		else {
+			error = fatfs_lookup_node(dvp, (char *)ent->name, &np);
+			if (error == 0)
+				ent->error = EEXIST;
+			else if (error != ENOENT)
+				ent->error = error;
+			error = 0;
+		}
+		if (ent->error)
+			continue;
+		total += fat_file_clusters(fmp, ent->size);
+		if (total > fmp->last_cluster) {
+			error = ENOSPC;
 			goto out;
 		}
-		np->dirent.cluster = cl;
+	}
+	if (total == 0)
+		goto out;
 
-		/* Update directory entry */
-		de = &np->dirent;
-		de->size = end_pos;
-		error = fatfs_put_node(fmp, np);
-		if (error)
-			goto out;
-		vp->v_size = (off_t)end_pos;
+	cls = malloc(total * sizeof(__u32));
+	if (cls == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	/* Data of the files are cleared from this buffer */
+	zero_nr = MIN(total, MAX(ZERO_MAX / fmp->cluster_size, 1U));
+	if (posix_memalign(&zero, MAX(uk_blkdev_ioalign(fmp->dev),
+				      sizeof(void *)),
+			   (size_t)zero_nr * fmp->cluster_size)) {
+		zero = NULL;
+		error = ENOMEM;
+		goto out;
 	}
+	memset(zero, 0, (size_t)zero_nr * fmp->cluster_size);
 
-	/* Seek to the cluster for the file offset */
-	error = fat_seek_cluster(fmp, np->dirent.cluster, file_pos, &cl);
+	error = fat_alloc_clusters(fmp, total, cls);
 	if (error)
 		goto out;
+	error = fat_zero_clusters(fmp, cp, cls, zero, zero_nr);
+	if (error) {
+		for (i = 0; i < total; i++)
+			fat_set_cluster(fmp, cls[i], CL_FREE);
+		goto out;
+	}
 
-	buf_pos = file_pos % fmp->cluster_size;
-	cl_size = iov->iov_len / fmp->cluster_size + 1;
-	nr_write = 0;
-	i = 0;
-	do {
-		/* First and last cluster must be read before write */
-		if (i == 0 || i == cl_size) {
-			if (fat_read_cluster(fmp, cl)) {
-				error = EIO;
-				goto out;
-			}
-		}
-		nr_copy = fmp->cluster_size;
-		if (buf_pos > 0)
-			nr_copy -= buf_pos;
-		if (buf_pos + iov->iov_len < fmp->cluster_size)
-			nr_copy = iov->iov_len;
-		memcpy(fmp->io_buf + buf_pos, iov->iov_base, nr_copy);
-
-		if (fat_write_cluster(fmp, cl)) {
-			error = EIO;
-			goto out;
-		}
-		file_pos += nr_copy;
-		nr_write += nr_copy;
-		iov->iov_len -= nr_copy;
-		if (iov->iov_len <= 0)
-			break;
-
-		error = fat_next_cluster(fmp, cl, &cl);
-		if (error)
-			goto out;
-
-		iov->iov_base = (void *)((char*)iov->iov_base + nr_copy);
-		buf_pos = 0;
-		i++;
-	} while (!IS_EOFCL(fmp, cl));
-
-	uio->uio_resid -= (off_t)nr_write;
-	uio->uio_offset += (off_t)nr_write;
-
-	/*
-	 * XXX: Todo!
-	 *    de.time = ?
-	 *    de.date = ?
-	 *    if (dirent_set(fp, &de))
-	 *        return EIO;
-	 */
-	error = 0;
+	k = 0;
+	for (n = 0; n < cp->count; n++) {
+		ent = &cp->ents[n];
+		if (ent->error)
+			continue;
+		nr = fat_file_clusters(fmp, ent->size);
+
+		de = &np.dirent;
+		memset(de, 0, sizeof(struct fat_dirent));
+		de->cluster = cls[k];
+		de->size = (__u32)ent->size;
+		fat_stamp(de, STAMP_CREATE | STAMP_MODIFY | STAMP_ACCESS);
+		fat_mode_to_attr(S_IFREG | cp->mode, &de->attr);
+
+		ent->error = fat_link_clusters(fmp, cls + k, nr);
+		if (!ent->error)
+			ent->error = fatfs_add_name(dvp, &np, (char *)ent->name);
+		if (ent->error) {
+			for (i = 0; i < nr; i++)
+				fat_set_cluster(fmp, cls[k + i], CL_FREE);
+		} else
+			cp->nr++;
+		k += nr;
+	}
  out:
+	error2 = fatfs_batch_end(fmp);
 	uk_mutex_unlock(&fmp->lock);
-	return error;
+	free(zero);
+	free(cls);
+	return error ? error : error2;
 }
 
 static int
-fatfs_readdir(struct vnode *vp, struct vfscore_file *fp, struct dirent *dir)
+fatfs_ioctl(struct vnode *vp, struct vfscore_file *fp, unsigned long com,
+	    void *data)
 {
+	struct fatfs_getdents *gd;
+	struct fatfs_readdirplus *rp;
+	struct fatfs_lookup *lp;
+	struct fatfs_rmtree *rt;
+	struct fatfs_openhandle *oh;
+	struct fatfs_dirpos *pos;
 	struct fatfsmount *fmp;
 	struct fatfs_node np;
-	struct fat_dirent *de;
+	const char *name;
 	int error;
 
-	fmp = vp->v_mount->m_data;
-	uk_mutex_lock(&fmp->lock);
-
-	error = fatfs_get_node(vp, (int)fp->f_offset, &np);
-	if (error)
-		goto out;
-	de = &np.dirent;
-	fat_restore_name((char *)&de->name, dir->d_name);
-
-	if (de->attr & FA_SUBDIR)
-		dir->d_type = DT_DIR;
-	else if (de->attr & FA_DEVICE)
-		dir->d_type = DT_BLK;
-	else
-		dir->d_type = DT_REG;
-
-	dir->d_fileno = fp->f_offset;
-
-	fp->f_offset++;
-	error = 0;
- out:
-	uk_mutex_unlock(&fmp->lock);
-	return error;
+	switch (com) {
+	case FATFS_IOC_GETDENTS:
+		gd = data;
+		return fatfs_getdents(vp, fp, gd->buf, gd->count, &gd->nr, 0);
+	case FATFS_IOC_READDIRPLUS:
+		rp = data;
+		return fatfs_getdents(vp, fp, rp->buf, rp->count, &rp->nr, 1);
+	case FATFS_IOC_COMPACT:
+		if (vp->v_type != VDIR)
+			return ENOTDIR;
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		error = fatfs_compact_node(vp);
+		uk_mutex_unlock(&fmp->lock);
+		return error;
+	case FATFS_IOC_LOOKUP:
+		if (vp->v_type != VDIR)
+			return ENOTDIR;
+		lp = data;
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		error = fatfs_path_lookup(vp, lp->path, &np);
+		uk_mutex_unlock(&fmp->lock);
+		if (error)
+			return error;
+		name = strrchr(lp->path, '/');
+		name = name ? name + 1 : lp->path;
+		if (strlen(name) >= sizeof(lp->ent.d.d_name))
+			return ENAMETOOLONG;
+		fatfs_fill_direntplus(&np, (char *)name, fatfs_node_ino(&np),
+				      &lp->ent);
+		return 0;
+	case FATFS_IOC_CREATE:
+		if (vp->v_type != VDIR)
+			return ENOTDIR;
+		return fat_create_many(vp, data);
+	case FATFS_IOC_SCAN:
+		if (vp->v_type != VDIR)
+			return ENOTDIR;
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		pos = fatfs_dirpos(fmp, fp);
+		if (pos == NULL)
+			error = ENOMEM;
+		else
+			error = fatfs_scan(vp, pos, data);
+		uk_mutex_unlock(&fmp->lock);
+		return error;
+	case FATFS_IOC_GETHANDLE:
+		if (vp == vp->v_mount->m_root->d_vnode)
+			return EINVAL;	/* no directory entry */
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		np = *(struct fatfs_node *)vp->v_data;
+		uk_mutex_unlock(&fmp->lock);
+		if (NODE_REMOVED(&np))
+			return ENOENT;
+		fatfs_handle_make(&np, data);
+		return 0;
+	case FATFS_IOC_OPENHANDLE:
+		oh = data;
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		error = fatfs_handle_lookup(vp, &oh->handle, &np);
+		if (!error)
+			error = fat_get_vnode(vp->v_mount, &np, &oh->vp);
+		uk_mutex_unlock(&fmp->lock);
+		return error;
+	case FATFS_IOC_USAGE:
+		if (vp->v_type != VDIR)
+			return ENOTDIR;
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		error = fatfs_usage_get(vp, data);
+		uk_mutex_unlock(&fmp->lock);
+		return error;
+	case FATFS_IOC_RMTREE:
+		if (vp->v_type != VDIR)
+			return ENOTDIR;
+		rt = data;
+		fmp = vp->v_mount->m_data;
+		uk_mutex_lock(&fmp->lock);
+		error = fatfs_rmtree(vp, (char *)rt->name, &rt->nr);
+		uk_mutex_unlock(&fmp->lock);
+		return error;
+	default:
+		return EINVAL;
+	}
 }
 
 /*
@@ -450,39 +1271,77 @@ fatfs_create(struct vnode *dvp, char *name, mode_t mode)
 	if (!S_ISREG(mode))
 		return EINVAL;
 
-	if (!fat_valid_name(name))
+	if (!fat_valid_name(name) && !fat_valid_lname(name))
 		return EINVAL;
 
 	fmp = dvp->v_mount->m_data;
 	uk_mutex_lock(&fmp->lock);
 
 	/* Allocate free cluster for new file. */
-	error = fat_alloc_cluster(fmp, 0, &cl);
+	error = fat_new_cluster(fmp, &cl);
 	if (error)
 		goto out;
 
 	de = &np.dirent;
 	memset(de, 0, sizeof(struct fat_dirent));
-	fat_convert_name(name, (char *)de->name);
 	de->cluster = cl;
-	de->time = TEMP_TIME;
-	de->date = TEMP_DATE;
+	fat_stamp(de, STAMP_CREATE | STAMP_MODIFY | STAMP_ACCESS);
 	fat_mode_to_attr(mode, &de->attr);
-	error = fatfs_add_node(dvp, &np);
+	error = fatfs_add_name(dvp, &np, name);
 	if (error)
-		goto out;
-	error = fat_set_cluster(fmp, cl, fmp->fat_eof);
+		fat_set_cluster(fmp, cl, CL_FREE);
  out:
 	uk_mutex_unlock(&fmp->lock);
 	return error;
 }
 
+/*
+ * Remove file entry. The caller must hold the lock.
+ */
+static int
+fat_remove(struct vnode *dvp, char *name)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node np, *vnp;
+	struct fat_dirent *de, old;
+	int error;
+
+	fmp = dvp->v_mount->m_data;
+
+	error = fatfs_lookup_node(dvp, name, &np);
+	if (error)
+		return error;
+	de = &np.dirent;
+	if (IS_DIR(de))
+		return EISDIR;
+	if (!IS_FILE(de))
+		return EPERM;
+
+	/* remove directory */
+	vnp = fat_find_vnode(fmp, &np);
+	old = *de;
+	de->name[0] = 0xe5;
+	error = fatfs_put_node(fmp, &np);
+	if (error)
+		return error;
+
+	/* Pending updates of the file are not written any more */
+	if (vnp != NULL)
+		fatfs_drop_node(fmp, vnp, &old);
+	if (np.lfn.nr > 0) {
+		error = fatfs_del_lfn(fmp, &np);
+		if (error)
+			return error;
+	}
+
+	/* Readers and writers of the file stop using its clusters */
+	return fatfs_remove_chain(fmp, &np);
+}
+
 static int
 fatfs_remove(struct vnode *dvp, struct vnode *vp __unused, char *name)
 {
 	struct fatfsmount *fmp;
-	struct fatfs_node np;
-	struct fat_dirent *de;
 	int error;
 
 	if (*name == '\0')
@@ -491,125 +1350,235 @@ fatfs_remove(struct vnode *dvp, struct vnode *vp __unused, char *name)
 	fmp = dvp->v_mount->m_data;
 	uk_mutex_lock(&fmp->lock);
 
+	error = fat_remove(dvp, name);
+
+	uk_mutex_unlock(&fmp->lock);
+	return error;
+}
+
+/*
+ * Remove directory entry. The caller must hold the lock.
+ */
+static int
+fat_rmdir(struct vnode *dvp, char *name)
+{
+	struct fatfsmount *fmp;
+	struct fatfs_node np, *vnp;
+	struct fat_dirent *de, old;
+	int error;
+
+	fmp = dvp->v_mount->m_data;
+
 	error = fatfs_lookup_node(dvp, name, &np);
 	if (error)
-		goto out;
+		return error;
+
 	de = &np.dirent;
-	if (IS_DIR(de)) {
-		error = EISDIR;
-		goto out;
-	}
-	if (!IS_FILE(de)) {
-		error = EPERM;
-		goto out;
+	if (!IS_DIR(de))
+		return ENOTDIR;
+
+	/* remove directory */
+	vnp = fat_find_vnode(fmp, &np);
+	old = *de;
+	de->name[0] = 0xe5;
+	error = fatfs_put_node(fmp, &np);
+	if (error)
+		return error;
+
+	/* Pending updates of the directory are not written any more */
+	if (vnp != NULL)
+		fatfs_drop_node(fmp, vnp, &old);
+	if (np.lfn.nr > 0) {
+		error = fatfs_del_lfn(fmp, &np);
+		if (error)
+			return error;
 	}
 
+	/* The vnodes of the directory do not reach it any more */
+	fatfs_nodes_gone(fmp, &np);
+
 	/* Remove clusters */
 	error = fat_free_clusters(fmp, de->cluster);
 	if (error)
-		goto out;
+		return error;
+	fatfs_dir_release(fmp, de->cluster);
+	return 0;
+}
 
-	/* remove directory */
-	de->name[0] = 0xe5;
-	error = fatfs_put_node(fmp, &np);
- out:
-	uk_mutex_unlock(&fmp->lock);
+/*
+ * Delete the directory entry of a renamed file, with its long name.
+ */
+static int
+fat_rename_del(struct fatfsmount *fmp, struct fatfs_node *np)
+{
+	int error;
+
+	np->dirent.name[0] = SLOT_DELETED;
+	error = fatfs_put_node(fmp, np);
+	if (error)
+		return error;
+	if (np->lfn.nr > 0)
+		error = fatfs_del_lfn(fmp, np);
+	return error;
+}
+
+/*
+ * Give an entry a new short name in place, dropping its long name.
+ * The short name is written first, so a failure never loses the
+ * entry.
+ *
+ * @fmp: fat mount data
+ * @np: fat node of the entry
+ * @name: new name, valid in 8.3 format
+ */
+static int
+fat_rename_short(struct fatfsmount *fmp, struct fatfs_node *np, char *name)
+{
+	struct fatfs_node old;
+	int error;
+
+	old = *np;
+	fat_convert_name(name, (char *)np->dirent.name);
+	np->lfn.nr = 0;
+	error = fatfs_put_node(fmp, np);
+	if (error || old.lfn.nr == 0)
+		return error;
+
+	error = fatfs_del_lfn(fmp, &old);
+	fatfs_dir_del_lname(fmp, np);
 	return error;
 }
 
 static int
 fatfs_rename(struct vnode *dvp1, struct vnode *vp1, char *name1,
-	     struct vnode *dvp2, struct vnode *vp2, char *name2)
+	     struct vnode *dvp2, struct vnode *vp2 __unused, char *name2)
 {
 	struct fatfsmount *fmp;
-	struct fatfs_node np1;
+	struct fatfs_node np1, np2, old;
 	struct fat_dirent *de1, *de2;
-	int error;
+	char *buf = NULL;
+	int same, error;
+
+	if (!fat_valid_name(name2) && !fat_valid_lname(name2))
+		return EINVAL;
 
 	fmp = dvp1->v_mount->m_data;
 	uk_mutex_lock(&fmp->lock);
 
+	/* The entry is copied from disk, with the size kept in memory */
+	error = fatfs_sync_node(fmp, vp1->v_data);
+	if (error)
+		goto out;
+
 	error = fatfs_lookup_node(dvp1, name1, &np1);
 	if (error)
 		goto out;
 	de1 = &np1.dirent;
 
+	/* The new name may only differ in case from the old one */
+	same = (fatfs_lookup_node(dvp2, name2, &np2) == 0 &&
+		np2.dcluster == np1.dcluster && np2.sector == np1.sector &&
+		np2.offset == np1.offset);
+
 	if (IS_FILE(de1)) {
 		/* Remove destination file, first */
-		error = fatfs_remove(dvp2, vp1, name2);
-		if (error == EIO)
-			goto out;
-
-		/* Change file name of directory entry */
-		fat_convert_name(name2, (char *)de1->name);
+		if (!same) {
+			error = fat_remove(dvp2, name2);
+			if (error == EIO)
+				goto out;
+		}
 
-		/* Same directory ? */
-		if (dvp1 == dvp2) {
-			/* Change the name of existing file */
-			error = fatfs_put_node(fmp, &np1);
+		old = np1;
+		if (fat_valid_name(name2) &&
+		    (same || (dvp1 == dvp2 && np1.lfn.nr == 0))) {
+			error = fat_rename_short(fmp, &np1, name2);
 			if (error)
 				goto out;
 		} else {
-			/* Create new directory entry */
-			error = fatfs_add_node(dvp2, &np1);
+			/*
+			 * Create new directory entry before the source one
+			 * goes, so that a failure leaves the old name.
+			 */
+			if (same)
+				error = fatfs_add_long(dvp2, &np1, name2, &old);
+			else
+				error = fatfs_add_name(dvp2, &np1, name2);
 			if (error)
 				goto out;
 
-			/* Remove souce file */
-			error = fatfs_remove(dvp1, vp2, name1);
+			/* Remove souce entry, its clusters now belong to the new one */
+			error = fat_rename_del(fmp, &old);
 			if (error)
 				goto out;
 		}
 	} else {
 
 		/* remove destination directory */
-		error = fatfs_rmdir(dvp2, NULL, name2);
-		if (error == EIO)
-			goto out;
-
-		/* Change file name of directory entry */
-		fat_convert_name(name2, (char *)de1->name);
+		if (!same) {
+			error = fat_rmdir(dvp2, name2);
+			if (error == EIO)
+				goto out;
+		}
 
-		/* Same directory ? */
-		if (dvp1 == dvp2) {
-			/* Change the name of existing directory */
-			error = fatfs_put_node(fmp, &np1);
+		old = np1;
+		if (fat_valid_name(name2) &&
+		    (same || (dvp1 == dvp2 && np1.lfn.nr == 0))) {
+			error = fat_rename_short(fmp, &np1, name2);
 			if (error)
 				goto out;
 		} else {
-			/* Create new directory entry */
-			error = fatfs_add_node(dvp2, &np1);
+			/*
+			 * Create new directory entry before the source one
+			 * goes, so that a failure leaves the old name.
+			 */
+			if (dvp1 != dvp2)	/* before the usage is added */
+				fatfs_usage_move(fmp, de1->cluster,
+					((struct fatfs_node *)dvp2->v_data)->dirent.cluster);
+			if (same)
+				error = fatfs_add_long(dvp2, &np1, name2, &old);
+			else
+				error = fatfs_add_name(dvp2, &np1, name2);
 			if (error)
 				goto out;
 
-			/* Update "." and ".." for renamed directory */
-			if (fat_read_cluster(fmp, de1->cluster)) {
-				error = EIO;
-				goto out;
-			}
-
-			de2 = (struct fat_dirent *)fmp->io_buf;
-			de2->cluster = de1->cluster;
-			de2->time = TEMP_TIME;
-			de2->date = TEMP_DATE;
-			de2++;
-			de2->cluster = ((struct fatfs_node *)dvp2->v_data)->dirent.cluster;
-			de2->time = TEMP_TIME;
-			de2->date = TEMP_DATE;
-
-			if (fat_write_cluster(fmp, de1->cluster)) {
-				error = EIO;
-				goto out;
+			if (dvp1 != dvp2) {
+				/* Update "." and ".." for renamed directory */
+				buf = fatfs_buf_get(&fmp->cl_bufs);
+				if (buf == NULL) {
+					error = ENOMEM;
+					goto out;
+				}
+				if (fat_read_run(fmp, de1->cluster, 1, buf)) {
+					error = EIO;
+					goto out;
+				}
+
+				de2 = (struct fat_dirent *)buf;
+				de2->cluster = de1->cluster;
+				fat_stamp(de2, STAMP_MODIFY);
+				de2++;
+				de2->cluster = ((struct fatfs_node *)dvp2->v_data)->dirent.cluster;
+				fat_stamp(de2, STAMP_MODIFY);
+
+				if (fat_write_run(fmp, de1->cluster, 1, buf)) {
+					error = EIO;
+					goto out;
+				}
+				/* ".." has changed on disk */
+				fatfs_dir_drop(fmp, de1->cluster);
 			}
 
-			/* Remove souce directory */
-			error = fatfs_rmdir(dvp1, NULL, name1);
+			/* Remove souce entry, keeping the directory clusters */
+			error = fat_rename_del(fmp, &old);
 			if (error)
 				goto out;
 		}
 	}
+	/* Open vnodes of the entry follow it */
+	fatfs_node_moved(fmp, &old, &np1);
  out:
 	uk_mutex_unlock(&fmp->lock);
+	fatfs_buf_put(&fmp->cl_bufs, buf);
 	return error;
 }
 
@@ -619,58 +1588,57 @@ fatfs_mkdir(struct vnode *dvp, char *name, mode_t mode)
 	struct fatfsmount *fmp;
 	struct fatfs_node np;
 	struct fat_dirent *de;
+	char *buf;
 	__u32 cl;
 	int error;
 
 	if (!S_ISDIR(mode))
 		return EINVAL;
 
-	if (!fat_valid_name(name))
+	if (!fat_valid_name(name) && !fat_valid_lname(name))
 		return ENOTDIR;
 
 	fmp = dvp->v_mount->m_data;
+	buf = fatfs_buf_get(&fmp->cl_bufs);
+	if (buf == NULL)
+		return ENOMEM;
 	uk_mutex_lock(&fmp->lock);
 
 	/* Allocate free cluster for directory data */
-	error = fat_alloc_cluster(fmp, 0, &cl);
+	error = fat_new_cluster(fmp, &cl);
 	if (error)
 		goto out;
 
 	memset(&np, 0, sizeof(struct fatfs_node));
 	de = &np.dirent;
-	fat_convert_name(name, (char *)&de->name);
 	de->cluster = cl;
-	de->time = TEMP_TIME;
-	de->date = TEMP_DATE;
+	fat_stamp(de, STAMP_CREATE | STAMP_MODIFY | STAMP_ACCESS);
 	fat_mode_to_attr(mode, &de->attr);
-	error = fatfs_add_node(dvp, &np);
-	if (error)
+	error = fatfs_add_name(dvp, &np, name);
+	if (error) {
+		fat_set_cluster(fmp, cl, CL_FREE);
 		goto out;
+	}
 
 	/* Initialize "." and ".." for new directory */
-	memset(fmp->io_buf, 0, fmp->cluster_size);
+	memset(buf, 0, fmp->cluster_size);
 
-	de = (struct fat_dirent *)fmp->io_buf;
+	de = (struct fat_dirent *)buf;
 	memcpy(de->name, ".          ", 11);
 	de->attr = FA_SUBDIR;
 	de->cluster = cl;
-	de->time = TEMP_TIME;
-	de->date = TEMP_DATE;
+	fat_stamp(de, STAMP_CREATE | STAMP_MODIFY | STAMP_ACCESS);
 	de++;
 	memcpy(de->name, "..         ", 11);
 	de->attr = FA_SUBDIR;
 	de->cluster = ((struct fatfs_node *)dvp->v_data)->dirent.cluster;
-	de->time = TEMP_TIME;
-	de->date = TEMP_DATE;
+	fat_stamp(de, STAMP_CREATE | STAMP_MODIFY | STAMP_ACCESS);
 
-	if (fat_write_cluster(fmp, cl)) {
+	if (fat_write_run(fmp, cl, 1, buf))
 		error = EIO;
-		goto out;
-	}
-	/* Add eof */
-	error = fat_set_cluster(fmp, cl, fmp->fat_eof);
  out:
 	uk_mutex_unlock(&fmp->lock);
+	fatfs_buf_put(&fmp->cl_bufs, buf);
 	return error;
 }
 
@@ -681,8 +1649,6 @@ static int
 fatfs_rmdir(struct vnode *dvp, struct vnode *vp __unused, char *name)
 {
 	struct fatfsmount *fmp;
-	struct fatfs_node np;
-	struct fat_dirent *de;
 	int error;
 
 	if (*name == '\0')
@@ -691,26 +1657,8 @@ fatfs_rmdir(struct vnode *dvp, struct vnode *vp __unused, char *name)
 	fmp = dvp->v_mount->m_data;
 	uk_mutex_lock(&fmp->lock);
 
-	error = fatfs_lookup_node(dvp, name, &np);
-	if (error)
-		goto out;
-
-	de = &np.dirent;
-	if (!IS_DIR(de)) {
-		error = ENOTDIR;
-		goto out;
-	}
-
-	/* Remove clusters */
-	error = fat_free_clusters(fmp, de->cluster);
-	if (error)
-		goto out;
-
-	/* remove directory */
-	de->name[0] = 0xe5;
+	error = fat_rmdir(dvp, name);
 
-	error = fatfs_put_node(fmp, &np);
- out:
 	uk_mutex_unlock(&fmp->lock);
 	return error;
 }
@@ -718,10 +1666,21 @@ fatfs_rmdir(struct vnode *dvp, struct vnode *vp __unused, char *name)
 static int
 fatfs_getattr(struct vnode *vp, struct vattr *vap)
 {
+	struct fat_dirent *de;
+
 	vap->va_type = vp->v_type;
 	vap->va_mode = vp->v_mode;
 	vap->va_nodeid = vp->v_ino;
 	vap->va_size = vp->v_size;
+
+	/* Times kept in memory are newer than the ones on disk */
+	de = &((struct fatfs_node *)vp->v_data)->dirent;
+	vap->va_mtime.tv_sec = fat_time_to_unix(de->date, de->time);
+	vap->va_mtime.tv_nsec = 0;
+	vap->va_ctime = vap->va_mtime;
+	vap->va_atime.tv_sec = de->adate != 0 ?
+		fat_time_to_unix(de->adate, 0) : vap->va_mtime.tv_sec;
+	vap->va_atime.tv_nsec = 0;
 	return 0;
 }
 
@@ -736,8 +1695,19 @@ fatfs_setattr(struct vnode *vp __unused, struct vattr *vap __unused)
 static int
 fatfs_inactive(struct vnode *vp)
 {
+	struct fatfsmount *fmp;
+
+	/*
+	 * The last chance to write the size and times kept in memory,
+	 * or to free the clusters of a removed file.
+	 */
+	fmp = vp->v_mount->m_data;
+	uk_mutex_lock(&fmp->lock);
+	fatfs_free_orphan(fmp, vp->v_data);
+	fatfs_sync_node(fmp, vp->v_data);
+	uk_mutex_unlock(&fmp->lock);
 
-	free(vp->v_data);
+	fatfs_node_free(fmp, vp->v_data);
 	return 0;
 }
 
@@ -747,14 +1717,30 @@ fatfs_truncate(struct vnode *vp, off_t length)
 	struct fatfsmount *fmp;
 	struct fatfs_node *np;
 	struct fat_dirent *de;
+	char *buf = NULL;
 	int error;
 	__u32 cl;
 
 	fmp = vp->v_mount->m_data;
+	np = vp->v_data;
+	uk_mutex_lock(&np->lock);
 	uk_mutex_lock(&fmp->lock);
 
-	np = vp->v_data;
 	de = &np->dirent;
+	if (NODE_REMOVED(np)) {
+		error = ENOENT;
+		goto out;
+	}
+
+	/* The entry is written below, with the pending updates */
+	error = fatfs_sync_node(fmp, np);
+	if (error)
+		goto out;
+
+	/* Readers without lock stop using the chain before it changes */
+	fatfs_node_write_begin(np);
+	np->nr_ext = 0;
+	fatfs_node_write_end(np);
 
 	if (length == 0) {
 		/* Remove clusters */
@@ -769,16 +1755,49 @@ fatfs_truncate(struct vnode *vp, off_t length)
 			error = EIO;
 			goto out;
 		}
-		de->cluster = cl;
+		if (de->cluster != cl) {
+			/* The first cluster is written at once, as in write */
+			fatfs_node_write_begin(np);
+			de->cluster = cl;
+			fatfs_node_write_end(np);
+			error = fatfs_put_node(fmp, np);
+			if (error)
+				goto out;
+		}
+		uk_mutex_unlock(&fmp->lock);
+
+		/*
+		 * The file grows with zeros. Only the file data lock is
+		 * held over the I/O, readers see the old size until then.
+		 */
+		buf = fatfs_buf_get(&fmp->cl_bufs);
+		if (buf == NULL)
+			error = ENOMEM;
+		else
+			error = fat_write_hole(fmp, cl, vp->v_size, length,
+					       buf);
+
+		uk_mutex_lock(&fmp->lock);
+		if (error)
+			goto out;
+		if (NODE_REMOVED(np)) {
+			error = ENOENT;
+			goto out;
+		}
 	}
 
 	/* Update directory entry */
 	de->size = length;
+	fat_stamp(de, STAMP_MODIFY);
 	error = fatfs_put_node(fmp, np);
 	if (error)
 		goto out;
+	fatfs_node_write_begin(np);
 	vp->v_size = length;
+	fatfs_node_write_end(np);
  out:
 	uk_mutex_unlock(&fmp->lock);
+	uk_mutex_unlock(&np->lock);
+	fatfs_buf_put(&fmp->cl_bufs, buf);
 	return error;
 }
@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#ifndef _FATFS_IOCTL_H
+#define _FATFS_IOCTL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+#include <dirent.h>
+
+/*
+ * ioctl commands of fatfs
+ */
+#define FATFS_IOC_GETDENTS	0x46410001	/* read many directory entries */
+#define FATFS_IOC_READDIRPLUS	0x46410002	/* read entries with attributes */
+#define FATFS_IOC_COMPACT	0x46410003	/* compact directory, no argument */
+#define FATFS_IOC_LOOKUP	0x46410004	/* find entry of a path */
+#define FATFS_IOC_CREATE	0x46410005	/* create many files */
+#define FATFS_IOC_RMTREE	0x46410006	/* remove entry and subtree */
+#define FATFS_IOC_SCAN		0x46410007	/* list entries of subtree */
+#define FATFS_IOC_GETHANDLE	0x46410008	/* get handle of the file */
+#define FATFS_IOC_OPENHANDLE	0x46410009	/* get vnode of a handle */
+#define FATFS_IOC_USAGE		0x4641000a	/* usage of a subtree */
+
+struct vnode;
+
+/*
+ * Argument of FATFS_IOC_GETDENTS
+ *
+ * Entries are returned from the current directory position, which is
+ * shared with readdir(). nr is 0 at the end of the directory.
+ */
+struct fatfs_getdents {
+	struct dirent	*buf;		/* buffer for entries */
+	size_t		count;		/* number of entries in buffer */
+	size_t		nr;		/* number of entries returned */
+};
+
+/*
+ * Directory entry with the attributes stored in the FAT entry
+ */
+struct fatfs_direntplus {
+	struct dirent	d;		/* name, type and file# */
+	mode_t		mode;		/* file mode */
+	off_t		size;		/* file size in bytes */
+	time_t		mtime;		/* last modification time */
+	unsigned int	cluster;	/* first cluster# */
+	unsigned char	attr;		/* FAT attribute */
+	unsigned short	date;		/* FAT modification date */
+	unsigned short	time;		/* FAT modification time */
+};
+
+/*
+ * Argument of FATFS_IOC_READDIRPLUS
+ *
+ * Works like FATFS_IOC_GETDENTS. A listing that starts at the first
+ * entry and runs to the end also builds the in-memory name index of
+ * the directory, so following lookups of the listed names need no I/O.
+ */
+struct fatfs_readdirplus {
+	struct fatfs_direntplus *buf;	/* buffer for entries */
+	size_t		count;		/* number of entries in buffer */
+	size_t		nr;		/* number of entries returned */
+};
+
+/*
+ * Argument of FATFS_IOC_LOOKUP
+ *
+ * The path is resolved from the directory of the ioctl. It must not
+ * have "." or ".." components, nor end with '/'. The name returned in
+ * ent is the last component of the path, d_fileno is the inode number.
+ */
+struct fatfs_lookup {
+	const char	*path;		/* path from the directory */
+	struct fatfs_direntplus ent;	/* entry found */
+};
+
+/*
+ * File to create with FATFS_IOC_CREATE
+ */
+struct fatfs_create_ent {
+	const char	*name;		/* name in the directory */
+	off_t		size;		/* size in bytes, the data is zero */
+	int		error;		/* 0, or errno of this file */
+};
+
+/*
+ * Argument of FATFS_IOC_CREATE
+ *
+ * Regular files are created in the directory of the ioctl. The
+ * clusters of all the files are allocated in one pass of the FAT and
+ * the new entries fill the directory sectors in order. The writes of
+ * FAT and directory sectors are deferred, so that a sector shared by
+ * many files is written once. A file that can not be created gets its
+ * error set and the other files are still created.
+ */
+struct fatfs_create {
+	struct fatfs_create_ent *ents;	/* files to create */
+	size_t		count;		/* number of files */
+	mode_t		mode;		/* permission of the files */
+	size_t		nr;		/* number of files created */
+};
+
+/*
+ * Argument of FATFS_IOC_RMTREE
+ *
+ * The named entry of the directory is removed with everything below
+ * it. Each directory of the subtree is read once and all clusters are
+ * freed in one pass of the FAT. Files of the subtree still open fail
+ * with ENOENT afterwards.
+ */
+struct fatfs_rmtree {
+	const char	*name;		/* entry in the directory */
+	size_t		nr;		/* number of entries removed */
+};
+
+/*
+ * Record returned by FATFS_IOC_SCAN
+ */
+struct fatfs_scanent {
+	unsigned short	reclen;		/* bytes to the next record */
+	unsigned short	pathlen;	/* length of path */
+	mode_t		mode;		/* file mode */
+	off_t		size;		/* file size in bytes */
+	time_t		mtime;		/* last modification time */
+	unsigned int	cluster;	/* first cluster# */
+	unsigned char	attr;		/* FAT attribute */
+	unsigned short	date;		/* FAT modification date */
+	unsigned short	time;		/* FAT modification time */
+	char		path[];		/* path from the directory */
+};
+
+#define FATFS_SCAN_RESTART	0x0001	/* start again from the top */
+
+/*
+ * Argument of FATFS_IOC_SCAN
+ *
+ * Records of all the entries below the directory of the ioctl are
+ * filled in the buffer, as many as fit. The scan continues where the
+ * last call stopped, its state is kept in the open file. len is 0 at
+ * the end of the subtree.
+ *
+ * Directories are read in the order of their clusters on the disk,
+ * so a scan sweeps the volume instead of seeking back and forth.
+ * Entries changed between calls may be missed. Entries with a path
+ * longer than PATH_MAX are left out with their subtree.
+ */
+struct fatfs_scan {
+	void		*buf;		/* buffer for records */
+	size_t		size;		/* size of buffer in bytes */
+	int		flags;		/* FATFS_SCAN_* */
+	size_t		len;		/* bytes of records returned */
+	size_t		nr;		/* number of records returned */
+};
+
+/*
+ * Persistent handle of a file or directory, from FATFS_IOC_GETHANDLE
+ *
+ * The handle stays valid across mounts while the entry exists. The
+ * entry is found at its slot, or by its first cluster in the same
+ * directory after a rename or a compaction moved it. An entry without
+ * clusters is found at its slot only. The entry is checked with its
+ * creation time, and its short name if it has no creation time.
+ */
+struct fatfs_handle {
+	unsigned int	dcluster;	/* cluster# of the directory */
+	unsigned int	sector;		/* sector# of the entry */
+	unsigned int	slot;		/* slot of the entry in sector */
+	unsigned int	cluster;	/* first cluster# */
+	unsigned int	gen;		/* check of the creation time */
+};
+
+/*
+ * Argument of FATFS_IOC_OPENHANDLE
+ *
+ * The ioctl may be issued on any file of the mount. The directory
+ * sector of the handle is read and checked, and the vnode is returned
+ * with a reference, as by a lookup, with no path walk. ESTALE is
+ * returned if the entry is gone.
+ */
+struct fatfs_openhandle {
+	struct fatfs_handle handle;	/* handle to open */
+	struct vnode	*vp;		/* vnode of the entry */
+};
+
+/*
+ * Argument of FATFS_IOC_USAGE
+ *
+ * Totals of everything below the directory of the ioctl. The subtree
+ * is read on the first query, later queries take the totals kept up
+ * to date in memory.
+ */
+struct fatfs_usage {
+	off_t		bytes;		/* total size of files */
+	size_t		files;		/* number of files */
+	size_t		dirs;		/* number of directories */
+	size_t		clusters;	/* clusters of file data */
+};
+
+#endif /* !_FATFS_IOCTL_H */
@@ -0,0 +1,396 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2026, The Unikraft Authors.
+ * Licensed under the BSD-3-Clause License (the "License").
+ * You may not use this file except in compliance with the License.
+ */
+
+#include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef CONFIG_LIBUKSCHED
+#include <pthread.h>
+#endif
+
+#include <uk/essentials.h>
+#include <uk/test.h>
+#include <fatfs/ioctl.h>
+
+/*
+ * The tests run on a FAT volume mounted from CONFIG_LIBFATFS_TEST_DEV.
+ * The volume is mounted again between writing and checking, so that
+ * what is checked is read back from the image, not from memory.
+ */
+#define TEST_DIR	CONFIG_LIBFATFS_TEST_PATH
+#define TEST_PATH(name)	TEST_DIR "/" name
+
+#define DATA_SIZE	20000		/* a few clusters, last one partial */
+#define SMALL_SIZE	100
+
+static char data[DATA_SIZE];
+
+static int
+test_mount(void)
+{
+	if (mount(CONFIG_LIBFATFS_TEST_DEV, TEST_DIR, "fatfs", 0, NULL))
+		return errno;
+	return 0;
+}
+
+static int
+test_remount(void)
+{
+	if (umount(TEST_DIR))
+		return errno;
+	return test_mount();
+}
+
+/*
+ * Write a file made of one byte value. Return 0 on success.
+ */
+static int
+write_file(const char *path, char c, size_t size)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return errno;
+	memset(data, c, size);
+	n = write(fd, data, size);
+	close(fd);
+	return (n == (ssize_t)size) ? 0 : EIO;
+}
+
+/*
+ * Check that a file has the given size and is made of one byte value.
+ * Return 1 if it is.
+ */
+static int
+check_file(const char *path, char c, size_t size)
+{
+	struct stat st;
+	size_t i;
+	ssize_t n;
+	int fd;
+
+	if (stat(path, &st) || st.st_size != (off_t)size)
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, data, sizeof(data));
+	close(fd);
+	if (n != (ssize_t)size)
+		return 0;
+	for (i = 0; i < size; i++) {
+		if (data[i] != c)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Count the entries of a directory with exactly this name.
+ */
+static int
+dir_count(const char *dir, const char *name)
+{
+	struct dirent *d;
+	DIR *dp;
+	int nr = 0;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return -1;
+	while ((d = readdir(dp)) != NULL) {
+		if (!strcmp(d->d_name, name))
+			nr++;
+	}
+	closedir(dp);
+	return nr;
+}
+
+/*
+ * Long names keep their case and characters on the image, and are
+ * found in any case.
+ */
+UK_TESTCASE(fatfs, lfn_roundtrip)
+{
+	static const char * const names[] = {
+		"A long file name.txt",
+		"Mixed.Case.Name",
+		"lower case name",
+	};
+	char path[256];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		strcpy(path, TEST_PATH(""));
+		strcat(path, names[i]);
+		UK_TEST_EXPECT_ZERO(write_file(path, 'a' + i, SMALL_SIZE));
+	}
+	UK_TEST_ASSERT(test_remount() == 0);
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		UK_TEST_EXPECT_SNUM_EQ(dir_count(TEST_DIR, names[i]), 1);
+		strcpy(path, TEST_PATH(""));
+		strcat(path, names[i]);
+		UK_TEST_EXPECT(check_file(path, 'a' + i, SMALL_SIZE));
+		UK_TEST_EXPECT_ZERO(unlink(path));
+	}
+	UK_TEST_EXPECT(check_file(TEST_PATH("a LONG file NAME.TXT"), 'a',
+				  SMALL_SIZE) == 0);
+}
+
+/*
+ * The clusters freed by O_TRUNC go to the next file created, while
+ * the truncated file is still open. Neither file gets the data of
+ * the other.
+ */
+UK_TESTCASE(fatfs, trunc_create)
+{
+	struct stat st1, st2;
+	char buf[SMALL_SIZE];
+	int fd, fd2;
+
+	UK_TEST_ASSERT(write_file(TEST_PATH("trunc_a"), 'a', DATA_SIZE) == 0);
+	fd = open(TEST_PATH("trunc_a"), O_RDWR);
+	UK_TEST_ASSERT(fd >= 0);
+	fd2 = open(TEST_PATH("trunc_a"), O_RDWR | O_TRUNC);
+	UK_TEST_EXPECT(fd2 >= 0);
+	close(fd2);
+
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("trunc_b"), 'b', DATA_SIZE));
+	UK_TEST_EXPECT_ZERO(fstat(fd, &st1));
+	UK_TEST_EXPECT_ZERO(stat(TEST_PATH("trunc_b"), &st2));
+	UK_TEST_EXPECT(st1.st_ino != st2.st_ino);
+
+	memset(buf, 'A', sizeof(buf));
+	UK_TEST_EXPECT_SNUM_EQ(pwrite(fd, buf, sizeof(buf), 0), sizeof(buf));
+	close(fd);
+
+	UK_TEST_ASSERT(test_remount() == 0);
+	UK_TEST_EXPECT(check_file(TEST_PATH("trunc_a"), 'A', SMALL_SIZE));
+	UK_TEST_EXPECT(check_file(TEST_PATH("trunc_b"), 'b', DATA_SIZE));
+	UK_TEST_EXPECT_ZERO(unlink(TEST_PATH("trunc_a")));
+	UK_TEST_EXPECT_ZERO(unlink(TEST_PATH("trunc_b")));
+}
+
+/*
+ * Rename over an open file and over an empty directory, and renames
+ * changing only the case of a name.
+ */
+UK_TESTCASE(fatfs, rename_over)
+{
+	char buf[SMALL_SIZE];
+	int fd;
+
+	UK_TEST_ASSERT(write_file(TEST_PATH("ren_src"), 's', DATA_SIZE) == 0);
+	UK_TEST_ASSERT(write_file(TEST_PATH("ren_dst"), 'd', DATA_SIZE) == 0);
+	fd = open(TEST_PATH("ren_dst"), O_RDWR);
+	UK_TEST_ASSERT(fd >= 0);
+	UK_TEST_EXPECT_ZERO(rename(TEST_PATH("ren_src"), TEST_PATH("ren_dst")));
+
+	/* The file replaced is gone, its clusters are not written */
+	memset(buf, 'x', sizeof(buf));
+	UK_TEST_EXPECT_SNUM_EQ(pwrite(fd, buf, sizeof(buf), 0), -1);
+	close(fd);
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("ren_new"), 'n', DATA_SIZE));
+
+	UK_TEST_EXPECT_ZERO(mkdir(TEST_PATH("ren_d1"), 0777));
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("ren_d1/f"), 'f', SMALL_SIZE));
+	UK_TEST_EXPECT_ZERO(mkdir(TEST_PATH("ren_d2"), 0777));
+	UK_TEST_EXPECT_ZERO(rename(TEST_PATH("ren_d1"), TEST_PATH("ren_d2")));
+
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("Case Only Name.txt"), 'c',
+				       SMALL_SIZE));
+	UK_TEST_EXPECT_ZERO(rename(TEST_PATH("Case Only Name.txt"),
+				   TEST_PATH("CASE ONLY NAME.TXT")));
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("readme.txt"), 'r',
+				       SMALL_SIZE));
+	UK_TEST_EXPECT_ZERO(rename(TEST_PATH("readme.txt"),
+				   TEST_PATH("README.TXT")));
+
+	UK_TEST_ASSERT(test_remount() == 0);
+	UK_TEST_EXPECT(check_file(TEST_PATH("ren_dst"), 's', DATA_SIZE));
+	UK_TEST_EXPECT(check_file(TEST_PATH("ren_new"), 'n', DATA_SIZE));
+	UK_TEST_EXPECT_SNUM_EQ(dir_count(TEST_DIR, "ren_src"), 0);
+	UK_TEST_EXPECT(check_file(TEST_PATH("ren_d2/f"), 'f', SMALL_SIZE));
+	UK_TEST_EXPECT_SNUM_EQ(dir_count(TEST_DIR, "ren_d1"), 0);
+	UK_TEST_EXPECT_SNUM_EQ(dir_count(TEST_DIR, "Case Only Name.txt"), 0);
+	UK_TEST_EXPECT_SNUM_EQ(dir_count(TEST_DIR, "CASE ONLY NAME.TXT"), 1);
+	UK_TEST_EXPECT(check_file(TEST_PATH("README.TXT"), 'r', SMALL_SIZE));
+	UK_TEST_EXPECT_SNUM_EQ(dir_count(TEST_DIR, "README.TXT"), 1);
+
+	unlink(TEST_PATH("ren_dst"));
+	unlink(TEST_PATH("ren_new"));
+	unlink(TEST_PATH("ren_d2/f"));
+	rmdir(TEST_PATH("ren_d2"));
+	unlink(TEST_PATH("CASE ONLY NAME.TXT"));
+	unlink(TEST_PATH("README.TXT"));
+}
+
+/*
+ * Get the usage of a directory with FATFS_IOC_USAGE.
+ */
+static int
+dir_usage(const char *dir, struct fatfs_usage *u)
+{
+	int fd, rc;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return errno;
+	rc = ioctl(fd, FATFS_IOC_USAGE, u);
+	close(fd);
+	return rc ? errno : 0;
+}
+
+/*
+ * A directory moved between a directory whose usage is kept and one
+ * whose usage is not known leaves the usage of both right.
+ */
+UK_TESTCASE(fatfs, usage_move)
+{
+	struct fatfs_usage u;
+	int fd;
+
+	UK_TEST_ASSERT(mkdir(TEST_PATH("use_t"), 0777) == 0);
+	UK_TEST_ASSERT(mkdir(TEST_PATH("use_u"), 0777) == 0);
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("use_t/a"), 'a', SMALL_SIZE));
+	UK_TEST_EXPECT_ZERO(mkdir(TEST_PATH("use_u/mv"), 0777));
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("use_u/mv/f"), 'f',
+				       SMALL_SIZE));
+
+	/* The usage of use_t is kept from now on, not the one of use_u */
+	UK_TEST_ASSERT(dir_usage(TEST_PATH("use_t"), &u) == 0);
+	UK_TEST_EXPECT_SNUM_EQ(u.files, 1);
+	UK_TEST_EXPECT_SNUM_EQ(u.dirs, 0);
+
+	/* In from the directory not counted */
+	UK_TEST_EXPECT_ZERO(rename(TEST_PATH("use_u/mv"),
+				   TEST_PATH("use_t/mv")));
+	UK_TEST_EXPECT_ZERO(dir_usage(TEST_PATH("use_t"), &u));
+	UK_TEST_EXPECT_SNUM_EQ(u.bytes, 2 * SMALL_SIZE);
+	UK_TEST_EXPECT_SNUM_EQ(u.files, 2);
+	UK_TEST_EXPECT_SNUM_EQ(u.dirs, 1);
+
+	/* Out to it, later changes below do not count any more */
+	UK_TEST_EXPECT_ZERO(rename(TEST_PATH("use_t/mv"),
+				   TEST_PATH("use_u/mv")));
+	fd = open(TEST_PATH("use_u/mv/f"), O_WRONLY | O_APPEND);
+	UK_TEST_EXPECT(fd >= 0);
+	UK_TEST_EXPECT_SNUM_EQ(write(fd, data, SMALL_SIZE), SMALL_SIZE);
+	close(fd);
+	UK_TEST_EXPECT_ZERO(write_file(TEST_PATH("use_u/mv/g"), 'g',
+				       SMALL_SIZE));
+	UK_TEST_EXPECT_ZERO(dir_usage(TEST_PATH("use_t"), &u));
+	UK_TEST_EXPECT_SNUM_EQ(u.bytes, SMALL_SIZE);
+	UK_TEST_EXPECT_SNUM_EQ(u.files, 1);
+	UK_TEST_EXPECT_SNUM_EQ(u.dirs, 0);
+
+	UK_TEST_EXPECT_ZERO(dir_usage(TEST_PATH("use_u"), &u));
+	UK_TEST_EXPECT_SNUM_EQ(u.bytes, 3 * SMALL_SIZE);
+	UK_TEST_EXPECT_SNUM_EQ(u.files, 2);
+	UK_TEST_EXPECT_SNUM_EQ(u.dirs, 1);
+
+	unlink(TEST_PATH("use_u/mv/f"));
+	unlink(TEST_PATH("use_u/mv/g"));
+	rmdir(TEST_PATH("use_u/mv"));
+	rmdir(TEST_PATH("use_u"));
+	unlink(TEST_PATH("use_t/a"));
+	rmdir(TEST_PATH("use_t"));
+}
+
+#ifdef CONFIG_LIBUKSCHED
+#define RACE_CHUNK	3000		/* not a multiple of the cluster */
+#define RACE_CHUNKS	64
+
+static volatile int race_done;
+
+static void *
+race_writer(void *arg)
+{
+	static char buf[RACE_CHUNK];
+	int fd = *(int *)arg;
+	off_t off = 0;
+	int i;
+
+	memset(buf, 'W', sizeof(buf));
+	for (i = 0; i < RACE_CHUNKS; i++, off += RACE_CHUNK)
+		pwrite(fd, buf, sizeof(buf), off);
+	/* Past the end, the gap reads as zeros */
+	pwrite(fd, buf, sizeof(buf), off + DATA_SIZE);
+	race_done = 1;
+	return NULL;
+}
+
+/*
+ * A reader concurrent with a writer extending the file sees its data
+ * or zeros, never the old contents of the clusters it is given.
+ */
+UK_TESTCASE(fatfs, read_extending)
+{
+	static char buf[RACE_CHUNK * RACE_CHUNKS * 2] __align(4096);
+	pthread_t thread;
+	ssize_t n, i;
+	int fd, rfd, bad = 0;
+
+	/* Leave free clusters holding data */
+	UK_TEST_ASSERT(write_file(TEST_PATH("race_old"), 'S', DATA_SIZE) == 0);
+	UK_TEST_EXPECT_ZERO(unlink(TEST_PATH("race_old")));
+
+	fd = open(TEST_PATH("race"), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	UK_TEST_ASSERT(fd >= 0);
+	rfd = open(TEST_PATH("race"), O_RDONLY);
+	UK_TEST_ASSERT(rfd >= 0);
+
+	race_done = 0;
+	UK_TEST_ASSERT(pthread_create(&thread, NULL, race_writer, &fd) == 0);
+	do {
+		n = pread(rfd, buf, sizeof(buf), 0);
+		for (i = 0; i < n; i++) {
+			if (buf[i] != 'W' && buf[i] != 0)
+				bad++;
+		}
+	} while (!race_done);
+	pthread_join(thread, NULL);
+	close(rfd);
+	close(fd);
+	UK_TEST_EXPECT_ZERO(bad);
+
+	UK_TEST_ASSERT(test_remount() == 0);
+	rfd = open(TEST_PATH("race"), O_RDONLY);
+	UK_TEST_ASSERT(rfd >= 0);
+	n = read(rfd, buf, sizeof(buf));
+	close(rfd);
+	UK_TEST_EXPECT_SNUM_EQ(n, RACE_CHUNK * (RACE_CHUNKS + 1) + DATA_SIZE);
+	for (i = 0; i < n; i++) {
+		if (i >= RACE_CHUNK * RACE_CHUNKS &&
+		    i < RACE_CHUNK * RACE_CHUNKS + DATA_SIZE ?
+		    buf[i] != 0 : buf[i] != 'W')
+			bad++;
+	}
+	UK_TEST_EXPECT_ZERO(bad);
+	UK_TEST_EXPECT_ZERO(unlink(TEST_PATH("race")));
+}
+#endif /* CONFIG_LIBUKSCHED */
+
+static int
+fatfs_test_init(struct uk_testsuite *suite __unused)
+{
+	if (mkdir(TEST_DIR, 0777) && errno != EEXIST)
+		return -errno;
+	return -test_mount();
+}
+
+uk_testsuite_register(fatfs, fatfs_test_init);